@@ -0,0 +1,793 @@
+/*
+ *
+ * bvh.c - a bounding volume hierarchy over the triangles of the current 3D scene, which lets rays
+ *         find the triangles they hit without testing every triangle
+ *
+ * The hierarchy is split with a binned surface area heuristic. Its top levels are split on one thread
+ * and the subtrees below them are built in parallel, each into its own node list, and then joined.
+ */
+#include "bvh.h"
+#include "mesh.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
+#define MAX(X, Y) (((X) > (Y)) ? (X) : (Y))
+
+// The number of bins that triangle centers are sorted into along each axis when looking for a split
+#define BVH_BINS 16
+// Nodes with this many triangles or fewer are always leaves, and nodes with more than BVH_MAX_LEAF are always split
+#define BVH_MIN_SPLIT 2
+#define BVH_MAX_LEAF 8
+// The cost of visiting a node relative to testing a triangle
+#define BVH_TRAVERSAL_COST 1.0
+// Nodes this deep are always leaves, which bounds the stack needed to trace a ray
+#define BVH_MAX_DEPTH 64
+// The number of subtrees built in parallel per thread, so that uneven subtrees even out
+#define BVH_TASKS_PER_THREAD 4
+
+// The start of a cached hierarchy file
+#define BVH_MAGIC "STLBVH1"
+
+/*
+ * Box
+ *
+ * Struct holding an axis-aligned box
+ * Members:
+ *  -min, max: the smallest and largest corner of the box
+ */
+typedef struct {
+	float min[3];
+	float max[3];
+} Box;
+
+/*
+ * RangeBounds
+ *
+ * Struct holding the bounds of a range of triangles
+ * Members:
+ *  -box: a box containing the triangles
+ *  -center_min, center_max: a box containing the centers of the boxes of the triangles
+ *  -count: the number of triangles
+ */
+typedef struct {
+	Box box;
+	double center_min[3];
+	double center_max[3];
+	uint32_t count;
+} RangeBounds;
+
+/*
+ * BuildTask
+ *
+ * Struct describing a subtree that is built on a worker thread
+ * Members:
+ *  -node: the index of the root of the subtree in the top of the hierarchy
+ *  -first: the start of the range of the triangle order holding the triangles of the subtree
+ *  -bounds: the bounds of those triangles
+ *  -depth: the depth of the root of the subtree
+ *  -num_nodes, nodes_size, nodes: the nodes of the subtree, the first of which is its root
+ */
+typedef struct {
+	uint32_t node;
+	uint32_t first;
+	RangeBounds bounds;
+	int32_t depth;
+	int64_t num_nodes;
+	int64_t nodes_size;
+	BvhNode* nodes;
+} BuildTask;
+
+/*
+ * Builder
+ *
+ * Struct holding the state shared by the threads building a hierarchy
+ * Members:
+ *  -boxes: the bounds of each triangle, in the same order as order
+ *  -order: the indices of the triangles, which are partitioned as the hierarchy is split
+ *  -top: the top of the hierarchy, which is split on the calling thread
+ *  -task_depth: the depth at which subtrees are left to be built in parallel
+ *  -num_tasks, tasks: the subtrees left to be built in parallel
+ *  -next_task: the index of the next subtree for a worker to build
+ */
+typedef struct {
+	Box* boxes;
+	uint32_t* order;
+	BuildTask* top;
+	int32_t task_depth;
+	int32_t num_tasks;
+	BuildTask* tasks;
+	int32_t next_task;
+} Builder;
+
+/*
+ * BvhHeader
+ *
+ * Struct written at the start of a cached hierarchy file
+ * Members:
+ *  -magic: BVH_MAGIC
+ *  -file_size, file_mtime: the size and modification time of the STL file when the hierarchy was built
+ *  -scale: the maximum radius that the object was normalized to
+ *  -vertex_format: the format the vertices were stored in, which changes their positions slightly
+ *  -num_triangles, num_nodes: the number of triangles and nodes that follow the header
+ */
+typedef struct {
+	char magic[8];
+	int64_t file_size;
+	int64_t file_mtime;
+	double scale;
+	int32_t vertex_format;
+	int32_t reserved;
+	int64_t num_triangles;
+	int64_t num_nodes;
+} BvhHeader;
+
+/*
+ * round_down, round_up
+ *
+ * INPUTS: x: a double
+ * RETURN VALUE: the largest float that is no more than x, or the smallest float that is no less than x
+ * SIDE EFFECTS: none
+ */
+static float round_down(double x) {
+	float f = (float)x;
+	return ((double)f > x) ? nextafterf(f, -INFINITY) : f;
+}
+
+static float round_up(double x) {
+	float f = (float)x;
+	return ((double)f < x) ? nextafterf(f, INFINITY) : f;
+}
+
+/*
+ * empty_box
+ *
+ * RETURN VALUE: a box that contains nothing, which grow_box can extend
+ * SIDE EFFECTS: none
+ */
+static Box empty_box() {
+	Box b = {{INFINITY, INFINITY, INFINITY}, {-INFINITY, -INFINITY, -INFINITY}};
+	return b;
+}
+
+/*
+ * grow_box
+ *
+ * INPUTS: box: the box to grow
+ *         other: the box to include in it
+ * SIDE EFFECTS: extends box to contain other
+ */
+static void grow_box(Box* box, Box* other) {
+	int32_t k;
+	for (k = 0; k < 3; k++) {
+		box->min[k] = MIN(box->min[k], other->min[k]);
+		box->max[k] = MAX(box->max[k], other->max[k]);
+	}
+}
+
+/*
+ * box_area
+ *
+ * INPUTS: box: a box
+ * RETURN VALUE: the surface area of the box, or 0 if it is empty
+ * SIDE EFFECTS: none
+ */
+static double box_area(Box* box) {
+	double dx = (double)box->max[0] - box->min[0];
+	double dy = (double)box->max[1] - box->min[1];
+	double dz = (double)box->max[2] - box->min[2];
+	if (dx < 0 || dy < 0 || dz < 0) {
+		return 0;
+	}
+	return 2 * (dx * dy + dy * dz + dz * dx);
+}
+
+/*
+ * add_nodes
+ *
+ * INPUTS: task: the subtree to add to
+ *         n: the number of nodes to add
+ * RETURN VALUE: the index of the first added node
+ * SIDE EFFECTS: grows the node list of the subtree if needed
+ */
+static int64_t add_nodes(BuildTask* task, int32_t n) {
+	while (task->num_nodes + n > task->nodes_size) {
+		task->nodes = dynamic_resize(task->nodes, &task->nodes_size, sizeof(BvhNode));
+	}
+	task->num_nodes += n;
+	return task->num_nodes - n;
+}
+
+/*
+ * empty_bounds
+ *
+ * RETURN VALUE: the bounds of no triangles, which add_bounds can extend
+ * SIDE EFFECTS: none
+ */
+static RangeBounds empty_bounds() {
+	RangeBounds r = {{{INFINITY, INFINITY, INFINITY}, {-INFINITY, -INFINITY, -INFINITY}},
+	                 {INFINITY, INFINITY, INFINITY}, {-INFINITY, -INFINITY, -INFINITY}, 0};
+	return r;
+}
+
+/*
+ * add_bounds
+ *
+ * INPUTS: r: the bounds to extend
+ *         other: the bounds to include in them
+ * SIDE EFFECTS: extends r to cover the triangles of other as well
+ */
+static void add_bounds(RangeBounds* r, RangeBounds* other) {
+	int32_t k;
+	for (k = 0; k < 3; k++) {
+		r->box.min[k] = MIN(r->box.min[k], other->box.min[k]);
+		r->box.max[k] = MAX(r->box.max[k], other->box.max[k]);
+		r->center_min[k] = MIN(r->center_min[k], other->center_min[k]);
+		r->center_max[k] = MAX(r->center_max[k], other->center_max[k]);
+	}
+	r->count += other->count;
+}
+
+/*
+ * measure_range
+ *
+ * INPUTS: b: the state shared by the threads building the hierarchy
+ *         first, count: a range of the triangle order
+ * RETURN VALUE: the bounds of the triangles in the range
+ * SIDE EFFECTS: none
+ */
+static RangeBounds measure_range(Builder* b, uint32_t first, uint32_t count) {
+	RangeBounds r = empty_bounds();
+	uint32_t i;
+	int32_t k;
+	for (i = first; i < first + count; i++) {
+		Box* box = &b->boxes[i];
+		for (k = 0; k < 3; k++) {
+			r.box.min[k] = MIN(r.box.min[k], box->min[k]);
+			r.box.max[k] = MAX(r.box.max[k], box->max[k]);
+			double center = 0.5 * ((double)box->min[k] + box->max[k]);
+			r.center_min[k] = MIN(r.center_min[k], center);
+			r.center_max[k] = MAX(r.center_max[k], center);
+		}
+	}
+	r.count = count;
+	return r;
+}
+
+/*
+ * build_node
+ *
+ * INPUTS: b: the state shared by the threads building the hierarchy
+ *         task: the subtree that the node belongs to
+ *         node: the index of the node in the subtree, which has been added already
+ *         first: the start of the range of the triangle order holding the triangles below the node
+ *         bounds: the bounds of those triangles
+ *         depth: the depth of the node
+ * SIDE EFFECTS: splits the node until its leaves are cheaper to test than to split further, partitioning
+ *               its range of the triangle order, or leaves it to be built in parallel at the task depth
+ *
+ * The bounds of the children are collected while the triangles are binned, so each level of the hierarchy
+ * only reads the triangles twice: once to bin them and once to partition them.
+ */
+static void build_node(Builder* b, BuildTask* task, int64_t node, uint32_t first, RangeBounds* bounds, int32_t depth) {
+	uint32_t count = bounds->count;
+	memcpy(task->nodes[node].min, bounds->box.min, sizeof(bounds->box.min));
+	memcpy(task->nodes[node].max, bounds->box.max, sizeof(bounds->box.max));
+	task->nodes[node].first = first;
+	task->nodes[node].count = count;
+	if (count <= BVH_MIN_SPLIT || depth >= BVH_MAX_DEPTH) {
+		return;
+	}
+	if (task == b->top && depth == b->task_depth && count > BVH_MAX_LEAF) {
+		// The subtree is left for a worker; its root stays a placeholder until the subtrees are joined
+		b->tasks[b->num_tasks++] = (BuildTask){(uint32_t)node, first, *bounds, depth, 0, 0, NULL};
+		task->nodes[node].count = 0;
+		return;
+	}
+
+	// Sort the centers into bins along the axis they are most spread out on, and find the cheapest split between two bins
+	int32_t axis = 0;
+	int32_t k;
+	for (k = 1; k < 3; k++) {
+		if (bounds->center_max[k] - bounds->center_min[k] > bounds->center_max[axis] - bounds->center_min[axis]) {
+			axis = k;
+		}
+	}
+	double min = bounds->center_min[axis];
+	double extent = bounds->center_max[axis] - min;
+	double factor = (extent > 0) ? BVH_BINS * 0.99999 / extent : 0;
+	double best_cost = INFINITY;
+	int32_t best_split = 0;
+	RangeBounds left, right;
+	if (factor > 0) {
+		RangeBounds bins[BVH_BINS];
+		int32_t bin;
+		for (bin = 0; bin < BVH_BINS; bin++) {
+			bins[bin] = empty_bounds();
+		}
+		// The loop is written out rather than calling add_bounds, since it dominates the build
+		uint32_t i;
+		for (i = first; i < first + count; i++) {
+			Box* box = &b->boxes[i];
+			bin = (int32_t)((0.5 * ((double)box->min[axis] + box->max[axis]) - min) * factor);
+			bin = MAX(0, MIN(BVH_BINS - 1, bin));
+			RangeBounds* r = &bins[bin];
+			for (k = 0; k < 3; k++) {
+				r->box.min[k] = MIN(r->box.min[k], box->min[k]);
+				r->box.max[k] = MAX(r->box.max[k], box->max[k]);
+				double center = 0.5 * ((double)box->min[k] + box->max[k]);
+				r->center_min[k] = MIN(r->center_min[k], center);
+				r->center_max[k] = MAX(r->center_max[k], center);
+			}
+			r->count++;
+		}
+
+		// right_areas[s] and right_counts[s] cover the bins from s to the last one
+		double right_areas[BVH_BINS];
+		uint32_t right_counts[BVH_BINS];
+		Box box = empty_box();
+		uint32_t box_count = 0;
+		int32_t s;
+		for (s = BVH_BINS - 1; s > 0; s--) {
+			grow_box(&box, &bins[s].box);
+			box_count += bins[s].count;
+			right_areas[s] = box_area(&box);
+			right_counts[s] = box_count;
+		}
+		double parent_area = box_area(&bounds->box);
+		box = empty_box();
+		box_count = 0;
+		for (s = 1; s < BVH_BINS; s++) {
+			grow_box(&box, &bins[s - 1].box);
+			box_count += bins[s - 1].count;
+			if (box_count == 0 || right_counts[s] == 0) {
+				continue;
+			}
+			double cost = BVH_TRAVERSAL_COST + (box_area(&box) * box_count + right_areas[s] * right_counts[s]) / parent_area;
+			if (cost < best_cost) {
+				best_cost = cost;
+				best_split = s;
+			}
+		}
+
+		left = empty_bounds();
+		right = empty_bounds();
+		for (bin = 0; bin < BVH_BINS; bin++) {
+			add_bounds((bin < best_split) ? &left : &right, &bins[bin]);
+		}
+	}
+	if (count <= BVH_MAX_LEAF && (best_split == 0 || best_cost >= count)) {
+		return;
+	}
+
+	if (best_split > 0) {
+		// Move the triangles whose centers fall left of the split to the start of the range
+		uint32_t lo = first, hi = first + count;
+		while (lo < hi) {
+			Box* box = &b->boxes[lo];
+			int32_t bin = (int32_t)((0.5 * ((double)box->min[axis] + box->max[axis]) - min) * factor);
+			if (bin < best_split) {
+				lo++;
+			} else {
+				hi--;
+				Box swap = b->boxes[lo];
+				b->boxes[lo] = b->boxes[hi];
+				b->boxes[hi] = swap;
+				uint32_t index = b->order[lo];
+				b->order[lo] = b->order[hi];
+				b->order[hi] = index;
+			}
+		}
+	} else {
+		// Every center is in the same place, so the range is split in half
+		left = measure_range(b, first, count / 2);
+		right = measure_range(b, first + count / 2, count - count / 2);
+	}
+
+	int64_t children = add_nodes(task, 2);
+	task->nodes[node].first = (uint32_t)children;
+	task->nodes[node].count = 0;
+	build_node(b, task, children, first, &left, depth + 1);
+	build_node(b, task, children + 1, first + left.count, &right, depth + 1);
+}
+
+/*
+ * build_worker
+ *
+ * INPUTS: arg: the Builder to work for
+ * RETURN VALUE: NULL
+ * SIDE EFFECTS: builds subtrees until there are none left
+ */
+static void* build_worker(void* arg) {
+	Builder* b = arg;
+	int32_t t;
+	while ((t = __atomic_fetch_add(&b->next_task, 1, __ATOMIC_RELAXED)) < b->num_tasks) {
+		BuildTask* task = &b->tasks[t];
+		add_nodes(task, 1);
+		build_node(b, task, 0, task->first, &task->bounds, task->depth);
+	}
+	return NULL;
+}
+
+/*
+ * build_bvh
+ *
+ * INPUTS: num_triangles: the number of triangles in the scene
+ *         threads: the number of threads to build with
+ * OUTPUTS: bvh: a hierarchy over the triangles of the scene, split with the surface area heuristic
+ * RETURN VALUE: none
+ * SIDE EFFECTS: allocates the nodes and triangle order of bvh
+ *
+ * The top of the hierarchy is split on the calling thread, and the subtrees below it are built in parallel.
+ */
+void build_bvh(int64_t num_triangles, int32_t threads, Bvh* bvh) {
+	bvh->num_triangles = num_triangles;
+	bvh->order = malloc(num_triangles * sizeof(uint32_t));
+	if (num_triangles == 0) {
+		bvh->num_nodes = 0;
+		bvh->nodes = NULL;
+		return;
+	}
+
+	Builder b;
+	b.boxes = malloc(num_triangles * sizeof(Box));
+	b.order = bvh->order;
+	STATS_COUNT(COUNTER_BYTES_ALLOCATED, num_triangles * (sizeof(uint32_t) + sizeof(Box)));
+	int64_t i;
+	int32_t j, k;
+	for (i = 0; i < num_triangles; i++) {
+		double min[3] = {INFINITY, INFINITY, INFINITY};
+		double max[3] = {-INFINITY, -INFINITY, -INFINITY};
+		for (j = 0; j < 3; j++) {
+			Vector v = get_vertex(triangles[i].vertices[j]);
+			double c[3] = {v.x, v.y, v.z};
+			for (k = 0; k < 3; k++) {
+				min[k] = MIN(min[k], c[k]);
+				max[k] = MAX(max[k], c[k]);
+			}
+		}
+		for (k = 0; k < 3; k++) {
+			b.boxes[i].min[k] = round_down(min[k]);
+			b.boxes[i].max[k] = round_up(max[k]);
+		}
+		b.order[i] = (uint32_t)i;
+	}
+
+	// Split the top of the hierarchy until there are enough subtrees to keep every thread busy
+	int32_t max_tasks = BVH_TASKS_PER_THREAD * threads;
+	b.task_depth = 0;
+	while ((1 << b.task_depth) < max_tasks) {
+		b.task_depth++;
+	}
+	BuildTask top = {0, 0, measure_range(&b, 0, (uint32_t)num_triangles), 0, 0, 0, NULL};
+	b.top = &top;
+	b.tasks = malloc((1 << b.task_depth) * sizeof(BuildTask));
+	b.num_tasks = 0;
+	b.next_task = 0;
+	add_nodes(&top, 1);
+	build_node(&b, &top, 0, 0, &top.bounds, 0);
+
+	pthread_t* workers = malloc(threads * sizeof(pthread_t));
+	int32_t t;
+	for (t = 0; t < threads; t++) {
+		pthread_create(&workers[t], NULL, build_worker, &b);
+	}
+	for (t = 0; t < threads; t++) {
+		pthread_join(workers[t], NULL);
+	}
+	free(workers);
+
+	// Join the subtrees to the top: the root of each replaces its placeholder, and the rest follow the top
+	bvh->num_nodes = top.num_nodes;
+	for (t = 0; t < b.num_tasks; t++) {
+		bvh->num_nodes += b.tasks[t].num_nodes - 1;
+	}
+	bvh->nodes = malloc(bvh->num_nodes * sizeof(BvhNode));
+	STATS_COUNT(COUNTER_BYTES_ALLOCATED, bvh->num_nodes * sizeof(BvhNode));
+	memcpy(bvh->nodes, top.nodes, top.num_nodes * sizeof(BvhNode));
+	int64_t base = top.num_nodes;
+	for (t = 0; t < b.num_tasks; t++) {
+		BuildTask* task = &b.tasks[t];
+		for (i = 0; i < task->num_nodes; i++) {
+			BvhNode n = task->nodes[i];
+			if (n.count == 0) {
+				n.first = (uint32_t)(base + n.first - 1);
+			}
+			bvh->nodes[(i == 0) ? task->node : base + i - 1] = n;
+		}
+		base += task->num_nodes - 1;
+		free(task->nodes);
+	}
+
+	free(top.nodes);
+	free(b.tasks);
+	free(b.boxes);
+}
+
+/*
+ * bvh_path
+ *
+ * INPUTS: file: the STL file path
+ *         suffix: the text to put after the file name
+ * RETURN VALUE: the path of the file with the suffix, which must be freed
+ * SIDE EFFECTS: allocates the path
+ */
+static char* bvh_path(char* file, char* suffix) {
+	char* path = malloc(strlen(file) + strlen(suffix) + 1);
+	strcpy(path, file);
+	strcat(path, suffix);
+	return path;
+}
+
+/*
+ * open_cached
+ *
+ * INPUTS: file, scale, num_triangles: as for load_bvh, except that a negative num_triangles matches any number
+ * OUTPUTS: header: the header of the cached hierarchy
+ * RETURN VALUE: the cached hierarchy file positioned after its header if it matches, NULL otherwise
+ * SIDE EFFECTS: opens the cached hierarchy file
+ */
+static FILE* open_cached(char* file, double scale, int64_t num_triangles, BvhHeader* header) {
+	struct stat st;
+	if (stat(file, &st) != 0) {
+		return NULL;
+	}
+	char* path = bvh_path(file, ".bvh");
+	FILE* fp = fopen(path, "rb");
+	free(path);
+	if (fp == NULL) {
+		return NULL;
+	}
+	if (fread(header, sizeof(BvhHeader), 1, fp) != 1 || memcmp(header->magic, BVH_MAGIC, sizeof(BVH_MAGIC)) != 0 ||
+	    header->file_size != (int64_t)st.st_size || header->file_mtime != (int64_t)st.st_mtime || header->scale != scale ||
+	    header->vertex_format != (int32_t)vertex_format || (num_triangles >= 0 && header->num_triangles != num_triangles)) {
+		fclose(fp);
+		return NULL;
+	}
+	return fp;
+}
+
+/*
+ * bvh_cached
+ *
+ * INPUTS: file, scale, num_triangles: as for load_bvh
+ * RETURN VALUE: 1 if load_bvh would find a hierarchy for the file, 0 otherwise
+ * SIDE EFFECTS: none
+ */
+int32_t bvh_cached(char* file, double scale, int64_t num_triangles) {
+	BvhHeader header;
+	FILE* fp = open_cached(file, scale, num_triangles, &header);
+	if (fp == NULL) {
+		return 0;
+	}
+	fclose(fp);
+	return 1;
+}
+
+/*
+ * cached_bvh_triangles
+ *
+ * INPUTS: file, scale: as for load_bvh
+ * RETURN VALUE: the number of triangles that the hierarchy cached for the file was built for, or -1 if there is none
+ *               for the current contents of the file, the same scale and the same vertex format
+ * SIDE EFFECTS: none
+ */
+int64_t cached_bvh_triangles(char* file, double scale) {
+	BvhHeader header;
+	FILE* fp = open_cached(file, scale, -1, &header);
+	if (fp == NULL) {
+		return -1;
+	}
+	fclose(fp);
+	return header.num_triangles;
+}
+
+/*
+ * load_bvh
+ *
+ * INPUTS: file: the STL file that the scene was loaded from
+ *         scale: the maximum radius that the object was normalized to
+ *         num_triangles: the number of triangles in the scene
+ * OUTPUTS: bvh: the hierarchy cached for the file, if there is one
+ * RETURN VALUE: 1 if the hierarchy cached in <file>.bvh was built for the current contents of the file,
+ *               the same scale and vertex format, and the same number of triangles, 0 otherwise
+ * SIDE EFFECTS: allocates the nodes and triangle order of bvh if it returns 1
+ */
+int32_t load_bvh(char* file, double scale, int64_t num_triangles, Bvh* bvh) {
+	BvhHeader header;
+	FILE* fp = open_cached(file, scale, num_triangles, &header);
+	if (fp == NULL) {
+		return 0;
+	}
+	bvh->num_nodes = header.num_nodes;
+	bvh->num_triangles = num_triangles;
+	bvh->nodes = malloc(header.num_nodes * sizeof(BvhNode));
+	bvh->order = malloc(num_triangles * sizeof(uint32_t));
+	STATS_COUNT(COUNTER_BYTES_ALLOCATED, header.num_nodes * sizeof(BvhNode) + num_triangles * sizeof(uint32_t));
+	int32_t loaded = fread(bvh->nodes, sizeof(BvhNode), header.num_nodes, fp) == (size_t)header.num_nodes &&
+	                 fread(bvh->order, sizeof(uint32_t), num_triangles, fp) == (size_t)num_triangles;
+	fclose(fp);
+	if (!loaded) {
+		free_bvh(bvh);
+	}
+	return loaded;
+}
+
+/*
+ * save_bvh
+ *
+ * INPUTS: file: the STL file that the scene was loaded from
+ *         scale: the maximum radius that the object was normalized to
+ *         bvh: the hierarchy to save
+ * OUTPUTS: none
+ * RETURN VALUE: none
+ * SIDE EFFECTS: writes the hierarchy to <file>.bvh under a temporary name and renames it into place,
+ *               if it can be written
+ */
+void save_bvh(char* file, double scale, Bvh* bvh) {
+	struct stat st;
+	if (stat(file, &st) != 0) {
+		return;
+	}
+	BvhHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, BVH_MAGIC, sizeof(BVH_MAGIC));
+	header.file_size = st.st_size;
+	header.file_mtime = st.st_mtime;
+	header.scale = scale;
+	header.vertex_format = vertex_format;
+	header.num_triangles = bvh->num_triangles;
+	header.num_nodes = bvh->num_nodes;
+
+	char suffix[32];
+	sprintf(suffix, ".bvh.%ld.tmp", (long)getpid());
+	char* temp_path = bvh_path(file, suffix);
+	char* path = bvh_path(file, ".bvh");
+	FILE* fp = fopen(temp_path, "wb");
+	if (fp != NULL) {
+		int32_t written = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+		                  fwrite(bvh->nodes, sizeof(BvhNode), bvh->num_nodes, fp) == (size_t)bvh->num_nodes &&
+		                  fwrite(bvh->order, sizeof(uint32_t), bvh->num_triangles, fp) == (size_t)bvh->num_triangles;
+		written &= (fclose(fp) == 0);
+		if (!written || rename(temp_path, path) != 0) {
+			unlink(temp_path);
+		}
+	}
+	free(path);
+	free(temp_path);
+}
+
+/*
+ * free_bvh
+ *
+ * INPUTS: bvh: a hierarchy returned by build_bvh or load_bvh
+ * OUTPUTS: none
+ * RETURN VALUE: none
+ * SIDE EFFECTS: frees the nodes and triangle order of bvh
+ */
+void free_bvh(Bvh* bvh) {
+	free(bvh->nodes);
+	free(bvh->order);
+	bvh->nodes = NULL;
+	bvh->order = NULL;
+}
+
+/*
+ * packet_hits_box
+ *
+ * INPUTS: node: a node of the hierarchy
+ *         packet: a packet of rays
+ *         inverse: the reciprocal of each component of the direction of each ray
+ * RETURN VALUE: 1 if any ray of the packet enters the box of the node before its nearest hit so far, 0 otherwise
+ * SIDE EFFECTS: none
+ */
+static int32_t packet_hits_box(BvhNode* node, RayPacket* packet, double (*inverse)[3]) {
+	double origin[3] = {packet->origin.x, packet->origin.y, packet->origin.z};
+	int32_t r, k;
+	for (r = 0; r < packet->count; r++) {
+		double near = 0;
+		double far = packet->t[r];
+		for (k = 0; k < 3; k++) {
+			double t0 = (node->min[k] - origin[k]) * inverse[r][k];
+			double t1 = (node->max[k] - origin[k]) * inverse[r][k];
+			near = MAX(near, MIN(t0, t1));
+			far = MIN(far, MAX(t0, t1));
+		}
+		if (near <= far) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * trace_packet
+ *
+ * INPUTS: bvh: a hierarchy over the triangles of the scene
+ *         packet: a packet of rays whose t have been set to the farthest distance to look at
+ *         cull_backfaces: nonzero if triangles whose front faces away from the origin of the rays should be ignored
+ * OUTPUTS: packet: t and triangle set to the nearest hit of each ray
+ * RETURN VALUE: the number of nodes visited
+ * SIDE EFFECTS: none
+ */
+uint64_t trace_packet(Bvh* bvh, RayPacket* packet, int32_t cull_backfaces) {
+	if (bvh->num_nodes == 0) {
+		return 0;
+	}
+	double inverse[RAY_PACKET_SIZE][3];
+	int32_t r;
+	for (r = 0; r < packet->count; r++) {
+		inverse[r][0] = 1.0 / packet->directions[r].x;
+		inverse[r][1] = 1.0 / packet->directions[r].y;
+		inverse[r][2] = 1.0 / packet->directions[r].z;
+	}
+
+	uint64_t visited = 0;
+	uint32_t stack[2 * BVH_MAX_DEPTH + 2];
+	int32_t top = 0;
+	stack[top++] = 0;
+	while (top > 0) {
+		BvhNode* node = &bvh->nodes[stack[--top]];
+		visited++;
+		if (!packet_hits_box(node, packet, inverse)) {
+			continue;
+		}
+		if (node->count == 0) {
+			// Visit the child whose center is nearer along the first ray first, so farther hits are cut off sooner
+			BvhNode* left = &bvh->nodes[node->first];
+			BvhNode* right = left + 1;
+			Vector d = packet->directions[0];
+			double left_along = (left->min[0] + left->max[0]) * d.x + (left->min[1] + left->max[1]) * d.y +
+			                    (left->min[2] + left->max[2]) * d.z;
+			double right_along = (right->min[0] + right->max[0]) * d.x + (right->min[1] + right->max[1]) * d.y +
+			                     (right->min[2] + right->max[2]) * d.z;
+			int32_t near_first = (left_along <= right_along);
+			stack[top++] = node->first + near_first;
+			stack[top++] = node->first + !near_first;
+			continue;
+		}
+
+		uint32_t i;
+		for (i = node->first; i < node->first + node->count; i++) {
+			uint32_t index = bvh->order[i];
+			Vector v0 = get_vertex(triangles[index].vertices[0]);
+			Vector e1 = add_vec(get_vertex(triangles[index].vertices[1]), neg_vec(v0));
+			Vector e2 = add_vec(get_vertex(triangles[index].vertices[2]), neg_vec(v0));
+			Vector to_origin = add_vec(packet->origin, neg_vec(v0));
+			// The same test as backface_culled, since every ray leaves the camera
+			if (cull_backfaces && dot(cross(e1, e2), neg_vec(to_origin)) > 0) {
+				continue;
+			}
+			Vector q = cross(to_origin, e1);
+			// Moller-Trumbore intersection of each ray with the triangle
+			for (r = 0; r < packet->count; r++) {
+				Vector p = cross(packet->directions[r], e2);
+				double det = dot(e1, p);
+				if (det == 0) {
+					continue;
+				}
+				double inv_det = 1 / det;
+				double u = dot(to_origin, p) * inv_det;
+				if (u < 0 || u > 1) {
+					continue;
+				}
+				double v = dot(packet->directions[r], q) * inv_det;
+				if (v < 0 || u + v > 1) {
+					continue;
+				}
+				double t = dot(e2, q) * inv_det;
+				if (t > 0 && t < packet->t[r]) {
+					packet->t[r] = t;
+					packet->triangle[r] = index;
+				}
+			}
+		}
+	}
+	return visited;
+}
@@ -0,0 +1,142 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <stdint.h>
+#include "vector.h"
+
+// The number of rays traced together through the hierarchy, as a square of pixels
+#define RAY_PACKET_SIDE 4
+#define RAY_PACKET_SIZE (RAY_PACKET_SIDE * RAY_PACKET_SIDE)
+
+/*
+ * BvhNode
+ *
+ * Struct representing a node of a bounding volume hierarchy over the triangles of the scene
+ * Members:
+ *  -min, max: a box containing every triangle below the node, rounded outwards to floats
+ *  -first: the index in the triangle order of the first triangle of a leaf, or the index of the
+ *          first of the two children of an inner node (the second one follows it)
+ *  -count: the number of triangles in a leaf, or 0 for an inner node
+ */
+typedef struct {
+	float min[3];
+	float max[3];
+	uint32_t first;
+	uint32_t count;
+} BvhNode;
+
+/*
+ * Bvh
+ *
+ * Struct holding a bounding volume hierarchy over the triangles of the scene
+ * Members:
+ *  -num_nodes, nodes: the nodes of the hierarchy, the first of which is the root
+ *  -num_triangles, order: the indices of the triangles in the triangle list, grouped by leaf
+ */
+typedef struct {
+	int64_t num_nodes;
+	BvhNode* nodes;
+	int64_t num_triangles;
+	uint32_t* order;
+} Bvh;
+
+/*
+ * RayPacket
+ *
+ * Struct holding a packet of rays that leave the same point and are traced together
+ * Members:
+ *  -origin: the point that the rays leave from
+ *  -count: the number of rays in the packet
+ *  -directions: the direction of each ray, which need not be normalized
+ *  -t: the distance along each ray, in multiples of its direction, to the nearest hit so far
+ *  -triangle: the index in the triangle list of the nearest triangle hit by each ray, or -1
+ */
+typedef struct {
+	Vector origin;
+	int32_t count;
+	Vector directions[RAY_PACKET_SIZE];
+	double t[RAY_PACKET_SIZE];
+	int64_t triangle[RAY_PACKET_SIZE];
+} RayPacket;
+
+/*
+ * build_bvh
+ *
+ * INPUTS: num_triangles: the number of triangles in the scene
+ *         threads: the number of threads to build with
+ * OUTPUTS: bvh: a hierarchy over the triangles of the scene, split with the surface area heuristic
+ * RETURN VALUE: none
+ * SIDE EFFECTS: allocates the nodes and triangle order of bvh
+ *
+ * The top of the hierarchy is split on the calling thread, and the subtrees below it are built in parallel.
+ */
+extern void build_bvh(int64_t num_triangles, int32_t threads, Bvh* bvh);
+
+/*
+ * load_bvh
+ *
+ * INPUTS: file: the STL file that the scene was loaded from
+ *         scale: the maximum radius that the object was normalized to
+ *         num_triangles: the number of triangles in the scene
+ * OUTPUTS: bvh: the hierarchy cached for the file, if there is one
+ * RETURN VALUE: 1 if the hierarchy cached in <file>.bvh was built for the current contents of the file,
+ *               the same scale and vertex format, and the same number of triangles, 0 otherwise
+ * SIDE EFFECTS: allocates the nodes and triangle order of bvh if it returns 1
+ */
+extern int32_t load_bvh(char* file, double scale, int64_t num_triangles, Bvh* bvh);
+
+/*
+ * bvh_cached
+ *
+ * INPUTS: file, scale, num_triangles: as for load_bvh
+ * RETURN VALUE: 1 if load_bvh would find a hierarchy for the file, 0 otherwise
+ * SIDE EFFECTS: none
+ */
+extern int32_t bvh_cached(char* file, double scale, int64_t num_triangles);
+
+/*
+ * cached_bvh_triangles
+ *
+ * INPUTS: file, scale: as for load_bvh
+ * RETURN VALUE: the number of triangles that the hierarchy cached for the file was built for, or -1 if there is none
+ *               for the current contents of the file, the same scale and the same vertex format
+ * SIDE EFFECTS: none
+ */
+extern int64_t cached_bvh_triangles(char* file, double scale);
+
+/*
+ * save_bvh
+ *
+ * INPUTS: file: the STL file that the scene was loaded from
+ *         scale: the maximum radius that the object was normalized to
+ *         bvh: the hierarchy to save
+ * OUTPUTS: none
+ * RETURN VALUE: none
+ * SIDE EFFECTS: writes the hierarchy to <file>.bvh under a temporary name and renames it into place,
+ *               if it can be written
+ */
+extern void save_bvh(char* file, double scale, Bvh* bvh);
+
+/*
+ * free_bvh
+ *
+ * INPUTS: bvh: a hierarchy returned by build_bvh or load_bvh
+ * OUTPUTS: none
+ * RETURN VALUE: none
+ * SIDE EFFECTS: frees the nodes and triangle order of bvh
+ */
+extern void free_bvh(Bvh* bvh);
+
+/*
+ * trace_packet
+ *
+ * INPUTS: bvh: a hierarchy over the triangles of the scene
+ *         packet: a packet of rays whose t have been set to the farthest distance to look at
+ *         cull_backfaces: nonzero if triangles whose front faces away from the origin of the rays should be ignored
+ * OUTPUTS: packet: t and triangle set to the nearest hit of each ray
+ * RETURN VALUE: the number of nodes visited
+ * SIDE EFFECTS: none
+ */
+extern uint64_t trace_packet(Bvh* bvh, RayPacket* packet, int32_t cull_backfaces);
+
+#endif
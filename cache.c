@@ -0,0 +1,307 @@
+/*
+ *
+ * cache.c - an on-disk cache of finished pictures, keyed by the contents of the STL file and
+ *           every parameter that changes the picture, so repeated requests skip drawing entirely
+ *
+ * Each picture is stored as <dir>/<key>.png. The modification time of a picture is the last
+ * time it was used, and the least recently used pictures are removed when the cache is full.
+ */
+#include "cache.h"
+#include "mesh.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
+
+// The number of bytes read from a file at a time
+#define CACHE_BUFFER_SIZE (1 << 20)
+
+// The multipliers of the two lanes of the key hash
+#define HASH_PRIME_A 0x9E3779B97F4A7C15ull
+#define HASH_PRIME_B 0xC2B2AE3D27D4EB4Full
+
+/*
+ * Hash
+ *
+ * Struct holding the state of a 128-bit hash that is fed 8 bytes at a time
+ * Members:
+ *  -a, b: the two 64-bit lanes of the hash
+ *  -length: the number of bytes hashed so far
+ */
+typedef struct {
+	uint64_t a;
+	uint64_t b;
+	uint64_t length;
+} Hash;
+
+/*
+ * CacheEntry
+ *
+ * Struct describing a picture in the cache directory while the cache is being trimmed
+ * Members:
+ *  -name: the file name of the picture
+ *  -size: the size of the picture in bytes
+ *  -used: the last time the picture was used, in nanoseconds
+ */
+typedef struct {
+	char name[CACHE_KEY_LENGTH + 4];
+	int64_t size;
+	int64_t used;
+} CacheEntry;
+
+static unsigned char buffer[CACHE_BUFFER_SIZE];
+
+/*
+ * rotate
+ *
+ * INPUTS: x: a 64-bit integer
+ *         bits: the number of bits to rotate by, between 1 and 63
+ * RETURN VALUE: x rotated left by bits
+ * SIDE EFFECTS: none
+ */
+static uint64_t rotate(uint64_t x, int32_t bits) {
+	return (x << bits) | (x >> (64 - bits));
+}
+
+/*
+ * mix
+ *
+ * INPUTS: x: a 64-bit integer
+ * RETURN VALUE: x with its bits scrambled so that every input bit affects every output bit
+ * SIDE EFFECTS: none
+ */
+static uint64_t mix(uint64_t x) {
+	x ^= x >> 33;
+	x *= 0xFF51AFD7ED558CCDull;
+	x ^= x >> 33;
+	x *= 0xC4CEB9FE1A85EC53ull;
+	x ^= x >> 33;
+	return x;
+}
+
+/*
+ * hash_update
+ *
+ * INPUTS: h: the hash to add to
+ *         data, size: the bytes to add to the hash
+ * SIDE EFFECTS: adds the bytes to the hash, padding them with zeros to a multiple of 8 bytes
+ */
+static void hash_update(Hash* h, const void* data, size_t size) {
+	size_t i;
+	for (i = 0; i < size; i += 8) {
+		uint64_t word = 0;
+		memcpy(&word, (const char*)data + i, MIN(8, size - i));
+		h->a = rotate(h->a ^ word, 31) * HASH_PRIME_A;
+		h->b = rotate(h->b + word, 27) * HASH_PRIME_B;
+	}
+	h->length += size;
+}
+
+/*
+ * entry_path
+ *
+ * INPUTS: dir: the directory that holds the image cache
+ *         name: the name of a file in the directory
+ * RETURN VALUE: the path of the file, which must be freed
+ * SIDE EFFECTS: allocates the path
+ */
+static char* entry_path(char* dir, char* name) {
+	char* path = malloc(strlen(dir) + strlen(name) + 2);
+	sprintf(path, "%s/%s", dir, name);
+	return path;
+}
+
+/*
+ * copy_file
+ *
+ * INPUTS: from: the path of the file to copy
+ *         to: the path to copy it to
+ * RETURN VALUE: 1 if the whole file was copied, 0 otherwise
+ * SIDE EFFECTS: creates or replaces the file at to, unless the file at from could not be opened
+ */
+static int32_t copy_file(char* from, char* to) {
+	FILE* in = fopen(from, "rb");
+	if (in == NULL) {
+		return 0;
+	}
+	FILE* out = fopen(to, "wb");
+	if (out == NULL) {
+		fclose(in);
+		return 0;
+	}
+	int32_t copied = 1;
+	size_t size;
+	while ((size = fread(buffer, 1, CACHE_BUFFER_SIZE, in)) > 0) {
+		if (fwrite(buffer, 1, size, out) != size) {
+			copied = 0;
+			break;
+		}
+	}
+	copied &= !ferror(in);
+	fclose(in);
+	copied &= (fclose(out) == 0);
+	return copied;
+}
+
+/*
+ * cache_lookup
+ *
+ * INPUTS: dir: the directory that holds the image cache
+ *         file: the path of the STL file to draw
+ *         parameters: a string holding every parameter that changes the picture
+ *         output: the path that the picture should be written to
+ * OUTPUTS: key: the key of the picture, which is the empty string if the STL file could not be read
+ * RETURN VALUE: 1 if the picture was in the cache and was copied to output, 0 otherwise
+ * SIDE EFFECTS: hashes the contents of the STL file together with the parameters, and on a hit
+ *               marks the cached picture as recently used
+ *               counts the hit or miss and times the lookup
+ */
+int32_t cache_lookup(char* dir, char* file, char* parameters, char* key, char* output) {
+	STATS_BEGIN(lookup_start);
+	key[0] = '\0';
+	FILE* fp = fopen(file, "rb");
+	if (fp == NULL) {
+		STATS_COUNT(COUNTER_CACHE_MISSES, 1);
+		STATS_END(STAGE_CACHE_LOOKUP, lookup_start);
+		return 0;
+	}
+
+	// The file is hashed as it is stored, so a compressed file and its decompressed copy have different keys
+	Hash h = {HASH_PRIME_B, HASH_PRIME_A, 0};
+	size_t size;
+	while ((size = fread(buffer, 1, CACHE_BUFFER_SIZE, fp)) > 0) {
+		hash_update(&h, buffer, size);
+	}
+	fclose(fp);
+	// The length of the file separates it from the parameters
+	uint64_t file_length = h.length;
+	hash_update(&h, &file_length, sizeof(file_length));
+	hash_update(&h, parameters, strlen(parameters));
+	snprintf(key, CACHE_KEY_LENGTH, "%016llx%016llx", (unsigned long long)mix(h.a ^ h.length),
+	         (unsigned long long)mix(h.b ^ rotate(h.length, 32) ^ h.a));
+
+	char name[CACHE_KEY_LENGTH + 4];
+	sprintf(name, "%s.png", key);
+	char* path = entry_path(dir, name);
+	int32_t hit = copy_file(path, output);
+	if (hit) {
+		utimensat(AT_FDCWD, path, NULL, 0);
+	}
+	free(path);
+
+	STATS_COUNT(hit ? COUNTER_CACHE_HITS : COUNTER_CACHE_MISSES, 1);
+	STATS_END(STAGE_CACHE_LOOKUP, lookup_start);
+	return hit;
+}
+
+/*
+ * compare_used
+ *
+ * INPUTS: a, b: pointers to two CacheEntry structs
+ * RETURN VALUE: negative if a was used before b, positive if it was used after b, 0 otherwise
+ * SIDE EFFECTS: none
+ */
+static int compare_used(const void* a, const void* b) {
+	int64_t used_a = ((const CacheEntry*)a)->used;
+	int64_t used_b = ((const CacheEntry*)b)->used;
+	return (used_a > used_b) - (used_a < used_b);
+}
+
+/*
+ * trim_cache
+ *
+ * INPUTS: dir: the directory that holds the image cache
+ *         max_bytes: the limit on the total size of the pictures in the cache
+ * SIDE EFFECTS: removes the least recently used pictures until the rest fit in max_bytes
+ *               files in the directory that are not pictures of the cache are left alone
+ */
+static void trim_cache(char* dir, int64_t max_bytes) {
+	DIR* d = opendir(dir);
+	if (d == NULL) {
+		return;
+	}
+	int64_t num_entries = 0;
+	int64_t entries_size = 0;
+	CacheEntry* entries = NULL;
+	int64_t total = 0;
+	struct dirent* e;
+	while ((e = readdir(d)) != NULL) {
+		size_t len = strlen(e->d_name);
+		if (len != CACHE_KEY_LENGTH - 1 + 4 || strcmp(e->d_name + CACHE_KEY_LENGTH - 1, ".png") != 0 ||
+		    strspn(e->d_name, "0123456789abcdef") != CACHE_KEY_LENGTH - 1) {
+			continue;
+		}
+		char* path = entry_path(dir, e->d_name);
+		struct stat st;
+		int32_t found = (stat(path, &st) == 0);
+		free(path);
+		if (!found) {
+			continue;
+		}
+		if (num_entries == entries_size) {
+			entries = dynamic_resize(entries, &entries_size, sizeof(CacheEntry));
+		}
+		strcpy(entries[num_entries].name, e->d_name);
+		entries[num_entries].size = st.st_size;
+		entries[num_entries].used = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+		total += st.st_size;
+		num_entries++;
+	}
+	closedir(d);
+
+	if (total > max_bytes) {
+		qsort(entries, num_entries, sizeof(CacheEntry), compare_used);
+		int64_t i;
+		for (i = 0; i < num_entries && total > max_bytes; i++) {
+			char* path = entry_path(dir, entries[i].name);
+			// Another process may have removed the picture already
+			unlink(path);
+			free(path);
+			total -= entries[i].size;
+		}
+	}
+	free(entries);
+}
+
+/*
+ * cache_store
+ *
+ * INPUTS: dir: the directory that holds the image cache
+ *         key: the key returned by cache_lookup
+ *         output: the path that the picture was written to
+ *         max_bytes: the limit on the total size of the pictures in the cache
+ * OUTPUTS: none
+ * RETURN VALUE: 1 if the picture was stored, 0 otherwise
+ * SIDE EFFECTS: copies the picture into the cache under a temporary name and renames it into place, so that
+ *               other processes never see a partial picture, and then removes the least recently used
+ *               pictures until the cache is within max_bytes
+ */
+int32_t cache_store(char* dir, char* key, char* output, int64_t max_bytes) {
+	if (key[0] == '\0') {
+		return 0;
+	}
+	STATS_BEGIN(store_start);
+	mkdir(dir, 0777);
+
+	char name[CACHE_KEY_LENGTH + 32];
+	sprintf(name, "%s.png", key);
+	char* path = entry_path(dir, name);
+	sprintf(name, "%s.%ld.tmp", key, (long)getpid());
+	char* temp_path = entry_path(dir, name);
+	int32_t stored = copy_file(output, temp_path) && rename(temp_path, path) == 0;
+	if (!stored) {
+		unlink(temp_path);
+	}
+	free(temp_path);
+	free(path);
+
+	trim_cache(dir, max_bytes);
+	STATS_END(STAGE_CACHE_STORE, store_start);
+	return stored;
+}
@@ -0,0 +1,42 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+
+// The length of a cache key written as hex digits, including the terminating null
+#define CACHE_KEY_LENGTH 33
+
+// The default limit on the total size of the images in a cache directory
+#define CACHE_DEFAULT_BYTES (256ll << 20)
+
+/*
+ * cache_lookup
+ *
+ * INPUTS: dir: the directory that holds the image cache
+ *         file: the path of the STL file to draw
+ *         parameters: a string holding every parameter that changes the picture
+ *         output: the path that the picture should be written to
+ * OUTPUTS: key: the key of the picture, which is the empty string if the STL file could not be read
+ * RETURN VALUE: 1 if the picture was in the cache and was copied to output, 0 otherwise
+ * SIDE EFFECTS: hashes the contents of the STL file together with the parameters, and on a hit
+ *               marks the cached picture as recently used
+ *               counts the hit or miss and times the lookup
+ */
+extern int32_t cache_lookup(char* dir, char* file, char* parameters, char* key, char* output);
+
+/*
+ * cache_store
+ *
+ * INPUTS: dir: the directory that holds the image cache
+ *         key: the key returned by cache_lookup
+ *         output: the path that the picture was written to
+ *         max_bytes: the limit on the total size of the pictures in the cache
+ * OUTPUTS: none
+ * RETURN VALUE: 1 if the picture was stored, 0 otherwise
+ * SIDE EFFECTS: copies the picture into the cache under a temporary name and renames it into place, so that
+ *               other processes never see a partial picture, and then removes the least recently used
+ *               pictures until the cache is within max_bytes
+ */
+extern int32_t cache_store(char* dir, char* key, char* output, int64_t max_bytes);
+
+#endif
@@ -0,0 +1,437 @@
+/*
+ *
+ * input.c - reads uncompressed and compressed STL files
+ *
+ * Compressed files are inflated on their own thread into a link of chunks (see queue.h),
+ * which the parser copies records out of while the next chunks are being decompressed.
+ */
+#include "input.h"
+#include "mesh.h"
+#include "queue.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
+
+// The number of decompressed bytes in each chunk passed to the parser
+#define CHUNK_SIZE (1 << 20)
+// The number of compressed bytes read from the file at a time
+#define COMPRESSED_BUFFER_SIZE (1 << 18)
+
+/*
+ * InputFormat
+ *
+ * The formats that input files can be stored in
+ */
+typedef enum {
+	INPUT_PLAIN,
+	INPUT_GZIP,
+	INPUT_ZSTD
+} InputFormat;
+
+/*
+ * InputStream
+ *
+ * Members:
+ *  -file: the path of the file
+ *  -fp: the open file
+ *  -format: the format of the file
+ *  -thread: the thread decompressing the file, if it is compressed
+ *  -link: the chunks passed from the decompressing thread to the reader
+ *  -current: the chunk being read from, or NULL if the next read should wait for a new one
+ *  -offset: the number of bytes of the current chunk that have been read
+ *  -finished: whether the decompressing thread has passed its last chunk
+ *  -stop: set by the reader to stop the decompressing thread before the end of the file
+ *  -wait_ns: the time that the reader and the decompressing thread spent waiting for each other
+ *  -started, first_chunk, ended: the times at which decompression started, first passed a chunk and finished
+ *  -decompressed_bytes: the number of bytes that the decompressing thread passed to the reader
+ */
+struct InputStream {
+	char* file;
+	FILE* fp;
+	InputFormat format;
+	pthread_t thread;
+	Link link;
+	Batch* current;
+	int32_t offset;
+	int32_t finished;
+	int32_t stop;
+	uint64_t wait_ns[2];
+	uint64_t started;
+	uint64_t first_chunk;
+	uint64_t ended;
+	uint64_t decompressed_bytes;
+};
+
+/*
+ * pass_chunk
+ *
+ * INPUTS: in: a compressed input stream
+ *         b: a chunk filled by the decompressing thread
+ * RETURN VALUE: an empty chunk to fill next
+ * SIDE EFFECTS: passes b to the reader
+ */
+static Batch* pass_chunk(InputStream* in, Batch* b) {
+	STATS_COUNT(COUNTER_DECOMPRESSED_BYTES, b->count);
+	if (in->first_chunk == 0) {
+		in->first_chunk = stats_now();
+	}
+	in->decompressed_bytes += b->count;
+	queue_push(&in->link.full, b, &in->wait_ns[1]);
+	Batch* next = queue_pop(&in->link.empty, &in->wait_ns[1]);
+	next->count = 0;
+	return next;
+}
+
+/*
+ * fill_compressed
+ *
+ * INPUTS: in: a compressed input stream
+ *         length: the most bytes to read
+ * OUTPUTS: buffer: filled with the next compressed bytes of the file
+ * RETURN VALUE: the number of bytes read, which is 0 at the end of the file
+ * SIDE EFFECTS: advances the position in the file
+ */
+static size_t fill_compressed(InputStream* in, unsigned char* buffer, size_t length) {
+	STATS_BEGIN(read_start);
+	size_t n = fread(buffer, 1, length, in->fp);
+	STATS_END(STAGE_READ, read_start);
+	STATS_COUNT(COUNTER_COMPRESSED_BYTES, n);
+	return n;
+}
+
+/*
+ * inflate_gzip
+ *
+ * INPUTS: in: a gzip compressed input stream
+ *         b: an empty chunk
+ * RETURN VALUE: the partially filled last chunk
+ * SIDE EFFECTS: decompresses the file into chunks and passes the full ones to the reader
+ */
+static Batch* inflate_gzip(InputStream* in, Batch* b) {
+	z_stream z;
+	memset(&z, 0, sizeof(z));
+	// 15 window bits, plus 32 to accept both gzip and zlib headers
+	inflateInit2(&z, 15 + 32);
+	unsigned char* compressed = malloc(COMPRESSED_BUFFER_SIZE);
+
+	int32_t ret = Z_OK;
+	while (!__atomic_load_n(&in->stop, __ATOMIC_RELAXED)) {
+		if (z.avail_in == 0) {
+			z.next_in = compressed;
+			z.avail_in = fill_compressed(in, compressed, COMPRESSED_BUFFER_SIZE);
+			if (z.avail_in == 0) {
+				if (ret != Z_STREAM_END) {
+					fprintf(stderr, "%s ends in the middle of its compressed data\n", in->file);
+				}
+				break;
+			}
+		}
+		// Concatenated gzip files are decompressed one after the other, as gzip does. Anything else after the
+		// end of a member, such as the zero padding added by tape and block tools, is ignored like gzip does
+		if (ret == Z_STREAM_END) {
+			if (z.avail_in == 1) {
+				compressed[0] = z.next_in[0];
+				z.next_in = compressed;
+				z.avail_in = 1 + fill_compressed(in, compressed + 1, COMPRESSED_BUFFER_SIZE - 1);
+			}
+			if (z.avail_in < 2 || z.next_in[0] != 0x1f || z.next_in[1] != 0x8b) {
+				uInt i;
+				for (i = 0; i < z.avail_in && z.next_in[i] == 0; i++) {
+				}
+				if (i < z.avail_in) {
+					fprintf(stderr, "%s has trailing data after its compressed data, which was ignored\n", in->file);
+				}
+				break;
+			}
+			inflateReset(&z);
+		}
+
+		z.next_out = (unsigned char*)b->items + b->count;
+		z.avail_out = CHUNK_SIZE - b->count;
+		STATS_BEGIN(inflate_start);
+		ret = inflate(&z, Z_NO_FLUSH);
+		STATS_END(STAGE_DECOMPRESS, inflate_start);
+		b->count = CHUNK_SIZE - z.avail_out;
+		if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+			fprintf(stderr, "%s has invalid compressed data (%s)\n", in->file, z.msg ? z.msg : "unknown error");
+			break;
+		}
+
+		if (b->count == CHUNK_SIZE) {
+			b = pass_chunk(in, b);
+		}
+	}
+
+	inflateEnd(&z);
+	free(compressed);
+	return b;
+}
+
+#ifdef HAVE_ZSTD
+/*
+ * inflate_zstd
+ *
+ * INPUTS: in: a zstd compressed input stream
+ *         b: an empty chunk
+ * RETURN VALUE: the partially filled last chunk
+ * SIDE EFFECTS: decompresses the file into chunks and passes the full ones to the reader
+ */
+static Batch* inflate_zstd(InputStream* in, Batch* b) {
+	ZSTD_DStream* zs = ZSTD_createDStream();
+	ZSTD_initDStream(zs);
+	unsigned char* compressed = malloc(COMPRESSED_BUFFER_SIZE);
+	ZSTD_inBuffer zin = {compressed, 0, 0};
+
+	// The number of bytes that the current frame still needs, which is 0 between frames
+	size_t ret = 0;
+	while (!__atomic_load_n(&in->stop, __ATOMIC_RELAXED)) {
+		if (zin.pos == zin.size) {
+			zin.pos = 0;
+			zin.size = fill_compressed(in, compressed, COMPRESSED_BUFFER_SIZE);
+			if (zin.size == 0) {
+				if (ret != 0) {
+					fprintf(stderr, "%s ends in the middle of its compressed data\n", in->file);
+				}
+				break;
+			}
+		}
+
+		ZSTD_outBuffer zout = {b->items, CHUNK_SIZE, b->count};
+		STATS_BEGIN(inflate_start);
+		ret = ZSTD_decompressStream(zs, &zout, &zin);
+		STATS_END(STAGE_DECOMPRESS, inflate_start);
+		b->count = zout.pos;
+		if (ZSTD_isError(ret)) {
+			fprintf(stderr, "%s has invalid compressed data (%s)\n", in->file, ZSTD_getErrorName(ret));
+			break;
+		}
+
+		if (b->count == CHUNK_SIZE) {
+			b = pass_chunk(in, b);
+		}
+	}
+
+	ZSTD_freeDStream(zs);
+	free(compressed);
+	return b;
+}
+#endif
+
+/*
+ * decompress_thread
+ *
+ * INPUTS: arg: a compressed input stream
+ * RETURN VALUE: NULL
+ * SIDE EFFECTS: decompresses the file into chunks and passes them to the reader, followed by an empty chunk
+ */
+static void* decompress_thread(void* arg) {
+	InputStream* in = arg;
+	if (in->started == 0) {
+		in->started = stats_now();
+	}
+	Batch* b = queue_pop(&in->link.empty, &in->wait_ns[1]);
+	b->count = 0;
+
+#ifdef HAVE_ZSTD
+	if (in->format == INPUT_ZSTD) {
+		b = inflate_zstd(in, b);
+	} else
+#endif
+	b = inflate_gzip(in, b);
+
+	if (b->count > 0) {
+		b = pass_chunk(in, b);
+	}
+	in->ended = stats_now();
+	queue_push(&in->link.full, b, &in->wait_ns[1]);
+	return NULL;
+}
+
+/*
+ * start_decompression
+ *
+ * INPUTS: in: a compressed input stream positioned at the start of the file
+ * SIDE EFFECTS: starts the decompressing thread
+ */
+static void start_decompression(InputStream* in) {
+	in->current = NULL;
+	in->offset = 0;
+	in->finished = 0;
+	in->stop = 0;
+	pthread_create(&in->thread, NULL, decompress_thread, in);
+}
+
+/*
+ * stop_decompression
+ *
+ * INPUTS: in: a compressed input stream
+ * SIDE EFFECTS: stops the decompressing thread, throwing away the chunks it has not passed on yet
+ */
+static void stop_decompression(InputStream* in) {
+	__atomic_store_n(&in->stop, 1, __ATOMIC_RELAXED);
+	if (in->current != NULL) {
+		queue_push(&in->link.empty, in->current, &in->wait_ns[0]);
+		in->current = NULL;
+	}
+	// Keep returning chunks so that the thread can reach its last one
+	while (!in->finished) {
+		Batch* b = queue_pop(&in->link.full, &in->wait_ns[0]);
+		in->finished = (b->count == 0);
+		queue_push(&in->link.empty, b, &in->wait_ns[0]);
+	}
+	pthread_join(in->thread, NULL);
+}
+
+/*
+ * open_input
+ *
+ * INPUTS: file: the path of the file to open
+ * RETURN VALUE: the opened file, or NULL if it could not be opened
+ * SIDE EFFECTS: detects whether the file is compressed from its first bytes, and if it is,
+ *               starts a thread that decompresses it ahead of the reads
+ */
+InputStream* open_input(char* file) {
+	FILE* fp = fopen(file, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "Failed to open %s\n", file);
+		return NULL;
+	}
+
+	unsigned char magic[4] = {0, 0, 0, 0};
+	size_t magic_size = fread(magic, 1, 4, fp);
+	fseek(fp, 0, SEEK_SET);
+
+	InputStream* in = calloc(1, sizeof(InputStream));
+	in->file = file;
+	in->fp = fp;
+	if (magic_size >= 2 && magic[0] == 0x1F && magic[1] == 0x8B) {
+		in->format = INPUT_GZIP;
+	} else if (magic_size == 4 && magic[0] == 0x28 && magic[1] == 0xB5 && magic[2] == 0x2F && magic[3] == 0xFD) {
+#ifdef HAVE_ZSTD
+		in->format = INPUT_ZSTD;
+#else
+		fprintf(stderr, "%s is zstd compressed, which this build cannot read (rebuild with make ZSTD=1)\n", file);
+		fclose(fp);
+		free(in);
+		return NULL;
+#endif
+	} else {
+		in->format = INPUT_PLAIN;
+	}
+
+	if (in->format != INPUT_PLAIN) {
+		init_link(&in->link, CHUNK_SIZE);
+		start_decompression(in);
+	}
+	return in;
+}
+
+/*
+ * read_input
+ *
+ * INPUTS: in: an open input file
+ *         size: the number of bytes to read
+ * OUTPUTS: buffer: filled with the next bytes of the (decompressed) file
+ * RETURN VALUE: the number of bytes read, which is less than size only at the end of the file
+ * SIDE EFFECTS: advances the position in the file
+ */
+size_t read_input(InputStream* in, void* buffer, size_t size) {
+	if (in->format == INPUT_PLAIN) {
+		return fread(buffer, 1, size, in->fp);
+	}
+
+	size_t done = 0;
+	while (done < size && !in->finished) {
+		if (in->current == NULL) {
+			in->current = queue_pop(&in->link.full, &in->wait_ns[0]);
+			in->offset = 0;
+			if (in->current->count == 0) {
+				in->finished = 1;
+				queue_push(&in->link.empty, in->current, &in->wait_ns[0]);
+				in->current = NULL;
+				break;
+			}
+		}
+
+		size_t n = MIN(size - done, (size_t)(in->current->count - in->offset));
+		memcpy((char*)buffer + done, (char*)in->current->items + in->offset, n);
+		done += n;
+		in->offset += n;
+		if (in->offset == in->current->count) {
+			queue_push(&in->link.empty, in->current, &in->wait_ns[0]);
+			in->current = NULL;
+		}
+	}
+	return done;
+}
+
+/*
+ * input_size
+ *
+ * INPUTS: in: an open input file
+ * RETURN VALUE: the size of the file on disk, which is smaller than the data read from it if it is compressed
+ * SIDE EFFECTS: none
+ */
+int64_t input_size(InputStream* in) {
+	struct stat st;
+	if (fstat(fileno(in->fp), &st) != 0) {
+		return -1;
+	}
+	return st.st_size;
+}
+
+/*
+ * input_compressed
+ *
+ * INPUTS: in: an open input file
+ * RETURN VALUE: 1 if the file is decompressed as it is read, 0 otherwise
+ * SIDE EFFECTS: none
+ */
+int32_t input_compressed(InputStream* in) {
+	return in->format != INPUT_PLAIN;
+}
+
+/*
+ * rewind_input
+ *
+ * INPUTS: in: an open input file
+ * SIDE EFFECTS: moves back to the start of the file, restarting decompression if it is compressed
+ */
+void rewind_input(InputStream* in) {
+	if (in->format != INPUT_PLAIN) {
+		stop_decompression(in);
+	}
+	fseek(in->fp, 0, SEEK_SET);
+	if (in->format != INPUT_PLAIN) {
+		start_decompression(in);
+	}
+}
+
+/*
+ * close_input
+ *
+ * INPUTS: in: an open input file
+ * SIDE EFFECTS: stops decompression if it has not finished, closes the file and frees the stream
+ *               records the utilization of the decompressing thread
+ */
+void close_input(InputStream* in) {
+	if (in->format != INPUT_PLAIN) {
+		stop_decompression(in);
+		free_link(&in->link);
+		if (stats_enabled) {
+			stats_pipeline_stage("decompress", in->started, in->first_chunk ? in->first_chunk : in->ended, in->ended,
+			                     in->wait_ns[1], in->decompressed_bytes / STL_BLOCK_SIZE);
+		}
+	}
+	fclose(in->fp);
+	free(in);
+}
@@ -0,0 +1,71 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * InputStream
+ *
+ * An open input file, which is read directly if it is uncompressed and is decompressed
+ * on a separate thread if it is gzip (or, when built with ZSTD=1, zstd) compressed
+ */
+typedef struct InputStream InputStream;
+
+/*
+ * open_input
+ *
+ * INPUTS: file: the path of the file to open
+ * RETURN VALUE: the opened file, or NULL if it could not be opened
+ * SIDE EFFECTS: detects whether the file is compressed from its first bytes, and if it is,
+ *               starts a thread that decompresses it ahead of the reads
+ */
+extern InputStream* open_input(char* file);
+
+/*
+ * read_input
+ *
+ * INPUTS: in: an open input file
+ *         size: the number of bytes to read
+ * OUTPUTS: buffer: filled with the next bytes of the (decompressed) file
+ * RETURN VALUE: the number of bytes read, which is less than size only at the end of the file
+ * SIDE EFFECTS: advances the position in the file
+ */
+extern size_t read_input(InputStream* in, void* buffer, size_t size);
+
+/*
+ * input_size
+ *
+ * INPUTS: in: an open input file
+ * RETURN VALUE: the size of the file on disk, which is smaller than the data read from it if it is compressed
+ * SIDE EFFECTS: none
+ */
+extern int64_t input_size(InputStream* in);
+
+/*
+ * input_compressed
+ *
+ * INPUTS: in: an open input file
+ * RETURN VALUE: 1 if the file is decompressed as it is read, 0 otherwise
+ * SIDE EFFECTS: none
+ */
+extern int32_t input_compressed(InputStream* in);
+
+/*
+ * rewind_input
+ *
+ * INPUTS: in: an open input file
+ * SIDE EFFECTS: moves back to the start of the file, restarting decompression if it is compressed
+ */
+extern void rewind_input(InputStream* in);
+
+/*
+ * close_input
+ *
+ * INPUTS: in: an open input file
+ * SIDE EFFECTS: stops decompression if it has not finished, closes the file and frees the stream
+ *               records the utilization of the decompressing thread
+ */
+extern void close_input(InputStream* in);
+
+#endif
@@ -0,0 +1,1045 @@
+/*
+ *
+ * lod.c - simplifies the current 3D scene with quadric error edge collapses, so that objects
+ *         that cover few pixels are drawn with fewer triangles
+ *
+ * Each vertex keeps a quadric that measures the squared distance of a point from the planes of the
+ * triangles it has absorbed, weighted by their area. Collapses are made in rounds: every edge is priced
+ * in parallel, and then the cheapest edges whose neighborhoods do not overlap are collapsed together,
+ * which keeps the result close to collapsing one cheapest edge at a time.
+ *
+ * Levels of detail that halve the number of triangles each time can be cached in <file>.lod, so that
+ * later pictures read a coarse level instead of the whole file.
+ */
+#include "lod.h"
+#include "mesh.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
+#define MAX(X, Y) (((X) > (Y)) ? (X) : (Y))
+
+// Collapses are skipped for vertices with more neighbors than this, which are rare and expensive to check
+#define LOD_MAX_NEIGHBORS 64
+// A collapse is rejected if it turns the normal of a triangle by more than about 75 degrees
+#define LOD_MIN_NORMAL_COS 0.25
+// The weight of the planes that keep the border of an open surface in place, relative to the triangles
+#define LOD_BORDER_WEIGHT 10.0
+// At most one in this many of the edges priced in a round are considered for collapsing in it, so that a
+// round never reaches far past the cheapest edges
+#define LOD_ROUND_SHARE 3
+// The number of bits of the cost of a collapse that it is sorted by
+#define LOD_SORT_BITS 16
+// Cached levels of detail stop once a level has this many triangles or fewer
+#define LOD_MIN_TRIANGLES 1024
+// The most levels of detail in a cache file, including the full object
+#define LOD_MAX_LEVELS 32
+
+// The start of a cached level of detail file
+#define LOD_MAGIC "STLLOD2"
+
+/*
+ * Quadric
+ *
+ * Struct holding a sum of squared distances from planes, as the symmetric matrix of the quadratic form
+ * Members:
+ *  -a: the upper triangle of the matrix in the order xx, xy, xz, xw, yy, yz, yw, zz, zw, ww
+ *  -weight: the total area of the triangles whose planes were added
+ */
+typedef struct {
+	double a[10];
+	double weight;
+} Quadric;
+
+/*
+ * Collapse
+ *
+ * Struct describing the collapse of an edge into one vertex
+ * Members:
+ *  -from: the vertex that is removed
+ *  -to: the vertex that is kept and moved to position
+ *  -cost: the squared error of the collapse
+ *  -position: the new position of the kept vertex
+ */
+typedef struct {
+	uint32_t from;
+	uint32_t to;
+	float cost;
+	float position[3];
+} Collapse;
+
+/*
+ * Simplifier
+ *
+ * Struct holding an object while it is simplified
+ * Members:
+ *  -num_vertices, positions, quadrics: the vertices of the object, including ones that have been removed
+ *  -remap: the vertex that each vertex was collapsed into, or the vertex itself
+ *  -border: nonzero for each vertex on the border of an open surface
+ *  -num_triangles, indices: the 3 vertices of each triangle that is left
+ *  -first_adjacent, adjacent: the triangles around each vertex, which are adjacent[first_adjacent[v]]
+ *                             up to adjacent[first_adjacent[v + 1]]
+ *  -collapses, num_collapses: the collapses priced in a round, grouped by the range of triangles of
+ *                             each thread, so that thread t found num_collapses[t] of them starting
+ *                             at collapses[3 * first triangle of its range]
+ *  -locked: nonzero for each vertex that was collapsed or moved in the current round
+ *  -threads: the number of threads to price the collapses with
+ *  -max_error: the largest error of a collapse made so far
+ */
+typedef struct {
+	int64_t num_vertices;
+	Vector* positions;
+	Quadric* quadrics;
+	uint32_t* remap;
+	uint8_t* border;
+	int64_t num_triangles;
+	uint32_t* indices;
+	int64_t* first_adjacent;
+	uint32_t* adjacent;
+	Collapse* collapses;
+	int64_t* num_collapses;
+	uint8_t* locked;
+	int32_t threads;
+	double max_error;
+} Simplifier;
+
+/*
+ * SimplifyJob
+ *
+ * Struct describing the share of a parallel pass over the object done by one thread
+ * Members:
+ *  -s: the object being simplified
+ *  -thread: the index of the thread
+ *  -first, count: the range of triangles or vertices that the thread works on
+ */
+typedef struct {
+	Simplifier* s;
+	int32_t thread;
+	int64_t first;
+	int64_t count;
+} SimplifyJob;
+
+/*
+ * LodHeader
+ *
+ * Struct written at the start of a cached level of detail file
+ * Members:
+ *  -magic: LOD_MAGIC
+ *  -file_size, file_mtime: the size and modification time of the STL file when the levels were built
+ *  -scale: the maximum radius that the object was normalized to
+ *  -num_levels: the number of LodLevel structs that follow the header, the first of which is the full object
+ */
+typedef struct {
+	char magic[8];
+	int64_t file_size;
+	int64_t file_mtime;
+	double scale;
+	int32_t num_levels;
+	int32_t reserved;
+} LodHeader;
+
+/*
+ * LodLevel
+ *
+ * Struct describing a level of detail in a cached level of detail file
+ * Members:
+ *  -num_triangles, num_vertices: the size of the level
+ *  -error: the largest error of a collapse made to reach the level
+ *  -offset: the position in the file of the float positions of the vertices, which are followed by
+ *           the indices of the triangles, or 0 for the full object, which is read from the STL file
+ */
+typedef struct {
+	int64_t num_triangles;
+	int64_t num_vertices;
+	double error;
+	int64_t offset;
+} LodLevel;
+
+/*
+ * LodMesh
+ *
+ * Struct holding a simplified object outside of the scene
+ * Members:
+ *  -num_vertices, positions: the vertices of the object
+ *  -num_triangles, indices: the 3 vertices of each triangle
+ *  -error: the largest error of a collapse made to reach it
+ */
+typedef struct {
+	int64_t num_vertices;
+	Vector* positions;
+	int64_t num_triangles;
+	uint32_t* indices;
+	double error;
+} LodMesh;
+
+/*
+ * add_plane
+ *
+ * INPUTS: q: the quadric to add to
+ *         n: the normal of a plane, which must be normalized
+ *         p: a point on the plane
+ *         weight: the weight of the plane
+ * SIDE EFFECTS: adds the squared distance from the plane, times weight, to q
+ */
+static void add_plane(Quadric* q, Vector n, Vector p, double weight) {
+	double d = -dot(n, p);
+	double plane[4] = {n.x, n.y, n.z, d};
+	int32_t i, j, k = 0;
+	for (i = 0; i < 4; i++) {
+		for (j = i; j < 4; j++) {
+			q->a[k++] += weight * plane[i] * plane[j];
+		}
+	}
+}
+
+/*
+ * add_quadric
+ *
+ * INPUTS: q, other: two quadrics
+ * SIDE EFFECTS: adds other to q
+ */
+static void add_quadric(Quadric* q, Quadric* other) {
+	int32_t k;
+	for (k = 0; k < 10; k++) {
+		q->a[k] += other->a[k];
+	}
+	q->weight += other->weight;
+}
+
+/*
+ * quadric_error
+ *
+ * INPUTS: q: a quadric
+ *         v: a point
+ * RETURN VALUE: the weighted mean squared distance of v from the planes of q
+ * SIDE EFFECTS: none
+ */
+static double quadric_error(Quadric* q, Vector v) {
+	double* a = q->a;
+	double e = a[0] * v.x * v.x + 2 * a[1] * v.x * v.y + 2 * a[2] * v.x * v.z + 2 * a[3] * v.x +
+	           a[4] * v.y * v.y + 2 * a[5] * v.y * v.z + 2 * a[6] * v.y +
+	           a[7] * v.z * v.z + 2 * a[8] * v.z + a[9];
+	return (q->weight > 0) ? MAX(0, e / q->weight) : MAX(0, e);
+}
+
+/*
+ * quadric_minimum
+ *
+ * INPUTS: q: a quadric
+ * OUTPUTS: v: the point at which q is smallest
+ * RETURN VALUE: 1 if there is a single such point, 0 if the planes of q do not pin one down
+ * SIDE EFFECTS: none
+ */
+static int32_t quadric_minimum(Quadric* q, Vector* v) {
+	double* a = q->a;
+	// Solve the 3x3 system by Cramer's rule
+	double det = a[0] * (a[4] * a[7] - a[5] * a[5]) - a[1] * (a[1] * a[7] - a[5] * a[2]) + a[2] * (a[1] * a[5] - a[4] * a[2]);
+	double size = fabs(a[0]) + fabs(a[4]) + fabs(a[7]);
+	if (fabs(det) <= 1e-9 * size * size * size) {
+		return 0;
+	}
+	double bx = -a[3], by = -a[6], bz = -a[8];
+	v->x = (bx * (a[4] * a[7] - a[5] * a[5]) - a[1] * (by * a[7] - a[5] * bz) + a[2] * (by * a[5] - a[4] * bz)) / det;
+	v->y = (a[0] * (by * a[7] - bz * a[5]) - bx * (a[1] * a[7] - a[5] * a[2]) + a[2] * (a[1] * bz - by * a[2])) / det;
+	v->z = (a[0] * (a[4] * bz - by * a[5]) - a[1] * (a[1] * bz - by * a[2]) + bx * (a[1] * a[5] - a[4] * a[2])) / det;
+	return 1;
+}
+
+/*
+ * run_parallel
+ *
+ * INPUTS: s: the object being simplified
+ *         count: the number of triangles or vertices to split between the threads
+ *         work: the function that does the share of one thread
+ * SIDE EFFECTS: calls work on s->threads threads, each with a contiguous share of the range from 0 to count
+ */
+static void run_parallel(Simplifier* s, int64_t count, void* (*work)(void*)) {
+	pthread_t workers[s->threads];
+	SimplifyJob jobs[s->threads];
+	int32_t t;
+	for (t = 0; t < s->threads; t++) {
+		int64_t first = count * t / s->threads;
+		jobs[t] = (SimplifyJob){s, t, first, count * (t + 1) / s->threads - first};
+		pthread_create(&workers[t], NULL, work, &jobs[t]);
+	}
+	for (t = 0; t < s->threads; t++) {
+		pthread_join(workers[t], NULL);
+	}
+}
+
+/*
+ * build_adjacency
+ *
+ * INPUTS: s: the object being simplified
+ * SIDE EFFECTS: lists the triangles around each vertex in s->first_adjacent and s->adjacent
+ */
+static void build_adjacency(Simplifier* s) {
+	int64_t i;
+	int32_t j;
+	memset(s->first_adjacent, 0, (s->num_vertices + 1) * sizeof(int64_t));
+	for (i = 0; i < 3 * s->num_triangles; i++) {
+		s->first_adjacent[s->indices[i] + 1]++;
+	}
+	for (i = 0; i < s->num_vertices; i++) {
+		s->first_adjacent[i + 1] += s->first_adjacent[i];
+	}
+	// Fill each list from its back, which leaves first_adjacent[v + 1] at the start of the list of v
+	for (i = s->num_triangles - 1; i >= 0; i--) {
+		for (j = 0; j < 3; j++) {
+			s->adjacent[--s->first_adjacent[s->indices[3 * i + j] + 1]] = (uint32_t)i;
+		}
+	}
+	for (i = 0; i < s->num_vertices; i++) {
+		s->first_adjacent[i] = s->first_adjacent[i + 1];
+	}
+	s->first_adjacent[s->num_vertices] = 3 * s->num_triangles;
+}
+
+/*
+ * current_triangle
+ *
+ * INPUTS: s: the object being simplified
+ *         k: an index into s->adjacent
+ * OUTPUTS: t: the vertices of the triangle, following the collapses made so far in the current round
+ * RETURN VALUE: 1 if the triangle still has three different vertices, 0 if a collapse removed it
+ * SIDE EFFECTS: none
+ */
+static int32_t current_triangle(Simplifier* s, int64_t k, uint32_t* t) {
+	uint32_t* old = s->indices + 3 * (int64_t)s->adjacent[k];
+	t[0] = s->remap[old[0]];
+	t[1] = s->remap[old[1]];
+	t[2] = s->remap[old[2]];
+	return t[0] != t[1] && t[1] != t[2] && t[2] != t[0];
+}
+
+/*
+ * edge_triangles
+ *
+ * INPUTS: s: the object being simplified
+ *         a, b: the two vertices of an edge
+ * RETURN VALUE: the number of triangles that share the edge
+ * SIDE EFFECTS: none
+ */
+static int32_t edge_triangles(Simplifier* s, uint32_t a, uint32_t b) {
+	int32_t count = 0;
+	int64_t k;
+	for (k = s->first_adjacent[a]; k < s->first_adjacent[a + 1]; k++) {
+		uint32_t t[3];
+		count += current_triangle(s, k, t) && (t[0] == b || t[1] == b || t[2] == b);
+	}
+	return count;
+}
+
+/*
+ * quadric_worker
+ *
+ * INPUTS: arg: a SimplifyJob over a range of vertices
+ * RETURN VALUE: NULL
+ * SIDE EFFECTS: sets the quadric of each vertex in the range from the planes of the triangles around it,
+ *               and from planes through the border edges around it that are perpendicular to their triangle,
+ *               and marks it if it has border edges
+ */
+static void* quadric_worker(void* arg) {
+	SimplifyJob* job = arg;
+	Simplifier* s = job->s;
+	int64_t v, k;
+	int32_t j;
+	for (v = job->first; v < job->first + job->count; v++) {
+		Quadric q;
+		memset(&q, 0, sizeof(q));
+		s->border[v] = 0;
+		for (k = s->first_adjacent[v]; k < s->first_adjacent[v + 1]; k++) {
+			uint32_t* t = s->indices + 3 * (int64_t)s->adjacent[k];
+			Vector p[3] = {s->positions[t[0]], s->positions[t[1]], s->positions[t[2]]};
+			Vector n = cross(add_vec(p[1], neg_vec(p[0])), add_vec(p[2], neg_vec(p[0])));
+			double length = magnitude(n);
+			if (length == 0) {
+				continue;
+			}
+			double area = length / 2;
+			n = mul_vec(1 / length, n);
+			add_plane(&q, n, p[0], area);
+			q.weight += area;
+
+			for (j = 0; j < 3; j++) {
+				uint32_t a = t[j], b = t[(j + 1) % 3];
+				if ((a != v && b != v) || edge_triangles(s, a, b) != 1) {
+					continue;
+				}
+				s->border[v] = 1;
+				Vector edge = add_vec(s->positions[b], neg_vec(s->positions[a]));
+				Vector border = cross(edge, n);
+				double border_length = magnitude(border);
+				if (border_length > 0) {
+					// The weight is an area, like those of the triangles, so it counts towards the mean as well
+					double border_weight = LOD_BORDER_WEIGHT * dot(edge, edge);
+					add_plane(&q, mul_vec(1 / border_length, border), s->positions[a], border_weight);
+					q.weight += border_weight;
+				}
+			}
+		}
+		s->quadrics[v] = q;
+	}
+	return NULL;
+}
+
+/*
+ * keeps_orientation
+ *
+ * INPUTS: s: the object being simplified
+ *         v: a vertex that moves to position
+ *         other: the other vertex of the edge being collapsed, whose triangles around v are removed
+ *         position: the new position of v
+ * RETURN VALUE: 1 if no triangle around v turns by more than the limit, 0 otherwise
+ * SIDE EFFECTS: none
+ */
+static int32_t keeps_orientation(Simplifier* s, uint32_t v, uint32_t other, Vector position) {
+	int64_t k;
+	int32_t j;
+	for (k = s->first_adjacent[v]; k < s->first_adjacent[v + 1]; k++) {
+		uint32_t t[3];
+		if (!current_triangle(s, k, t) || t[0] == other || t[1] == other || t[2] == other) {
+			continue;
+		}
+		Vector p[3];
+		for (j = 0; j < 3; j++) {
+			p[j] = s->positions[t[j]];
+		}
+		Vector before = cross(add_vec(p[1], neg_vec(p[0])), add_vec(p[2], neg_vec(p[0])));
+		for (j = 0; j < 3; j++) {
+			if (t[j] == v) {
+				p[j] = position;
+			}
+		}
+		Vector after = cross(add_vec(p[1], neg_vec(p[0])), add_vec(p[2], neg_vec(p[0])));
+		if (dot(before, after) < LOD_MIN_NORMAL_COS * magnitude(before) * magnitude(after)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * keeps_manifold
+ *
+ * INPUTS: s: the object being simplified
+ *         a, b: the two vertices of an edge
+ *         shared: the number of triangles that share the edge
+ * RETURN VALUE: 1 if a and b have exactly one common neighbor for each triangle that shares the edge,
+ *               so that collapsing the edge does not pinch the surface, 0 otherwise
+ * SIDE EFFECTS: none
+ */
+static int32_t keeps_manifold(Simplifier* s, uint32_t a, uint32_t b, int32_t shared) {
+	uint32_t neighbors[2 * LOD_MAX_NEIGHBORS];
+	int32_t num_neighbors = 0;
+	int64_t k;
+	int32_t i, j;
+	if (s->first_adjacent[a + 1] - s->first_adjacent[a] > LOD_MAX_NEIGHBORS) {
+		return 0;
+	}
+	for (k = s->first_adjacent[a]; k < s->first_adjacent[a + 1]; k++) {
+		uint32_t t[3];
+		if (!current_triangle(s, k, t)) {
+			continue;
+		}
+		for (j = 0; j < 3; j++) {
+			if (t[j] != a) {
+				neighbors[num_neighbors++] = t[j];
+			}
+		}
+	}
+
+	uint32_t common[2 * LOD_MAX_NEIGHBORS];
+	int32_t num_common = 0;
+	for (k = s->first_adjacent[b]; k < s->first_adjacent[b + 1]; k++) {
+		uint32_t t[3];
+		if (!current_triangle(s, k, t)) {
+			continue;
+		}
+		for (j = 0; j < 3; j++) {
+			uint32_t w = t[j];
+			if (w == a || w == b) {
+				continue;
+			}
+			int32_t found = 0;
+			for (i = 0; i < num_neighbors && !found; i++) {
+				found = (neighbors[i] == w);
+			}
+			for (i = 0; i < num_common && found; i++) {
+				found = (common[i] != w);
+			}
+			if (found) {
+				if (num_common == shared) {
+					return 0;
+				}
+				common[num_common++] = w;
+			}
+		}
+	}
+	return num_common == shared;
+}
+
+/*
+ * price_worker
+ *
+ * INPUTS: arg: a SimplifyJob over a range of triangles
+ * RETURN VALUE: NULL
+ * SIDE EFFECTS: prices the collapse of every edge of the triangles in the range, and stores them from
+ *               collapses[3 * job->first]
+ *               whether a collapse keeps the surface intact is only checked for the few that are chosen
+ *               edges shared by two triangles are priced by the one in which they run from the lower
+ *               vertex to the higher one, and border edges by their only triangle
+ */
+static void* price_worker(void* arg) {
+	SimplifyJob* job = arg;
+	Simplifier* s = job->s;
+	Collapse* out = s->collapses + 3 * job->first;
+	int64_t count = 0;
+	int64_t i;
+	int32_t j;
+	for (i = job->first; i < job->first + job->count; i++) {
+		for (j = 0; j < 3; j++) {
+			uint32_t a = s->indices[3 * i + j];
+			uint32_t b = s->indices[3 * i + (j + 1) % 3];
+			if (a > b && !(s->border[a] && s->border[b] && edge_triangles(s, a, b) == 1)) {
+				continue;
+			}
+
+			Quadric q = s->quadrics[a];
+			add_quadric(&q, &s->quadrics[b]);
+			Vector pa = s->positions[a];
+			Vector pb = s->positions[b];
+			Vector mid = mul_vec(0.5, add_vec(pa, pb));
+			Vector edge = add_vec(pb, neg_vec(pa));
+			// The best point is only used if it stays near the edge, since nearly flat quadrics put it anywhere
+			Vector best;
+			int32_t solved = quadric_minimum(&q, &best);
+			Vector offset = add_vec(best, neg_vec(mid));
+			if (!solved || dot(offset, offset) > dot(edge, edge)) {
+				double ea = quadric_error(&q, pa), eb = quadric_error(&q, pb), em = quadric_error(&q, mid);
+				best = (ea <= eb && ea <= em) ? pa : (eb <= em) ? pb : mid;
+			}
+			float cost = (float)quadric_error(&q, best);
+			if (!(cost < INFINITY)) {
+				continue;
+			}
+
+			Collapse* c = &out[count++];
+			c->from = b;
+			c->to = a;
+			c->cost = cost;
+			c->position[0] = (float)best.x;
+			c->position[1] = (float)best.y;
+			c->position[2] = (float)best.z;
+		}
+	}
+	s->num_collapses[job->thread] = count;
+	return NULL;
+}
+
+/*
+ * sort_key
+ *
+ * INPUTS: cost: the cost of a collapse, which is not negative
+ * RETURN VALUE: the top LOD_SORT_BITS bits of the cost, which sort in the same order as the costs
+ * SIDE EFFECTS: none
+ */
+static uint32_t sort_key(float cost) {
+	uint32_t bits;
+	memcpy(&bits, &cost, sizeof(bits));
+	return bits >> (32 - LOD_SORT_BITS);
+}
+
+/*
+ * simplify_round
+ *
+ * INPUTS: s: the object being simplified
+ *         max_triangles: the number of triangles to stop at
+ *         max_error: the largest error of a collapse that may be made
+ * RETURN VALUE: the number of collapses made
+ * SIDE EFFECTS: prices every edge, collapses the cheapest edges that keep the surface intact and do not touch
+ *               a vertex that a cheaper collapse moved, and removes the triangles that the collapses flattened
+ *
+ * The price of an edge only depends on the quadrics of its two vertices, so it stays right for the whole round
+ * as long as neither vertex is moved. Whether a collapse keeps the surface intact is checked against the
+ * collapses made before it, by following them through remap.
+ */
+static int64_t simplify_round(Simplifier* s, int64_t max_triangles, double max_error) {
+	build_adjacency(s);
+	run_parallel(s, s->num_triangles, price_worker);
+
+	// Sort the collapses by cost with one counting pass over the top bits of the costs
+	int64_t total = 0;
+	int32_t t;
+	for (t = 0; t < s->threads; t++) {
+		total += s->num_collapses[t];
+	}
+	int64_t* starts = calloc((1 << LOD_SORT_BITS) + 1, sizeof(int64_t));
+	uint32_t* order = malloc(MAX(total, 1) * sizeof(uint32_t));
+	int64_t i;
+	for (t = 0; t < s->threads; t++) {
+		Collapse* c = s->collapses + 3 * (s->num_triangles * t / s->threads);
+		for (i = 0; i < s->num_collapses[t]; i++) {
+			starts[sort_key(c[i].cost) + 1]++;
+		}
+	}
+	for (i = 0; i < (1 << LOD_SORT_BITS); i++) {
+		starts[i + 1] += starts[i];
+	}
+	for (t = 0; t < s->threads; t++) {
+		int64_t first = 3 * (s->num_triangles * t / s->threads);
+		for (i = 0; i < s->num_collapses[t]; i++) {
+			order[starts[sort_key(s->collapses[first + i].cost)]++] = (uint32_t)(first + i);
+		}
+	}
+	free(starts);
+
+	memset(s->locked, 0, s->num_vertices);
+	int64_t made = 0;
+	int64_t triangles_left = s->num_triangles;
+	double squared_error = max_error * max_error;
+	for (i = 0; i < (total + LOD_ROUND_SHARE - 1) / LOD_ROUND_SHARE && triangles_left > max_triangles; i++) {
+		Collapse* c = &s->collapses[order[i]];
+		if (c->cost > squared_error) {
+			break;
+		}
+		Vector position = {c->position[0], c->position[1], c->position[2]};
+		if (s->locked[c->from] || s->locked[c->to]) {
+			continue;
+		}
+		int32_t shared = edge_triangles(s, c->to, c->from);
+		if (shared > 2 || !keeps_manifold(s, c->to, c->from, shared) ||
+		    !keeps_orientation(s, c->to, c->from, position) || !keeps_orientation(s, c->from, c->to, position)) {
+			continue;
+		}
+		s->locked[c->from] = 1;
+		s->locked[c->to] = 1;
+		s->positions[c->to] = position;
+		add_quadric(&s->quadrics[c->to], &s->quadrics[c->from]);
+		s->remap[c->from] = c->to;
+		s->max_error = MAX(s->max_error, sqrt(c->cost));
+		s->border[c->to] |= s->border[c->from];
+		triangles_left -= shared;
+		made++;
+	}
+	free(order);
+
+	// Move the triangles to the vertices they were collapsed into and drop the ones left without area
+	int64_t kept = 0;
+	for (i = 0; i < s->num_triangles; i++) {
+		uint32_t a = s->remap[s->indices[3 * i]];
+		uint32_t b = s->remap[s->indices[3 * i + 1]];
+		uint32_t c = s->remap[s->indices[3 * i + 2]];
+		if (a != b && b != c && c != a) {
+			s->indices[3 * kept] = a;
+			s->indices[3 * kept + 1] = b;
+			s->indices[3 * kept + 2] = c;
+			kept++;
+		}
+	}
+	s->num_triangles = kept;
+	return made;
+}
+
+/*
+ * init_simplifier
+ *
+ * INPUTS: s: the simplifier to set up
+ *         num_triangles, num_vertices: the number of triangles and vertices in the scene
+ *         threads: the number of threads to simplify with
+ * SIDE EFFECTS: copies the scene into s, welding vertices at the same position together since STL files
+ *               store every triangle separately, and sets the quadric of every vertex
+ */
+static void init_simplifier(Simplifier* s, int64_t num_triangles, int64_t num_vertices, int32_t threads) {
+	s->threads = threads;
+	s->max_error = 0;
+	s->positions = malloc(MAX(num_vertices, 1) * sizeof(Vector));
+	s->remap = malloc(MAX(num_vertices, 1) * sizeof(uint32_t));
+
+	// Weld with an open addressing hash table over the exact coordinates
+	int64_t table_size = 1;
+	while (table_size < 2 * num_vertices) {
+		table_size *= 2;
+	}
+	uint32_t* table = malloc(table_size * sizeof(uint32_t));
+	memset(table, 0xFF, table_size * sizeof(uint32_t));
+	int64_t i;
+	s->num_vertices = 0;
+	for (i = 0; i < num_vertices; i++) {
+		Vector v = get_vertex(i);
+		uint64_t bits[3];
+		memcpy(bits, &v, sizeof(bits));
+		uint64_t h = (bits[0] * 0x9E3779B97F4A7C15ull) ^ (bits[1] * 0xC2B2AE3D27D4EB4Full) ^ (bits[2] * 0x165667B19E3779F9ull);
+		int64_t slot = (int64_t)((h ^ (h >> 29)) & (table_size - 1));
+		while (table[slot] != UINT32_MAX && memcmp(&s->positions[table[slot]], &v, sizeof(Vector)) != 0) {
+			slot = (slot + 1) & (table_size - 1);
+		}
+		if (table[slot] == UINT32_MAX) {
+			table[slot] = (uint32_t)s->num_vertices;
+			s->positions[s->num_vertices++] = v;
+		}
+		s->remap[i] = table[slot];
+	}
+	free(table);
+
+	s->indices = malloc(MAX(num_triangles, 1) * 3 * sizeof(uint32_t));
+	s->num_triangles = 0;
+	for (i = 0; i < num_triangles; i++) {
+		uint32_t a = s->remap[triangles[i].vertices[0]];
+		uint32_t b = s->remap[triangles[i].vertices[1]];
+		uint32_t c = s->remap[triangles[i].vertices[2]];
+		if (a != b && b != c && c != a) {
+			s->indices[3 * s->num_triangles] = a;
+			s->indices[3 * s->num_triangles + 1] = b;
+			s->indices[3 * s->num_triangles + 2] = c;
+			s->num_triangles++;
+		}
+	}
+	for (i = 0; i < s->num_vertices; i++) {
+		s->remap[i] = (uint32_t)i;
+	}
+
+	s->quadrics = malloc(MAX(s->num_vertices, 1) * sizeof(Quadric));
+	s->first_adjacent = malloc((s->num_vertices + 1) * sizeof(int64_t));
+	s->adjacent = malloc(MAX(s->num_triangles, 1) * 3 * sizeof(uint32_t));
+	s->collapses = malloc(MAX(s->num_triangles, 1) * 3 * sizeof(Collapse));
+	s->num_collapses = malloc(threads * sizeof(int64_t));
+	s->locked = malloc(MAX(s->num_vertices, 1));
+	s->border = malloc(MAX(s->num_vertices, 1));
+	STATS_COUNT(COUNTER_BYTES_ALLOCATED, num_vertices * (sizeof(Vector) + sizeof(uint32_t)) +
+	            s->num_vertices * (sizeof(Quadric) + sizeof(int64_t) + 2) +
+	            num_triangles * 3 * sizeof(uint32_t) + s->num_triangles * 3 * (sizeof(uint32_t) + sizeof(Collapse)));
+
+	build_adjacency(s);
+	run_parallel(s, s->num_vertices, quadric_worker);
+}
+
+/*
+ * simplify
+ *
+ * INPUTS: s: the object being simplified
+ *         max_triangles: the number of triangles to stop at
+ *         max_error: the largest error of a collapse that may be made
+ * SIDE EFFECTS: collapses edges in rounds until the object has at most max_triangles triangles, or no edge
+ *               can be collapsed within max_error
+ */
+static void simplify(Simplifier* s, int64_t max_triangles, double max_error) {
+	while (s->num_triangles > max_triangles && simplify_round(s, max_triangles, max_error) > 0) {
+	}
+}
+
+/*
+ * export_mesh
+ *
+ * INPUTS: s: the object being simplified
+ * OUTPUTS: mesh: a copy of the object as it is now, without the vertices that have been removed,
+ *                numbered in the order in which the triangles use them
+ * SIDE EFFECTS: allocates the positions and indices of mesh
+ */
+static void export_mesh(Simplifier* s, LodMesh* mesh) {
+	uint32_t* new_index = malloc(MAX(s->num_vertices, 1) * sizeof(uint32_t));
+	memset(new_index, 0xFF, s->num_vertices * sizeof(uint32_t));
+	mesh->positions = malloc(MAX(s->num_vertices, 1) * sizeof(Vector));
+	mesh->indices = malloc(MAX(s->num_triangles, 1) * 3 * sizeof(uint32_t));
+	mesh->num_triangles = s->num_triangles;
+	mesh->num_vertices = 0;
+	mesh->error = s->max_error;
+	int64_t i;
+	for (i = 0; i < 3 * s->num_triangles; i++) {
+		uint32_t v = s->indices[i];
+		if (new_index[v] == UINT32_MAX) {
+			new_index[v] = (uint32_t)mesh->num_vertices;
+			mesh->positions[mesh->num_vertices++] = s->positions[v];
+		}
+		mesh->indices[i] = new_index[v];
+	}
+	free(new_index);
+}
+
+/*
+ * free_simplifier
+ *
+ * INPUTS: s: a simplifier set up by init_simplifier
+ * SIDE EFFECTS: frees the copy of the object held by s
+ */
+static void free_simplifier(Simplifier* s) {
+	free(s->positions);
+	free(s->quadrics);
+	free(s->remap);
+	free(s->indices);
+	free(s->first_adjacent);
+	free(s->adjacent);
+	free(s->collapses);
+	free(s->num_collapses);
+	free(s->locked);
+	free(s->border);
+}
+
+/*
+ * lod_path
+ *
+ * INPUTS: file: the STL file path
+ *         suffix: the text to put after the file name
+ * RETURN VALUE: the path of the file with the suffix, which must be freed
+ * SIDE EFFECTS: allocates the path
+ */
+static char* lod_path(char* file, char* suffix) {
+	char* path = malloc(strlen(file) + strlen(suffix) + 1);
+	strcpy(path, file);
+	strcat(path, suffix);
+	return path;
+}
+
+/*
+ * choose_level
+ *
+ * INPUTS: levels, num_levels: the levels of detail of an object, from the full object down
+ *         max_triangles, max_error: as for load_lod
+ * RETURN VALUE: the index of the coarsest level within max_error, going no further than the first level
+ *               with at most max_triangles triangles
+ * SIDE EFFECTS: none
+ */
+static int32_t choose_level(LodLevel* levels, int32_t num_levels, int64_t max_triangles, double max_error) {
+	int32_t chosen = 0;
+	while (chosen + 1 < num_levels && levels[chosen].num_triangles > max_triangles && levels[chosen + 1].error <= max_error) {
+		chosen++;
+	}
+	return chosen;
+}
+
+/*
+ * read_cached_level
+ *
+ * INPUTS: file, max_radius, max_triangles, max_error, color: as for load_lod
+ * OUTPUTS: num_triangles, num_vertices: the size of the loaded level
+ *          full_triangles: the number of triangles in the full object
+ * RETURN VALUE: 1 if a level was loaded, 0 if the full object should be read from the STL file instead,
+ *               -1 if <file>.lod does not hold levels for the current contents of the file and max_radius
+ * SIDE EFFECTS: replaces the scene with the chosen level
+ */
+static int32_t read_cached_level(char* file, double max_radius, int64_t max_triangles, double max_error, int32_t color,
+                                 int64_t* num_triangles, int64_t* num_vertices, int64_t* full_triangles) {
+	struct stat st;
+	if (stat(file, &st) != 0) {
+		return -1;
+	}
+	char* path = lod_path(file, ".lod");
+	FILE* fp = fopen(path, "rb");
+	free(path);
+	if (fp == NULL) {
+		return -1;
+	}
+	LodHeader header;
+	LodLevel levels[LOD_MAX_LEVELS];
+	if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, LOD_MAGIC, sizeof(LOD_MAGIC)) != 0 ||
+	    header.file_size != (int64_t)st.st_size || header.file_mtime != (int64_t)st.st_mtime || header.scale != max_radius ||
+	    header.num_levels < 1 || header.num_levels > LOD_MAX_LEVELS ||
+	    fread(levels, sizeof(LodLevel), header.num_levels, fp) != (size_t)header.num_levels) {
+		fclose(fp);
+		return -1;
+	}
+	*full_triangles = levels[0].num_triangles;
+	int32_t chosen = choose_level(levels, header.num_levels, max_triangles, max_error);
+	if (chosen == 0) {
+		fclose(fp);
+		return 0;
+	}
+
+	LodLevel* level = &levels[chosen];
+	float* stored = malloc(MAX(level->num_vertices, 1) * 3 * sizeof(float));
+	uint32_t* indices = malloc(MAX(level->num_triangles, 1) * 3 * sizeof(uint32_t));
+	int32_t loaded = fseek(fp, level->offset, SEEK_SET) == 0 &&
+	                 fread(stored, 3 * sizeof(float), level->num_vertices, fp) == (size_t)level->num_vertices &&
+	                 fread(indices, 3 * sizeof(uint32_t), level->num_triangles, fp) == (size_t)level->num_triangles;
+	fclose(fp);
+	if (loaded) {
+		Vector* positions = malloc(MAX(level->num_vertices, 1) * sizeof(Vector));
+		int64_t i;
+		for (i = 0; i < level->num_vertices; i++) {
+			positions[i] = (Vector){stored[3 * i], stored[3 * i + 1], stored[3 * i + 2]};
+		}
+		replace_mesh(positions, level->num_vertices, indices, level->num_triangles, color);
+		free(positions);
+		*num_triangles = level->num_triangles;
+		*num_vertices = level->num_vertices;
+	}
+	free(stored);
+	free(indices);
+	return loaded ? 1 : -1;
+}
+
+/*
+ * write_levels
+ *
+ * INPUTS: file: the STL file that the object was loaded from
+ *         max_radius: the maximum radius that the object was normalized to
+ *         levels, num_levels: the levels of detail of the object, the first of which is the full object and
+ *                             is only described
+ * SIDE EFFECTS: writes the levels to <file>.lod under a temporary name and renames it into place, if it can be written
+ */
+static void write_levels(char* file, double max_radius, LodMesh* levels, int32_t num_levels) {
+	struct stat st;
+	if (stat(file, &st) != 0) {
+		return;
+	}
+	LodHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, LOD_MAGIC, sizeof(LOD_MAGIC));
+	header.file_size = st.st_size;
+	header.file_mtime = st.st_mtime;
+	header.scale = max_radius;
+	header.num_levels = num_levels;
+
+	LodLevel table[LOD_MAX_LEVELS];
+	int64_t offset = sizeof(header) + num_levels * sizeof(LodLevel);
+	int32_t i;
+	for (i = 0; i < num_levels; i++) {
+		table[i] = (LodLevel){levels[i].num_triangles, levels[i].num_vertices, levels[i].error, (i == 0) ? 0 : offset};
+		if (i > 0) {
+			offset += levels[i].num_vertices * 3 * sizeof(float) + levels[i].num_triangles * 3 * sizeof(uint32_t);
+		}
+	}
+
+	char suffix[32];
+	sprintf(suffix, ".lod.%ld.tmp", (long)getpid());
+	char* temp_path = lod_path(file, suffix);
+	char* path = lod_path(file, ".lod");
+	FILE* fp = fopen(temp_path, "wb");
+	if (fp != NULL) {
+		int32_t written = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+		                  fwrite(table, sizeof(LodLevel), num_levels, fp) == (size_t)num_levels;
+		for (i = 1; i < num_levels && written; i++) {
+			int64_t k;
+			for (k = 0; k < levels[i].num_vertices && written; k++) {
+				float p[3] = {(float)levels[i].positions[k].x, (float)levels[i].positions[k].y, (float)levels[i].positions[k].z};
+				written = fwrite(p, sizeof(p), 1, fp) == 1;
+			}
+			written = written && fwrite(levels[i].indices, 3 * sizeof(uint32_t), levels[i].num_triangles, fp) ==
+			                     (size_t)levels[i].num_triangles;
+		}
+		written &= (fclose(fp) == 0);
+		if (!written || rename(temp_path, path) != 0) {
+			unlink(temp_path);
+		}
+	}
+	free(path);
+	free(temp_path);
+}
+
+/*
+ * simplify_scene
+ *
+ * INPUTS: max_triangles, max_rms_error, threads, color: as for load_lod
+ *         num_triangles, num_vertices: pointers to the size of the scene
+ * SIDE EFFECTS: simplifies the scene until it has at most max_triangles triangles or no edge can be collapsed
+ *               within max_rms_error, replaces the scene with the result and sets the counters to its size
+ */
+static void simplify_scene(int64_t max_triangles, double max_rms_error, int32_t threads, int32_t color,
+                           int64_t* num_triangles, int64_t* num_vertices) {
+	STATS_BEGIN(simplify_start);
+	Simplifier s;
+	LodMesh mesh;
+	init_simplifier(&s, *num_triangles, *num_vertices, MAX(1, threads));
+	simplify(&s, max_triangles, max_rms_error);
+	export_mesh(&s, &mesh);
+	free_simplifier(&s);
+	replace_mesh(mesh.positions, mesh.num_vertices, mesh.indices, mesh.num_triangles, color);
+	*num_triangles = mesh.num_triangles;
+	*num_vertices = mesh.num_vertices;
+	free(mesh.positions);
+	free(mesh.indices);
+	STATS_END(STAGE_SIMPLIFY, simplify_start);
+}
+
+/*
+ * load_lod
+ *
+ * INPUTS: file: the STL file path
+ *         max_radius: the maximum distance from the center that each of the vertices in the object should have
+ *         max_triangles: the number of triangles to simplify the object down to, or 0 for no limit
+ *         max_rms_error: the area weighted root mean square distance that simplifying may move the surface of
+ *                        the object by, in the units of the normalized object, or INFINITY for no limit
+ *         cached: nonzero if the levels of detail should be read from (or built and written to) <file>.lod
+ *         threads: the number of threads to simplify with
+ *         color: the color of the object
+ *         num_triangles, num_vertices: pointers to these counters, which are set to the size of the loaded object
+ * SIDE EFFECTS: loads the object like parse_and_insert_STL and simplifies it until it has at most max_triangles
+ *               triangles or simplifying it further would move its surface by more than max_rms_error
+ *               when cached, the object is instead loaded from the coarsest cached level that meets the same limits,
+ *               and the full object is only read when no cached level does or the cache does not match the file
+ *
+ * The error of a collapse is the area weighted root mean square distance of the new vertex from the planes
+ * of the original triangles that it stands for, so parts of the surface such as sharp corners can move further
+ * than max_rms_error. Cached levels only halve the number of triangles down to LOD_MIN_TRIANGLES, so a level
+ * with more than max_triangles triangles is simplified further on every load, measuring the error from the level.
+ */
+void load_lod(char* file, double max_radius, int64_t max_triangles, double max_rms_error, int32_t cached,
+              int32_t threads, int32_t color, int64_t* num_triangles, int64_t* num_vertices) {
+	// Without a triangle limit, the object is simplified as far as max_rms_error allows
+	max_triangles = MAX(0, max_triangles);
+	int64_t full_triangles = 0;
+	int32_t found = -1;
+	if (cached) {
+		STATS_BEGIN(cache_start);
+		found = read_cached_level(file, max_radius, max_triangles, max_rms_error, color, num_triangles, num_vertices, &full_triangles);
+		STATS_END(STAGE_LOD_CACHE, cache_start);
+	}
+
+	if (found != 1) {
+		parse_and_insert_STL(file, max_radius, num_triangles, num_vertices, color);
+		full_triangles = *num_triangles;
+	}
+	if (found == -1 && cached && *num_triangles > 0) {
+		// Halve the object until it is small, keeping every level, and pick from the levels as a later picture would
+		STATS_BEGIN(simplify_start);
+		Simplifier s;
+		init_simplifier(&s, *num_triangles, *num_vertices, MAX(1, threads));
+		LodMesh levels[LOD_MAX_LEVELS];
+		LodLevel table[LOD_MAX_LEVELS];
+		int32_t num_levels = 1;
+		levels[0] = (LodMesh){*num_vertices, NULL, *num_triangles, NULL, 0};
+		while (num_levels < LOD_MAX_LEVELS && s.num_triangles > LOD_MIN_TRIANGLES) {
+			int64_t before = s.num_triangles;
+			simplify(&s, MAX(LOD_MIN_TRIANGLES, levels[num_levels - 1].num_triangles / 2), INFINITY);
+			if (s.num_triangles == before) {
+				break;
+			}
+			export_mesh(&s, &levels[num_levels++]);
+		}
+		free_simplifier(&s);
+		int32_t i;
+		for (i = 0; i < num_levels; i++) {
+			table[i] = (LodLevel){levels[i].num_triangles, levels[i].num_vertices, levels[i].error, 0};
+		}
+		int32_t level = choose_level(table, num_levels, max_triangles, max_rms_error);
+		if (level > 0) {
+			replace_mesh(levels[level].positions, levels[level].num_vertices, levels[level].indices,
+			             levels[level].num_triangles, color);
+			*num_triangles = levels[level].num_triangles;
+			*num_vertices = levels[level].num_vertices;
+		}
+		STATS_END(STAGE_SIMPLIFY, simplify_start);
+
+		STATS_BEGIN(cache_start);
+		write_levels(file, max_radius, levels, num_levels);
+		STATS_END(STAGE_LOD_CACHE, cache_start);
+		for (i = 1; i < num_levels; i++) {
+			free(levels[i].positions);
+			free(levels[i].indices);
+		}
+	}
+
+	// Cached levels only come in halving steps, so with a triangle limit the chosen level (or the full object, if
+	// no level is within max_rms_error) is simplified the rest of the way to it
+	int32_t further = !cached || max_triangles > 0;
+	if (further && *num_triangles > max_triangles && max_rms_error > 0) {
+		simplify_scene(max_triangles, max_rms_error, threads, color, num_triangles, num_vertices);
+	}
+	STATS_COUNT(COUNTER_TRIANGLES_SIMPLIFIED, full_triangles - *num_triangles);
+}
@@ -0,0 +1,29 @@
+#ifndef LOD_H
+#define LOD_H
+
+#include <stdint.h>
+
+/*
+ * load_lod
+ *
+ * INPUTS: file: the STL file path
+ *         max_radius: the maximum distance from the center that each of the vertices in the object should have
+ *         max_triangles: the number of triangles to simplify the object down to, or 0 for no limit
+ *         max_rms_error: the area weighted root mean square distance that simplifying may move the surface of
+ *                        the object by, in the units of the normalized object, or INFINITY for no limit
+ *         cached: nonzero if the levels of detail should be read from (or built and written to) <file>.lod
+ *         threads: the number of threads to simplify with
+ *         color: the color of the object
+ *         num_triangles, num_vertices: pointers to these counters, which are set to the size of the loaded object
+ * SIDE EFFECTS: loads the object like parse_and_insert_STL and simplifies it until it has at most max_triangles
+ *               triangles or simplifying it further would move its surface by more than max_rms_error
+ *               when cached, the object is instead loaded from the coarsest cached level that meets the same limits,
+ *               and the full object is only read when no cached level does or the cache does not match the file
+ *
+ * The limit is on the root mean square distance, not the largest one, so parts of the surface such as sharp
+ * corners can move further than max_rms_error.
+ */
+extern void load_lod(char* file, double max_radius, int64_t max_triangles, double max_rms_error, int32_t cached,
+                     int32_t threads, int32_t color, int64_t* num_triangles, int64_t* num_vertices);
+
+#endif
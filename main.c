@@ -34,10 +34,17 @@
  *              functions and structures file scope.
  */
 
+#include <math.h>
 #include <png.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "bvh.h"
+#include "cache.h"
+#include "mesh.h"
+#include "pipeline.h"
 #include "renderer.h"
+#include "stats.h"
 #include "vector.h"
 
 /*
@@ -54,13 +61,71 @@ typedef struct {
 static int32_t color = 0x00FFFFFF; // File-scope variable for the color of pixels, currently white.
 static pixel_t * picture_data = NULL; // File-scope pointer to an array of pixels
 
+// The PNG stream that rows are written to, and the buffer holding the row being written
+static FILE * png_fp = NULL;
+static png_structp png_ptr = NULL;
+static png_infop info_ptr = NULL;
+static png_byte * png_row = NULL;
+
 static pixel_t int_to_pixel(int32_t integer);
 static void make_png(char * str);
+static int32_t begin_png(char * str);
+static void write_png_row();
+static void end_png();
 static void free_image_data();
+static int32_t parse_options(int argc, char * argv[]);
+static void report_progressive_bench();
+static void report_lod_bench(char * file, double scale, Vector camera_location, double angle, int32_t color);
+
+static char * stats_file = NULL; // File to write the statistics JSON to, if any
+static char * trace_file = NULL; // File to write the Chrome trace to, if any
+static int32_t progressive = 0; // Whether the picture is drawn in coarse-to-fine passes
+static int32_t tiled = 0; // Whether the picture is drawn in bands and streamed to the PNG file
+static int32_t pipelined = 0; // Whether the picture is drawn by concurrent pipeline stages
+static int32_t meshlets = 0; // Whether the object is split into meshlets that are culled as a whole
+static int32_t points = 0; // The size of the square drawn for each triangle at its centroid, or 0 to draw triangles
+static int32_t backface_culling = 0; // Whether triangles facing away from the camera are skipped
+static int32_t normalization_set = 0; // Whether the normalization of the object was given, and what it is
+static Vector normalization_center;
+static double normalization_radius = 0;
+static int32_t reorder = 0; // Whether the triangles are sorted along a Morton curve after they are loaded
+static Engine engine = ENGINE_RASTER; // The way the picture is drawn
+static int32_t time_budget = 0; // Whether drawing stops after a time budget, which makes the picture depend on timing
+
+// The root mean square screen-space error in pixels that --lod=auto simplifies objects to
+#define LOD_AUTO_RMS_PIXELS 0.5
+
+// The limits that objects are simplified to (0 for none), whether their levels of detail are cached,
+// and whether the picture is also drawn from the full object to report what simplifying changed
+static int64_t lod_max_triangles = 0;
+static double lod_rms_pixels = 0;
+static int32_t lod_cache = 0;
+static int32_t lod_bench = 0;
+
+// The directory that finished pictures are cached in, if any, and the limit on its size
+static char * cache_dir = NULL;
+static int64_t cache_bytes = CACHE_DEFAULT_BYTES;
+
+#define MAX_SNAPSHOTS 64
+
+// Copies of picture_data after every progressive pass, kept for --progressive-bench
+static int32_t progressive_bench = 0;
+static int32_t num_snapshots = 0;
+static pixel_t * snapshots[MAX_SNAPSHOTS];
+static int64_t snapshot_triangles[MAX_SNAPSHOTS];
+static uint64_t snapshot_ns[MAX_SNAPSHOTS];
 
 int main(int argc, char * argv[]) {
+	argc = parse_options(argc, argv);
+	if (argc < 0) {
+		return 1;
+	}
+
 	// Initialize variables
-	picture_data = malloc(WIDTH * HEIGHT * sizeof(pixel_t));
+	if (!tiled) {
+		picture_data = malloc((int64_t)image_width * image_height * sizeof(pixel_t));
+		STATS_COUNT(COUNTER_BYTES_ALLOCATED, (int64_t)image_width * image_height * sizeof(pixel_t));
+	}
 	
 	char* file;
 	double scale = 1.0;
@@ -75,6 +140,34 @@ int main(int argc, char * argv[]) {
 		printf("   <angle> indicates the amount that the camera will be rotated clockwise from its default orientation\n");
 		printf("   and <color> is the hex color\n");
 		printf("The object will be placed at the origin\n");
+		printf("Options (may appear anywhere):\n");
+		printf("   --stats=<file>   write per-stage timings and counters as JSON (\"-\" for stdout)\n");
+		printf("   --trace=<file>   write per-stage timings and counters as a Chrome trace\n");
+		printf("   --vertex-format=<double|float|quantized>   how vertex positions are stored (default: double)\n");
+		printf("   --size=<w>x<h>   the size of the image in pixels (default: %dx%d)\n", WIDTH, HEIGHT);
+		printf("   --tiled[=<rows>] draw the image in bands of <rows> rows (default: 256) and stream them to the PNG file\n");
+		printf("   --threads=<n>    the number of threads to draw with (default: 1)\n");
+		printf("   --progressive    draw the picture in coarse-to-fine passes\n");
+		printf("   --budget=<ms>    draw progressively and stop after <ms> milliseconds with the best picture so far\n");
+		printf("   --progressive-bench   draw progressively to the end and report the error of every pass against the final picture\n");
+		printf("   --pipeline       read, decode, transform and draw the object on concurrent threads\n");
+		printf("   --normalization=<x>,<y>,<z>,<r>   the center and radius of the object, which lets --pipeline draw while reading\n");
+		printf("                    (otherwise they are cached in <STL file>.norm by the first pipelined run)\n");
+		printf("   --meshlets       split the object into meshlets of 64-128 triangles and skip the ones outside of the view\n");
+		printf("   --cull-backfaces skip triangles (and meshlets) facing away from the camera, for closed objects\n");
+		printf("   --reorder        sort the triangles along a Morton curve after loading them, so that consecutive triangles are close together\n");
+		printf("   --points[=<n>]   draw each triangle as an <n> by <n> pixel square at its centroid (default: 1), for very dense meshes\n");
+		printf("   --engine=<raster|ray|auto>   rasterize every triangle, cast a ray through every pixel, or pick whichever is\n");
+		printf("                    expected to be faster from the number of triangles per pixel (default: raster); rays\n");
+		printf("                    use a hierarchy cached in <file>.bvh, which auto only uses once ray has built it\n");
+		printf("   --lod=<n|auto>   simplify the object to at most <n> triangles, or with --lod-rms=0.5\n");
+		printf("   --lod-rms=<px>   simplify the object until its surface would move by more than <px> pixels on screen, as an\n");
+		printf("                    area weighted root mean square, so single points can still move further\n");
+		printf("   --lod-cache      keep levels of detail of the object in <STL file>.lod, so later pictures can skip reading all of it\n");
+		printf("   --lod-bench      draw the picture from the full and the simplified object and report the time saved and the difference\n");
+		printf("   --cache=<dir>    reuse pictures cached in <dir> for the same STL contents and parameters, and cache new ones there\n");
+		printf("   --cache-size=<MB>   the most that the pictures in the cache can take up before the least recently used are removed (default: %lld)\n",
+		       CACHE_DEFAULT_BYTES >> 20);
 		return 0;
 	}
 	if (argc >= 2) {
@@ -104,13 +197,356 @@ int main(int argc, char * argv[]) {
 
 	angle *= 3.14159 / 180;
 
-	draw_picture(file, scale, camera_location, angle, color);
-	make_png("image.png");
+	char key[CACHE_KEY_LENGTH] = "";
+	int32_t cached = 0;
+	if (cache_dir != NULL) {
+		// The key is built from the parsed settings in a fixed order, so that every spelling of the same picture
+		// shares it. Tiling, threads and the reports only change how the picture is made, so they are left out.
+		// ENGINE_AUTO only casts rays once <file>.bvh holds a hierarchy for the object, so that is part of the key
+		int64_t bvh_triangles = (engine == ENGINE_AUTO) ? cached_bvh_triangles(file, scale) : -1;
+		char parameters[512];
+		snprintf(parameters, sizeof(parameters),
+		         "%.17g %.17g %.17g %.17g %.17g %06x %dx%d progressive=%d pipelined=%d normalization=%d,%.17g,%.17g,%.17g,%.17g "
+		         "meshlets=%d backfaces=%d reorder=%d points=%d engine=%d,%lld vertex_format=%d lod=%lld,%.17g,%d",
+		         scale, angle, camera_location.x, camera_location.y, camera_location.z, color, image_width, image_height,
+		         progressive, pipelined, normalization_set, normalization_center.x, normalization_center.y,
+		         normalization_center.z, normalization_radius, meshlets, backface_culling, reorder, points, (int32_t)engine,
+		         (long long)bvh_triangles, (int32_t)vertex_format, (long long)lod_max_triangles, lod_rms_pixels, lod_cache);
+		cached = cache_lookup(cache_dir, file, parameters, key, "image.png");
+	}
+
+	if (cached) {
+		printf("Found in the image cache\n");
+	} else if (tiled) {
+		// Rows are encoded as they arrive, so encoding is timed along with drawing
+		if (begin_png("image.png")) {
+			draw_picture(file, scale, camera_location, angle, color);
+			end_png();
+		}
+	} else {
+		if (lod_bench) {
+			report_lod_bench(file, scale, camera_location, angle, color);
+		} else {
+			draw_picture(file, scale, camera_location, angle, color);
+		}
+		if (progressive_bench) {
+			report_progressive_bench();
+		}
+		STATS_BEGIN(png_start);
+		make_png("image.png");
+		STATS_END(STAGE_PNG_ENCODE, png_start);
+	}
+	if (cache_dir != NULL && !cached) {
+		cache_store(cache_dir, key, "image.png", cache_bytes);
+	}
+
+	if (stats_file != NULL) {
+		stats_write_json(stats_file);
+	}
+	if (trace_file != NULL) {
+		stats_write_trace(trace_file);
+	}
 
 	free_image_data();								
 	return 0;
 }
 
+/*
+ * parse_options
+ *
+ * INPUTS: argc, argv: the arguments passed to main
+ * OUTPUTS: removes all arguments starting with "--" from argv, leaving the positional arguments in order
+ * RETURN VALUE: the number of remaining arguments, or -1 if an option was not recognized
+ * SIDE EFFECTS: sets the file-scope option variables and enables statistics if requested
+ */
+static int32_t parse_options(int argc, char * argv[]) {
+	int32_t i;
+	int32_t remaining = 1;
+	for (i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "--", 2) != 0) {
+			argv[remaining++] = argv[i];
+			continue;
+		}
+		if (strncmp(argv[i], "--stats=", 8) == 0) {
+			stats_file = argv[i] + 8;
+			stats_enabled = 1;
+		} else if (strncmp(argv[i], "--trace=", 8) == 0) {
+			trace_file = argv[i] + 8;
+			stats_enabled = 1;
+		} else if (strncmp(argv[i], "--size=", 7) == 0) {
+			int32_t width, height;
+			if (sscanf(argv[i] + 7, "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0) {
+				fprintf(stderr, "Invalid image size %s\n", argv[i] + 7);
+				return -1;
+			}
+			set_image_size(width, height);
+		} else if (strcmp(argv[i], "--tiled") == 0 || strncmp(argv[i], "--tiled=", 8) == 0) {
+			int32_t band_rows = 256;
+			if (argv[i][7] == '=' && (sscanf(argv[i] + 8, "%d", &band_rows) != 1 || band_rows <= 0)) {
+				fprintf(stderr, "Invalid band height %s\n", argv[i] + 8);
+				return -1;
+			}
+			set_tiled(band_rows);
+			tiled = 1;
+		} else if (strncmp(argv[i], "--threads=", 10) == 0) {
+			int32_t threads;
+			if (sscanf(argv[i] + 10, "%d", &threads) != 1 || threads <= 0) {
+				fprintf(stderr, "Invalid thread count %s\n", argv[i] + 10);
+				return -1;
+			}
+			set_threads(threads);
+		} else if (strcmp(argv[i], "--progressive") == 0) {
+			set_progressive(1, 0);
+			progressive = 1;
+		} else if (strncmp(argv[i], "--budget=", 9) == 0) {
+			double budget_ms;
+			if (sscanf(argv[i] + 9, "%lf", &budget_ms) != 1 || budget_ms <= 0) {
+				fprintf(stderr, "Invalid time budget %s\n", argv[i] + 9);
+				return -1;
+			}
+			set_progressive(1, budget_ms);
+			progressive = 1;
+			time_budget = 1;
+		} else if (strcmp(argv[i], "--progressive-bench") == 0) {
+			set_progressive(1, 0);
+			progressive = 1;
+			progressive_bench = 1;
+		} else if (strcmp(argv[i], "--pipeline") == 0) {
+			set_pipelined(1);
+			pipelined = 1;
+		} else if (strncmp(argv[i], "--normalization=", 16) == 0) {
+			Vector center;
+			double radius;
+			if (sscanf(argv[i] + 16, "%lf,%lf,%lf,%lf", &center.x, &center.y, &center.z, &radius) != 4 || radius <= 0) {
+				fprintf(stderr, "Invalid normalization %s\n", argv[i] + 16);
+				return -1;
+			}
+			set_normalization(center, radius);
+			normalization_set = 1;
+			normalization_center = center;
+			normalization_radius = radius;
+		} else if (strcmp(argv[i], "--meshlets") == 0) {
+			set_meshlets(1);
+			meshlets = 1;
+		} else if (strcmp(argv[i], "--cull-backfaces") == 0) {
+			set_backface_culling(1);
+			backface_culling = 1;
+		} else if (strcmp(argv[i], "--reorder") == 0) {
+			set_reorder(1);
+			reorder = 1;
+		} else if (strcmp(argv[i], "--points") == 0 || strncmp(argv[i], "--points=", 9) == 0) {
+			int32_t size = 1;
+			if (argv[i][8] == '=' && (sscanf(argv[i] + 9, "%d", &size) != 1 || size <= 0)) {
+				fprintf(stderr, "Invalid point size %s\n", argv[i] + 9);
+				return -1;
+			}
+			set_point_size(size);
+			points = size;
+		} else if (strcmp(argv[i], "--engine=raster") == 0) {
+			engine = ENGINE_RASTER;
+			set_engine(engine);
+		} else if (strcmp(argv[i], "--engine=ray") == 0) {
+			engine = ENGINE_RAY;
+			set_engine(engine);
+		} else if (strcmp(argv[i], "--engine=auto") == 0) {
+			engine = ENGINE_AUTO;
+			set_engine(engine);
+		} else if (strcmp(argv[i], "--lod=auto") == 0) {
+			lod_rms_pixels = LOD_AUTO_RMS_PIXELS;
+		} else if (strncmp(argv[i], "--lod=", 6) == 0) {
+			long long max_triangles;
+			if (sscanf(argv[i] + 6, "%lld", &max_triangles) != 1 || max_triangles <= 0) {
+				fprintf(stderr, "Invalid triangle count %s\n", argv[i] + 6);
+				return -1;
+			}
+			lod_max_triangles = max_triangles;
+		} else if (strncmp(argv[i], "--lod-rms=", 10) == 0) {
+			if (sscanf(argv[i] + 10, "%lf", &lod_rms_pixels) != 1 || lod_rms_pixels <= 0) {
+				fprintf(stderr, "Invalid screen-space error %s\n", argv[i] + 10);
+				return -1;
+			}
+		} else if (strcmp(argv[i], "--lod-cache") == 0) {
+			lod_cache = 1;
+		} else if (strcmp(argv[i], "--lod-bench") == 0) {
+			lod_bench = 1;
+		} else if (strncmp(argv[i], "--cache=", 8) == 0) {
+			cache_dir = argv[i] + 8;
+		} else if (strncmp(argv[i], "--cache-size=", 13) == 0) {
+			double megabytes;
+			if (sscanf(argv[i] + 13, "%lf", &megabytes) != 1 || megabytes < 0) {
+				fprintf(stderr, "Invalid cache size %s\n", argv[i] + 13);
+				return -1;
+			}
+			cache_bytes = (int64_t)(megabytes * (1 << 20));
+		} else if (strcmp(argv[i], "--vertex-format=double") == 0) {
+			set_vertex_format(VERTEX_DOUBLE);
+		} else if (strcmp(argv[i], "--vertex-format=float") == 0) {
+			set_vertex_format(VERTEX_FLOAT);
+		} else if (strcmp(argv[i], "--vertex-format=quantized") == 0) {
+			set_vertex_format(VERTEX_QUANTIZED);
+		} else {
+			fprintf(stderr, "Unrecognized option %s\n", argv[i]);
+			return -1;
+		}
+	}
+	if (tiled && (progressive_bench || progressive)) {
+		fprintf(stderr, "Tiled pictures cannot be drawn progressively\n");
+		return -1;
+	}
+	if (pipelined && (tiled || progressive)) {
+		fprintf(stderr, "Pipelined pictures cannot be drawn tiled or progressively\n");
+		return -1;
+	}
+	if (normalization_set && !pipelined) {
+		fprintf(stderr, "--normalization is only used by pipelined pictures, so it needs --pipeline\n");
+		return -1;
+	}
+	if (reorder && pipelined) {
+		fprintf(stderr, "Pipelined pictures draw triangles as they are read, so they cannot be reordered\n");
+		return -1;
+	}
+	if (reorder && (engine != ENGINE_RASTER || meshlets)) {
+		fprintf(stderr, "Only triangles that are rasterized without meshlets can be reordered\n");
+		return -1;
+	}
+	if (points && (tiled || progressive || pipelined)) {
+		fprintf(stderr, "Points can only be drawn when the whole picture is drawn at once on one thread\n");
+		return -1;
+	}
+	if (meshlets && (tiled || progressive || pipelined)) {
+		fprintf(stderr, "Meshlets can only be used when the whole picture is drawn at once\n");
+		return -1;
+	}
+	if (engine == ENGINE_RAY && (tiled || progressive || pipelined || meshlets || points)) {
+		fprintf(stderr, "Ray cast pictures can only be drawn whole, without meshlets or points\n");
+		return -1;
+	}
+	if (engine == ENGINE_AUTO && pipelined) {
+		fprintf(stderr, "Pipelined pictures are always rasterized\n");
+		return -1;
+	}
+	if (cache_dir != NULL && (time_budget || progressive_bench)) {
+		fprintf(stderr, "Pictures drawn with a time budget or for --progressive-bench cannot be cached\n");
+		return -1;
+	}
+	int32_t lod = (lod_max_triangles > 0 || lod_rms_pixels > 0);
+	if ((lod_cache || lod_bench) && !lod) {
+		fprintf(stderr, "--lod-cache and --lod-bench need a level of detail from --lod or --lod-rms\n");
+		return -1;
+	}
+	if (lod && pipelined) {
+		fprintf(stderr, "Pipelined pictures draw triangles as they are read, so they cannot be simplified\n");
+		return -1;
+	}
+	if (lod_bench && (tiled || progressive_bench || cache_dir != NULL)) {
+		fprintf(stderr, "--lod-bench needs the whole picture in memory, and cannot be combined with --progressive-bench or --cache\n");
+		return -1;
+	}
+	set_lod(lod_max_triangles, lod_rms_pixels, lod_cache);
+	argv[remaining] = NULL;
+	return remaining;
+}
+
+/*
+ * progressive_pass_done
+ *
+ * INPUTS: pass: the index of the progressive pass that was just finished
+ *         triangles_drawn: the total number of triangles drawn so far
+ *         elapsed_ns: the time since draw_picture started
+ * OUTPUTS: none
+ * RETURN VALUE: none
+ * SIDE EFFECTS: saves a copy of picture_data if --progressive-bench was given
+ */
+void progressive_pass_done(int32_t pass, int64_t triangles_drawn, uint64_t elapsed_ns) {
+	if (!progressive_bench || num_snapshots == MAX_SNAPSHOTS) {
+		return;
+	}
+	snapshots[num_snapshots] = malloc((int64_t)image_width * image_height * sizeof(pixel_t));
+	memcpy(snapshots[num_snapshots], picture_data, (int64_t)image_width * image_height * sizeof(pixel_t));
+	snapshot_triangles[num_snapshots] = triangles_drawn;
+	snapshot_ns[num_snapshots] = elapsed_ns;
+	num_snapshots++;
+}
+
+/*
+ * compare_pictures
+ *
+ * INPUTS: picture, reference: two pictures of image_width by image_height pixels
+ * OUTPUTS: rmse: the root mean square difference of their color channels
+ *          wrong_pixels: the fraction of pixels that differ
+ * RETURN VALUE: none
+ * SIDE EFFECTS: none
+ */
+static void compare_pictures(pixel_t * picture, pixel_t * reference, double * rmse, double * wrong_pixels) {
+	int64_t k;
+	int64_t wrong = 0;
+	double squared_error = 0;
+	int64_t size = (int64_t)image_width * image_height;
+	for (k = 0; k < size; k++) {
+		pixel_t a = picture[k];
+		pixel_t b = reference[k];
+		double dr = a.red - b.red;
+		double dg = a.green - b.green;
+		double db = a.blue - b.blue;
+		squared_error += dr * dr + dg * dg + db * db;
+		wrong += (dr != 0 || dg != 0 || db != 0);
+	}
+	*rmse = sqrt(squared_error / (3.0 * size));
+	*wrong_pixels = (double)wrong / size;
+}
+
+/*
+ * report_progressive_bench
+ *
+ * INPUTS: none
+ * OUTPUTS: prints one JSON object per progressive pass with the time at which it finished and the
+ *          error of the picture at that point against the finished picture in picture_data
+ * RETURN VALUE: none
+ * SIDE EFFECTS: frees the saved snapshots
+ */
+static void report_progressive_bench() {
+	int32_t i;
+	for (i = 0; i < num_snapshots; i++) {
+		double rmse, wrong_pixels;
+		compare_pictures(snapshots[i], picture_data, &rmse, &wrong_pixels);
+		printf("{\"pass\": %d, \"ms\": %.3f, \"triangles\": %lld, \"rmse\": %.4f, \"wrong_pixels\": %.4f}\n",
+		       i, snapshot_ns[i] / 1e6, (long long)snapshot_triangles[i], rmse, wrong_pixels);
+		free(snapshots[i]);
+	}
+	num_snapshots = 0;
+}
+
+/*
+ * report_lod_bench
+ *
+ * INPUTS: file, scale, camera_location, angle, color: the parameters of the picture
+ * OUTPUTS: prints a JSON object with the time taken to draw the picture from the full object and from the
+ *          simplified one, and the error of the simplified picture against the full one
+ * RETURN VALUE: none
+ * SIDE EFFECTS: draws the picture twice, leaving the simplified picture in picture_data
+ *               the statistics cover both pictures
+ */
+static void report_lod_bench(char * file, double scale, Vector camera_location, double angle, int32_t color) {
+	int64_t size = (int64_t)image_width * image_height;
+	set_lod(0, 0, 0);
+	uint64_t full_start = stats_now();
+	draw_picture(file, scale, camera_location, angle, color);
+	uint64_t full_ns = stats_now() - full_start;
+	pixel_t * full = malloc(size * sizeof(pixel_t));
+	memcpy(full, picture_data, size * sizeof(pixel_t));
+
+	set_lod(lod_max_triangles, lod_rms_pixels, lod_cache);
+	uint64_t lod_start = stats_now();
+	draw_picture(file, scale, camera_location, angle, color);
+	uint64_t lod_ns = stats_now() - lod_start;
+
+	double rmse, wrong_pixels;
+	compare_pictures(picture_data, full, &rmse, &wrong_pixels);
+	printf("{\"full_ms\": %.3f, \"lod_ms\": %.3f, \"saved_ms\": %.3f, \"rmse\": %.4f, \"wrong_pixels\": %.4f}\n",
+	       full_ns / 1e6, lod_ns / 1e6, ((double)full_ns - lod_ns) / 1e6, rmse, wrong_pixels);
+	free(full);
+}
+
 /* 
  *  free_image_data
  *	 
@@ -192,8 +628,8 @@ void set_color(int32_t new_color){
  * SIDE EFFECTS: none
  */
 int32_t draw_dot(int32_t x, int32_t y){
-	if(x >= 0 && x < WIDTH && y >= 0 && y < HEIGHT){
-		picture_data[y*WIDTH + x] = int_to_pixel(color);
+	if(x >= 0 && x < image_width && y >= 0 && y < image_height){
+		picture_data[(int64_t)y*image_width + x] = int_to_pixel(color);
 		return 1;
 	}
 	else{
@@ -203,122 +639,179 @@ int32_t draw_dot(int32_t x, int32_t y){
 
 
 /* 
- *  make_png
+ *  begin_png
  *	 
- * Created by ECE 220H course staff
+ * Created by ECE 220H course staff, split up so that rows can be streamed in
  *	
  *	
  * INPUTS: str -- a string that tells the name of the file to write to
- *         also utilizes picture_data.
- * OUTPUTS: No direct outputs, creates a file given by str, after translating data from picture_data.
- * RETURN VALUE: none
- * SIDE EFFECTS: none
+ * OUTPUTS: creates a file given by str and writes the PNG header for an image_width by image_height picture
+ * RETURN VALUE: 1 if the file was created, 0 otherwise
+ * SIDE EFFECTS: sets up the file-scope PNG stream that write_png_row and end_png write to
  */
-static void make_png(char * str){
-    FILE * fp;
-    png_structp png_ptr = NULL;
-    png_infop info_ptr = NULL;
-    size_t x, y;
-    png_byte ** row_pointers = NULL;
-    /* "status" contains the return value of this function. At first
-       it is set to a value which means 'failure'. When the routine
-       has finished its work, it is set to a value which means
-       'success'. */
-    int32_t status = -1;
+static int32_t begin_png(char * str){
     /* The following number is set by trial and error only. I cannot
        see where it it is documented in the libpng manual.
     */
-    int32_t pixel_size = 3;
     int32_t depth = 8;
 
-    fp = fopen (str, "wb");
-    if (! fp) {
-        //goto fopen_failed;
+    png_fp = fopen (str, "wb");
+    if (! png_fp) {
 				fprintf(stderr, "Failed to get file.");
-				return;
-
+				return 0;
     }
 
     png_ptr = png_create_write_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
     if (png_ptr == NULL) {
 			fprintf(stderr, "PNG Failure. /n Failed to create PNG write struct.");
-			fclose (fp);
-	        //fopen_failed:
-			return;
-
-			//goto png_create_write_struct_failed;
+			fclose (png_fp);
+			return 0;
     }
 
     info_ptr = png_create_info_struct (png_ptr);
     if (info_ptr == NULL) {
-        //goto png_create_info_struct_failed; // Ew GOTOs are supposed to be evil. Even though they were decent here.
 				png_destroy_write_struct (&png_ptr, &info_ptr);
-		 //png_create_write_struct_failed:
-				fclose (fp);
-		 //fopen_failed:
-				return;
+				fclose (png_fp);
+				return 0;
 		}
 
-    /* Set up error handling. */
+    /* Set up error handling. Every function that calls into libpng sets
+       its own jump point, since this one returns before the rows are written. */
 
     if (setjmp (png_jmpbuf (png_ptr))) {
-        //goto png_failure;
-				// If anyone does read this. Remember kids, GOTOs do not exist.
 				png_destroy_write_struct (&png_ptr, &info_ptr);
-		 //png_create_write_struct_failed:
-				fclose (fp);
-		 //fopen_failed:
-				return;
+				fclose (png_fp);
+				return 0;
     }
 
     /* Set image attributes. */
 
     png_set_IHDR (png_ptr,
                   info_ptr,
-                  WIDTH,
-                  HEIGHT,
+                  image_width,
+                  image_height,
                   depth,
                   PNG_COLOR_TYPE_RGB,
                   PNG_INTERLACE_NONE,
                   PNG_COMPRESSION_TYPE_DEFAULT,
                   PNG_FILTER_TYPE_DEFAULT);
 
-    /* Initialize rows of PNG. */
+    png_init_io (png_ptr, png_fp);
+    png_write_info (png_ptr, info_ptr);
 
-    row_pointers = png_malloc (png_ptr, HEIGHT * sizeof (png_byte *));
-    for (y = 0; y < HEIGHT; y++) {
-        png_byte *row =
-            png_malloc (png_ptr, sizeof (unsigned char) * WIDTH * pixel_size);
-        row_pointers[y] = row;
-        for (x = 0; x < WIDTH; x++) {
-            pixel_t pixel = picture_data[y*WIDTH + x];
-            *row++ = pixel.red;
-            *row++ = pixel.green;
-            *row++ = pixel.blue;
-        }
-    }
+    /* One row is converted and written at a time. */
 
-    /* Write the image data to "fp". */
+    png_row = png_malloc (png_ptr, sizeof (unsigned char) * image_width * 3);
+    return 1;
+}
 
-    png_init_io (png_ptr, fp);
-    png_set_rows (png_ptr, info_ptr, row_pointers);
-    png_write_png (png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
+/* 
+ *  write_png_row
+ *	 
+ *	
+ * INPUTS: none, writes the row in png_row
+ * OUTPUTS: appends png_row to the PNG stream started by begin_png
+ * RETURN VALUE: none
+ * SIDE EFFECTS: abandons the PNG stream if libpng fails
+ */
+static void write_png_row(){
+    if (png_ptr == NULL) {
+        return;
+    }
 
-    /* The routine has successfully written the file, so we set
-       "status" to a value which indicates success. */
+    if (setjmp (png_jmpbuf (png_ptr))) {
+				fprintf(stderr, "PNG Failure. /n Failed to write a row.");
+				png_destroy_write_struct (&png_ptr, &info_ptr);
+				fclose (png_fp);
+				png_ptr = NULL;
+				return;
+    }
 
-    status++;
+    png_write_row (png_ptr, png_row);
+}
 
-    for (y = 0; y < HEIGHT; y++) {
-        png_free (png_ptr, row_pointers[y]);
+/* 
+ *  end_png
+ *	 
+ *	
+ * INPUTS: none
+ * OUTPUTS: finishes the PNG stream started by begin_png and closes the file
+ * RETURN VALUE: none
+ * SIDE EFFECTS: none
+ */
+static void end_png(){
+    if (png_ptr == NULL) {
+        return;
     }
-    png_free (png_ptr, row_pointers);
 
- //png_failure:
- //png_create_info_struct_failed:
+    if (setjmp (png_jmpbuf (png_ptr))) {
+				png_destroy_write_struct (&png_ptr, &info_ptr);
+				fclose (png_fp);
+				png_ptr = NULL;
+				return;
+    }
+
+    png_write_end (png_ptr, info_ptr);
+    png_free (png_ptr, png_row);
     png_destroy_write_struct (&png_ptr, &info_ptr);
- //png_create_write_struct_failed:
-    fclose (fp);
- //fopen_failed:
-    return;
-}
\ No newline at end of file
+    fclose (png_fp);
+    png_ptr = NULL;
+}
+
+/* 
+ *  write_row
+ *	 
+ *	
+ * INPUTS: y -- the index of the row, which are passed in order from top to bottom
+ *         row -- the colors of the image_width pixels in the row
+ * OUTPUTS: converts the row and appends it to the PNG stream
+ * RETURN VALUE: none
+ * SIDE EFFECTS: none
+ */
+void write_row(int32_t y, const int32_t * row){
+    int32_t x;
+    png_byte * out = png_row;
+    if (png_ptr == NULL) {
+        return;
+    }
+    for (x = 0; x < image_width; x++) {
+        pixel_t pixel = int_to_pixel(row[x]);
+        *out++ = pixel.red;
+        *out++ = pixel.green;
+        *out++ = pixel.blue;
+    }
+    write_png_row();
+}
+
+/* 
+ *  make_png
+ *	 
+ * Created by ECE 220H course staff
+ *	
+ *	
+ * INPUTS: str -- a string that tells the name of the file to write to
+ *         also utilizes picture_data.
+ * OUTPUTS: No direct outputs, creates a file given by str, after translating data from picture_data.
+ * RETURN VALUE: none
+ * SIDE EFFECTS: none
+ */
+static void make_png(char * str){
+    int64_t x, y;
+
+    if (! begin_png (str)) {
+        return;
+    }
+
+    for (y = 0; y < image_height && png_ptr != NULL; y++) {
+        png_byte * row = png_row;
+        for (x = 0; x < image_width; x++) {
+            pixel_t pixel = picture_data[y*image_width + x];
+            *row++ = pixel.red;
+            *row++ = pixel.green;
+            *row++ = pixel.blue;
+        }
+        write_png_row ();
+    }
+
+    end_png ();
+}
@@ -0,0 +1,594 @@
+/*
+ *
+ * mesh.c - storage for the vertices and triangles of the current 3D scene,
+ *          and the STL parser that fills it
+ *
+ * Split out of renderer.c.
+ */
+#include "mesh.h"
+#include "input.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
+#define MAX(X, Y) (((X) > (Y)) ? (X) : (Y))
+
+#define BUFFER_SIZE 2500000
+
+// The largest quantized coordinate
+#define QUANT_MAX 65535
+
+// The most that deflate can compress data by, which bounds the number of triangles in a compressed file
+#define MAX_COMPRESSION_RATIO 1032
+
+// The number of bits per axis in the Morton codes that triangles are sorted by
+#define MORTON_BITS 16
+// The number of bits sorted by each pass of the radix sort
+#define RADIX_BITS 16
+
+VertexFormat vertex_format = VERTEX_DOUBLE;
+
+int64_t vertex_list_size = 0;
+void* vertex_list;
+
+Vector quant_scale;
+Vector quant_offset;
+
+int64_t triangles_size = 0;
+Triangle* triangles;
+
+/*
+ * set_vertex_format
+ *
+ * INPUTS: format: the format to store the vertices of future objects in
+ * SIDE EFFECTS: sets vertex_format, which must not change while an object is loaded
+ */
+void set_vertex_format(VertexFormat format) {
+	vertex_format = format;
+}
+
+/*
+ * vertex_format_size
+ *
+ * INPUTS: format: a vertex format
+ * RETURN VALUE: the number of bytes used to store one vertex in the format
+ * SIDE EFFECTS: none
+ */
+uint32_t vertex_format_size(VertexFormat format) {
+	if (format == VERTEX_DOUBLE) {
+		return sizeof(Vector);
+	} else if (format == VERTEX_FLOAT) {
+		return 3 * sizeof(float);
+	} else {
+		return 3 * sizeof(uint16_t);
+	}
+}
+
+/*
+ * quantize
+ *
+ * INPUTS: x: a coordinate inside of the bounding box of the mesh
+ *         scale, offset: the quantization parameters for the axis of the coordinate
+ * RETURN VALUE: the nearest quantized coordinate
+ * SIDE EFFECTS: none
+ */
+static uint16_t quantize(double x, double scale, double offset) {
+	if (scale == 0) {
+		return 0;
+	}
+	double q = (x - offset) / scale + 0.5;
+	return (uint16_t)MAX(0, MIN(QUANT_MAX, q));
+}
+
+/*
+ * set_vertex
+ *
+ * INPUTS: index: the index of the vertex in the vertex list
+ *         v: the new position of the vertex
+ * SIDE EFFECTS: stores v in the vertex list in the current vertex format
+ */
+static void set_vertex(int64_t index, Vector v) {
+	if (vertex_format == VERTEX_DOUBLE) {
+		((Vector*)vertex_list)[index] = v;
+	} else if (vertex_format == VERTEX_FLOAT) {
+		float* f = (float*)vertex_list + 3 * index;
+		f[0] = (float)v.x;
+		f[1] = (float)v.y;
+		f[2] = (float)v.z;
+	} else {
+		uint16_t* q = (uint16_t*)vertex_list + 3 * index;
+		q[0] = quantize(v.x, quant_scale.x, quant_offset.x);
+		q[1] = quantize(v.y, quant_scale.y, quant_offset.y);
+		q[2] = quantize(v.z, quant_scale.z, quant_offset.z);
+	}
+}
+
+/*
+ * dynamic_resize
+ *
+ * INPUTS: array: the array to resize
+ *         array_len: a pointer to a number containing the current length of the array
+ *         element_size: the size of each element in the array (returned by sizeof)
+ * RETURNS: a new array with the old elements but a larger size
+ * SIDE EFFECTS: alters the value pointed to by array_len with the new array length
+ *               frees the array passed as a parameter
+ */
+void* dynamic_resize(void* array, int64_t* array_len, uint32_t element_size) {
+	int64_t old_array_len = *array_len;
+	// Double the size of the list
+	*array_len = (*array_len == 0) ? (1) : ((*array_len) * 2);
+	STATS_COUNT(COUNTER_BYTES_ALLOCATED, (uint64_t)(*array_len - old_array_len) * element_size);
+	// Grow the list, which keeps the old elements and frees the old memory if it has to move
+	return realloc(array, (size_t)(*array_len) * element_size);
+}
+
+/*
+ * reserve
+ *
+ * INPUTS: array: the array to grow
+ *         array_len: a pointer to a number containing the current length of the array
+ *         new_len: the number of elements that the array should be able to hold
+ *         element_size: the size of each element in the array (returned by sizeof)
+ * RETURNS: the array, grown to exactly new_len elements if it was smaller
+ * SIDE EFFECTS: alters the value pointed to by array_len with the new array length
+ */
+static void* reserve(void* array, int64_t* array_len, int64_t new_len, uint32_t element_size) {
+	if (new_len <= *array_len) {
+		return array;
+	}
+	STATS_COUNT(COUNTER_BYTES_ALLOCATED, (uint64_t)(new_len - *array_len) * element_size);
+	*array_len = new_len;
+	return realloc(array, (size_t)new_len * element_size);
+}
+
+/*
+ * add_triangle
+ *
+ * INPUTS: t: the triangle object containing the raw coordinates to insert into the scene
+ *         num_triangles, num_vertices: pointers to these two counters that will be updated as needed
+ * RETURN VALUE: 1 if the triangle was inserted, 0 if the vertices no longer fit in 32-bit indices
+ */
+int32_t add_triangle(RawTriangle t, int64_t* num_triangles, int64_t* num_vertices) {
+	if (*num_vertices + 3 > (int64_t)UINT32_MAX + 1) {
+		return 0;
+	}
+
+	uint32_t vertexIndices[3];
+	int32_t i;
+	for (i = 0; i < 3; i++) {
+		if (*num_vertices == vertex_list_size) {
+			vertex_list = dynamic_resize(vertex_list, &vertex_list_size, vertex_format_size(vertex_format));
+		}
+
+		// Insert new vertex into vertex list
+		set_vertex(*num_vertices, t.vertices[i]);
+		vertexIndices[i] = (uint32_t)*num_vertices;
+		(*num_vertices)++;
+	}
+
+	// Create new triangle object
+	Triangle new_t;
+	new_t.color = t.color;
+	for (i = 0; i < 3; i++)
+		new_t.vertices[i] = vertexIndices[i];
+
+	if (*num_triangles == triangles_size) {
+		triangles = dynamic_resize(triangles, &triangles_size, (uint32_t)sizeof(Triangle));
+	}
+
+	// Insert new triangle into triangle array
+	triangles[*num_triangles] = new_t;
+	(*num_triangles)++;
+	return 1;
+}
+
+/*
+ * read_STL_bounds
+ *
+ * INPUTS: in: an STL file positioned at the first triangle
+ * OUTPUTS: min, max: the corners of the bounding box of all vertices in the file
+ * SIDE EFFECTS: reads until the end of the file
+ */
+static void read_STL_bounds(InputStream* in, Vector* min, Vector* max) {
+	static char buffer[BUFFER_SIZE];
+	*min = (Vector){INFINITY, INFINITY, INFINITY};
+	*max = (Vector){-INFINITY, -INFINITY, -INFINITY};
+
+	while (1) {
+		int32_t num_elements_read = read_input(in, buffer, BUFFER_SIZE);
+		int32_t i;
+		for (i = 0; i < num_elements_read / STL_BLOCK_SIZE; i++) {
+			char* cur_buffer = buffer + i * STL_BLOCK_SIZE + 12;
+			int32_t j;
+			for (j = 0; j < 3; j++) {
+				float p[3];
+				memcpy(p, cur_buffer, 12);
+				min->x = MIN(min->x, p[0]);
+				min->y = MIN(min->y, p[1]);
+				min->z = MIN(min->z, p[2]);
+				max->x = MAX(max->x, p[0]);
+				max->y = MAX(max->y, p[1]);
+				max->z = MAX(max->z, p[2]);
+				cur_buffer += 12;
+			}
+		}
+
+		if (num_elements_read != BUFFER_SIZE)
+			break;
+	}
+}
+
+/*
+ * begin_STL
+ *
+ * INPUTS: in: an STL file positioned at its start
+ *         num_triangles, num_vertices: the current number of triangles and vertices in the scene
+ * RETURN VALUE: the number of triangle records that the file is expected to hold
+ * SIDE EFFECTS: reserves room for the triangles in the scene, reads the bounding box of the file if the vertices
+ *               are quantized, and leaves the file positioned at the first triangle record
+ */
+int64_t begin_STL(InputStream* in, int64_t num_triangles, int64_t num_vertices) {
+	// Read the header, which ends with the number of triangles
+	char header[STL_HEADER_SIZE];
+	uint32_t header_triangles = 0;
+	if (read_input(in, header, STL_HEADER_SIZE) == STL_HEADER_SIZE) {
+		memcpy(&header_triangles, header + 80, 4);
+	}
+
+	// Size the lists from the length of the file so that they never have to be doubled. The length of a
+	// compressed file is unknown, so the header is trusted as far as the size of the compressed data allows.
+	int64_t file_triangles = (input_size(in) - STL_HEADER_SIZE) / STL_BLOCK_SIZE;
+	if (input_compressed(in)) {
+		file_triangles = MIN((int64_t)header_triangles, input_size(in) * MAX_COMPRESSION_RATIO / STL_BLOCK_SIZE);
+	}
+	if (file_triangles > 0) {
+		triangles = reserve(triangles, &triangles_size, num_triangles + file_triangles, (uint32_t)sizeof(Triangle));
+		vertex_list = reserve(vertex_list, &vertex_list_size, num_vertices + 3 * file_triangles, vertex_format_size(vertex_format));
+	}
+
+	// Quantized vertices are stored relative to the bounding box, which takes an extra pass over the file
+	if (vertex_format == VERTEX_QUANTIZED) {
+		Vector min, max;
+		STATS_BEGIN(bounds_start);
+		read_STL_bounds(in, &min, &max);
+		STATS_END(STAGE_READ, bounds_start);
+		quant_offset = min;
+		quant_scale = mul_vec(1.0 / QUANT_MAX, add_vec(max, neg_vec(min)));
+
+		rewind_input(in);
+		read_input(in, header, STL_HEADER_SIZE);
+	}
+
+	return MAX(file_triangles, 0);
+}
+
+/*
+ * decode_STL_triangle
+ *
+ * INPUTS: record: a 50 byte binary STL triangle record
+ *         color: the color of the object
+ * RETURN VALUE: the triangle described by the record
+ * SIDE EFFECTS: none
+ */
+RawTriangle decode_STL_triangle(char* record, int32_t color) {
+	char* cur_buffer = record;
+	RawTriangle t;
+	t.color = color;
+
+	// Skip normal
+	cur_buffer += 12;
+
+	// Read in triangles
+	int32_t j;
+	for (j = 0; j < 3; j++) {
+		float x, y, z;
+		memcpy(&x, cur_buffer + 0, 4);
+		memcpy(&y, cur_buffer + 4, 4);
+		memcpy(&z, cur_buffer + 8, 4);
+		t.vertices[j].x = (double)x;
+		t.vertices[j].y = (double)y;
+		t.vertices[j].z = (double)z;
+		cur_buffer += 12;
+	}
+
+	// Attributes are skipped
+	return t;
+}
+
+/*
+ * normalize_mesh
+ *
+ * INPUTS: max_radius: the maximum distance from the center that each of the vertices in the object should have
+ *         num_vertices: the number of vertices in the scene
+ * OUTPUTS: center: the center of the vertices before they were moved
+ *          actual_max_radius: the largest distance of a vertex from the center before the vertices were scaled
+ * SIDE EFFECTS: moves the vertices so that they are centered at the origin and scales them so that
+ *               the farthest one is max_radius away from it
+ */
+void normalize_mesh(double max_radius, int64_t num_vertices, Vector* center, double* actual_max_radius) {
+	STATS_BEGIN(normalize_start);
+
+	// Normalize triangles to be centered at the origin
+	int64_t i;
+	*center = (Vector){0, 0, 0};
+	for (i = 0; i < num_vertices; i++) {
+		*center = add_vec(*center, get_vertex(i));
+	}
+	*center = mul_vec(1.0 / num_vertices, *center);
+
+	// Limit the maximum spread
+	*actual_max_radius = 0;
+	for (i = 0; i < num_vertices; i++) {
+		double dist = magnitude(add_vec(get_vertex(i), neg_vec(*center)));
+		*actual_max_radius = MAX(*actual_max_radius, dist);
+	}
+	double factor = max_radius / *actual_max_radius;
+
+	if (vertex_format == VERTEX_QUANTIZED) {
+		// Fold the normalization into the dequantization instead of requantizing every vertex
+		quant_scale = mul_vec(factor, quant_scale);
+		quant_offset = mul_vec(factor, add_vec(quant_offset, neg_vec(*center)));
+	} else {
+		for (i = 0; i < num_vertices; i++) {
+			set_vertex(i, mul_vec(factor, add_vec(get_vertex(i), neg_vec(*center))));
+		}
+	}
+
+	STATS_END(STAGE_NORMALIZE, normalize_start);
+}
+
+/*
+ * MortonKey
+ *
+ * Struct pairing the Morton code of the centroid of a triangle with the index of the triangle
+ */
+typedef struct {
+	uint64_t code;
+	uint32_t index;
+} MortonKey;
+
+/*
+ * spread_bits
+ *
+ * INPUTS: x: a MORTON_BITS bit integer
+ * RETURN VALUE: x with two zero bits inserted after each of its bits
+ * SIDE EFFECTS: none
+ */
+static uint64_t spread_bits(uint64_t x) {
+	x &= 0xFFFF;
+	x = (x | (x << 16)) & 0x0000FF0000FFull;
+	x = (x | (x << 8)) & 0x00F00F00F00Full;
+	x = (x | (x << 4)) & 0x0C30C30C30C3ull;
+	x = (x | (x << 2)) & 0x249249249249ull;
+	return x;
+}
+
+/*
+ * sort_morton
+ *
+ * INPUTS: num_triangles: the number of triangles in the scene
+ * SIDE EFFECTS: reorders the triangle list by the Morton codes of the centroids of the triangles
+ */
+static void sort_morton(int64_t num_triangles) {
+	// The Morton codes are taken relative to the bounding box of the centroids
+	Vector min = {INFINITY, INFINITY, INFINITY};
+	Vector max = {-INFINITY, -INFINITY, -INFINITY};
+	Vector* centroids = malloc(num_triangles * sizeof(Vector));
+	int64_t i;
+	for (i = 0; i < num_triangles; i++) {
+		Vector c = mul_vec(1.0 / 3, add_vec(get_vertex(triangles[i].vertices[0]),
+		                                    add_vec(get_vertex(triangles[i].vertices[1]), get_vertex(triangles[i].vertices[2]))));
+		centroids[i] = c;
+		min = (Vector){MIN(min.x, c.x), MIN(min.y, c.y), MIN(min.z, c.z)};
+		max = (Vector){MAX(max.x, c.x), MAX(max.y, c.y), MAX(max.z, c.z)};
+	}
+
+	double cells = (1 << MORTON_BITS) - 1;
+	Vector extent = add_vec(max, neg_vec(min));
+	Vector factor = {extent.x > 0 ? cells / extent.x : 0, extent.y > 0 ? cells / extent.y : 0, extent.z > 0 ? cells / extent.z : 0};
+	MortonKey* keys = malloc(num_triangles * sizeof(MortonKey));
+	MortonKey* sorted = malloc(num_triangles * sizeof(MortonKey));
+	STATS_COUNT(COUNTER_BYTES_ALLOCATED, num_triangles * (sizeof(Vector) + 2 * sizeof(MortonKey)));
+	for (i = 0; i < num_triangles; i++) {
+		uint64_t x = (uint64_t)((centroids[i].x - min.x) * factor.x);
+		uint64_t y = (uint64_t)((centroids[i].y - min.y) * factor.y);
+		uint64_t z = (uint64_t)((centroids[i].z - min.z) * factor.z);
+		keys[i].code = spread_bits(x) | (spread_bits(y) << 1) | (spread_bits(z) << 2);
+		keys[i].index = (uint32_t)i;
+	}
+	free(centroids);
+
+	// Least significant digit first radix sort, which keeps triangles with equal codes in their original order
+	int32_t shift;
+	static int64_t digit_starts[1 << RADIX_BITS];
+	for (shift = 0; shift < 3 * MORTON_BITS; shift += RADIX_BITS) {
+		memset(digit_starts, 0, sizeof(digit_starts));
+		for (i = 0; i < num_triangles; i++) {
+			digit_starts[(keys[i].code >> shift) & ((1 << RADIX_BITS) - 1)]++;
+		}
+		int64_t start = 0;
+		int32_t d;
+		for (d = 0; d < (1 << RADIX_BITS); d++) {
+			int64_t count = digit_starts[d];
+			digit_starts[d] = start;
+			start += count;
+		}
+		for (i = 0; i < num_triangles; i++) {
+			sorted[digit_starts[(keys[i].code >> shift) & ((1 << RADIX_BITS) - 1)]++] = keys[i];
+		}
+		MortonKey* swap = keys;
+		keys = sorted;
+		sorted = swap;
+	}
+	free(sorted);
+
+	Triangle* reordered = malloc(num_triangles * sizeof(Triangle));
+	STATS_COUNT(COUNTER_BYTES_ALLOCATED, num_triangles * sizeof(Triangle));
+	for (i = 0; i < num_triangles; i++) {
+		reordered[i] = triangles[keys[i].index];
+	}
+	free(keys);
+	free(triangles);
+	triangles = reordered;
+	triangles_size = num_triangles;
+}
+
+/*
+ * remap_vertices
+ *
+ * INPUTS: num_triangles, num_vertices: the number of triangles and vertices in the scene
+ * SIDE EFFECTS: moves the vertices into the order in which the triangle list first uses them
+ *               and renumbers the vertices of the triangles to match
+ */
+static void remap_vertices(int64_t num_triangles, int64_t num_vertices) {
+	uint32_t vertex_size = vertex_format_size(vertex_format);
+	uint32_t* new_index = malloc(num_vertices * sizeof(uint32_t));
+	char* remapped = malloc(num_vertices * vertex_size);
+	STATS_COUNT(COUNTER_BYTES_ALLOCATED, num_vertices * (sizeof(uint32_t) + vertex_size));
+	memset(new_index, 0xFF, num_vertices * sizeof(uint32_t));
+
+	int64_t i;
+	int32_t j;
+	uint32_t next = 0;
+	for (i = 0; i < num_triangles; i++) {
+		for (j = 0; j < 3; j++) {
+			uint32_t old = triangles[i].vertices[j];
+			if (new_index[old] == UINT32_MAX) {
+				new_index[old] = next;
+				memcpy(remapped + (int64_t)next * vertex_size, (char*)vertex_list + (int64_t)old * vertex_size, vertex_size);
+				next++;
+			}
+			triangles[i].vertices[j] = new_index[old];
+		}
+	}
+	// Vertices that no triangle uses keep their relative order at the end
+	for (i = 0; i < num_vertices; i++) {
+		if (new_index[i] == UINT32_MAX) {
+			memcpy(remapped + (int64_t)next * vertex_size, (char*)vertex_list + i * vertex_size, vertex_size);
+			next++;
+		}
+	}
+
+	free(new_index);
+	free(vertex_list);
+	vertex_list = remapped;
+	vertex_list_size = num_vertices;
+}
+
+/*
+ * reorder_mesh
+ *
+ * INPUTS: num_triangles, num_vertices: the number of triangles and vertices in the scene
+ * SIDE EFFECTS: sorts the triangle list along a Morton curve through the centroids of the triangles, so that
+ *               consecutive triangles are close together on screen, and then moves the vertices into the order
+ *               in which the sorted triangles use them
+ */
+void reorder_mesh(int64_t num_triangles, int64_t num_vertices) {
+	if (num_triangles == 0) {
+		return;
+	}
+	STATS_BEGIN(reorder_start);
+	sort_morton(num_triangles);
+	remap_vertices(num_triangles, num_vertices);
+	STATS_END(STAGE_REORDER, reorder_start);
+}
+
+/*
+ * replace_mesh
+ *
+ * INPUTS: positions, num_vertices: the positions of the vertices of the new object
+ *         indices, num_triangles: the indices into positions of the 3 vertices of each triangle, one triangle after another
+ *         color: the color of the object
+ * SIDE EFFECTS: replaces the vertices and triangles of the scene, storing the vertices in the current vertex format
+ *               (quantized vertices are stored relative to the bounding box of the new positions)
+ */
+void replace_mesh(Vector* positions, int64_t num_vertices, uint32_t* indices, int64_t num_triangles, int32_t color) {
+	int64_t i;
+	if (vertex_format == VERTEX_QUANTIZED) {
+		Vector min = {INFINITY, INFINITY, INFINITY};
+		Vector max = {-INFINITY, -INFINITY, -INFINITY};
+		for (i = 0; i < num_vertices; i++) {
+			Vector v = positions[i];
+			min = (Vector){MIN(min.x, v.x), MIN(min.y, v.y), MIN(min.z, v.z)};
+			max = (Vector){MAX(max.x, v.x), MAX(max.y, v.y), MAX(max.z, v.z)};
+		}
+		quant_offset = min;
+		quant_scale = mul_vec(1.0 / QUANT_MAX, add_vec(max, neg_vec(min)));
+	}
+
+	free(vertex_list);
+	vertex_list = NULL;
+	vertex_list_size = 0;
+	vertex_list = reserve(vertex_list, &vertex_list_size, num_vertices, vertex_format_size(vertex_format));
+	for (i = 0; i < num_vertices; i++) {
+		set_vertex(i, positions[i]);
+	}
+
+	free(triangles);
+	triangles = NULL;
+	triangles_size = 0;
+	triangles = reserve(triangles, &triangles_size, num_triangles, (uint32_t)sizeof(Triangle));
+	for (i = 0; i < num_triangles; i++) {
+		memcpy(triangles[i].vertices, indices + 3 * i, sizeof(triangles[i].vertices));
+		triangles[i].color = color;
+	}
+}
+
+/*
+ * parse_and_insert_STL
+ *
+ * INPUTS: file: the STL file path
+ *         max_radius: the maximum distance from the center that each of the vertices in the object should have
+ *         num_triangles, num_vertices: pointers to these counters that will be updated as needed when the object is inserted
+ *         color: the color of the object
+ * SIDE EFFECTS: adds the triangles from the STL file into the scene, and assumes that this object is the only one in the scene
+ *               may crash if the file provided is invalid
+ *               adds nothing if the object has more vertices than 32-bit indices can address, rather than a part of it
+ */
+void parse_and_insert_STL(char* file, double max_radius, int64_t* num_triangles, int64_t* num_vertices, int32_t color) {
+	InputStream* in = open_input(file);
+	if (in == NULL) {
+		return;
+	}
+	begin_STL(in, *num_triangles, *num_vertices);
+	int64_t first_triangle = *num_triangles;
+	int64_t first_vertex = *num_vertices;
+
+	int64_t i;
+	int32_t full = 0;
+	static char buffer[BUFFER_SIZE];
+	while (!full) {
+		STATS_BEGIN(read_start);
+		int32_t num_elements_read = read_input(in, buffer, BUFFER_SIZE);
+		STATS_END(STAGE_READ, read_start);
+
+		STATS_BEGIN(parse_start);
+		for (i = 0; i < num_elements_read / STL_BLOCK_SIZE; i++) {
+			// Add triangle
+			if (!add_triangle(decode_STL_triangle(buffer + i * STL_BLOCK_SIZE, color), num_triangles, num_vertices)) {
+				fprintf(stderr, "%s has more than %lld triangles, which is too many vertices for 32-bit indices, so it cannot be drawn\n",
+				        file, (long long)(*num_triangles - first_triangle));
+				*num_triangles = first_triangle;
+				*num_vertices = first_vertex;
+				full = 1;
+				break;
+			}
+		}
+		STATS_END(STAGE_PARSE, parse_start);
+
+		if (num_elements_read != BUFFER_SIZE)
+			break;
+	}
+
+	close_input(in);
+	if (*num_vertices == first_vertex) {
+		return;
+	}
+
+	Vector center;
+	double actual_max_radius;
+	normalize_mesh(max_radius, *num_vertices, &center, &actual_max_radius);
+}
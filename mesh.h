@@ -0,0 +1,196 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "vector.h"
+#include "input.h"
+
+// The size of a binary STL triangle record, and of the header before the first record
+#define STL_BLOCK_SIZE 50
+#define STL_HEADER_SIZE 84
+
+/*
+ * VertexFormat
+ *
+ * The ways in which vertex positions can be stored in memory
+ *  -VERTEX_DOUBLE: three doubles per vertex (24 bytes)
+ *  -VERTEX_FLOAT: three floats per vertex (12 bytes)
+ *  -VERTEX_QUANTIZED: three 16-bit integers per vertex relative to the bounding box of the mesh (6 bytes),
+ *                     which are dequantized whenever a vertex is read
+ */
+typedef enum {
+	VERTEX_DOUBLE,
+	VERTEX_FLOAT,
+	VERTEX_QUANTIZED
+} VertexFormat;
+
+/*
+ * Triangle
+ *
+ * Struct representing a triangle that will be rendered
+ * Members:
+ *  -vertices: the indices of the 3 vertices of the triangle in the vertex list (read with get_vertex)
+ *  -color: the color of the triangle
+ */
+typedef struct {
+	uint32_t vertices[3];
+	int32_t color;
+} Triangle;
+
+/*
+ * RawTriangle
+ *
+ * Struct representing a triangle that will not be rendered (must be passed through add_triangle)
+ * Members:
+ *  -vertices: the actual positions of the 3 vertices of the triangles as vectors
+ *  -color: the color of the triangle
+ */
+typedef struct {
+	Vector vertices[3];
+	int32_t color;
+} RawTriangle;
+
+// The format of the vertices in the current 3D scene
+extern VertexFormat vertex_format;
+
+// A list of the vertices in the current 3D scene, stored in vertex_format
+extern int64_t vertex_list_size;
+extern void* vertex_list;
+
+// The transformation from quantized vertices to positions: position = quantized * quant_scale + quant_offset
+extern Vector quant_scale;
+extern Vector quant_offset;
+
+// A list of the triangles in the current 3D scene
+extern int64_t triangles_size;
+extern Triangle* triangles;
+
+/*
+ * get_vertex
+ *
+ * INPUTS: index: the index of the vertex in the vertex list
+ * RETURN VALUE: the position of the vertex, converted from the format it is stored in
+ * SIDE EFFECTS: none
+ */
+static inline Vector get_vertex(int64_t index) {
+	if (vertex_format == VERTEX_DOUBLE) {
+		return ((Vector*)vertex_list)[index];
+	} else if (vertex_format == VERTEX_FLOAT) {
+		float* v = (float*)vertex_list + 3 * index;
+		return (Vector){v[0], v[1], v[2]};
+	} else {
+		uint16_t* v = (uint16_t*)vertex_list + 3 * index;
+		return (Vector){v[0] * quant_scale.x + quant_offset.x,
+		                v[1] * quant_scale.y + quant_offset.y,
+		                v[2] * quant_scale.z + quant_offset.z};
+	}
+}
+
+/*
+ * set_vertex_format
+ *
+ * INPUTS: format: the format to store the vertices of future objects in
+ * SIDE EFFECTS: sets vertex_format, which must not change while an object is loaded
+ */
+extern void set_vertex_format(VertexFormat format);
+
+/*
+ * vertex_format_size
+ *
+ * INPUTS: format: a vertex format
+ * RETURN VALUE: the number of bytes used to store one vertex in the format
+ * SIDE EFFECTS: none
+ */
+extern uint32_t vertex_format_size(VertexFormat format);
+
+/*
+ * dynamic_resize
+ *
+ * INPUTS: array: the array to resize
+ *         array_len: a pointer to a number containing the current length of the array
+ *         element_size: the size of each element in the array (returned by sizeof)
+ * RETURNS: a new array with the old elements but a larger size
+ * SIDE EFFECTS: alters the value pointed to by array_len with the new array length
+ *               frees the array passed as a parameter
+ */
+extern void* dynamic_resize(void* array, int64_t* array_len, uint32_t element_size);
+
+/*
+ * add_triangle
+ *
+ * INPUTS: t: the triangle object containing the raw coordinates to insert into the scene
+ *         num_triangles, num_vertices: pointers to these two counters that will be updated as needed
+ * RETURN VALUE: 1 if the triangle was inserted, 0 if the vertices no longer fit in 32-bit indices
+ */
+extern int32_t add_triangle(RawTriangle t, int64_t* num_triangles, int64_t* num_vertices);
+
+/*
+ * begin_STL
+ *
+ * INPUTS: in: an STL file positioned at its start
+ *         num_triangles, num_vertices: the current number of triangles and vertices in the scene
+ * RETURN VALUE: the number of triangle records that the file is expected to hold
+ * SIDE EFFECTS: reserves room for the triangles in the scene, reads the bounding box of the file if the vertices
+ *               are quantized, and leaves the file positioned at the first triangle record
+ */
+extern int64_t begin_STL(InputStream* in, int64_t num_triangles, int64_t num_vertices);
+
+/*
+ * decode_STL_triangle
+ *
+ * INPUTS: record: a 50 byte binary STL triangle record
+ *         color: the color of the object
+ * RETURN VALUE: the triangle described by the record
+ * SIDE EFFECTS: none
+ */
+extern RawTriangle decode_STL_triangle(char* record, int32_t color);
+
+/*
+ * normalize_mesh
+ *
+ * INPUTS: max_radius: the maximum distance from the center that each of the vertices in the object should have
+ *         num_vertices: the number of vertices in the scene
+ * OUTPUTS: center: the center of the vertices before they were moved
+ *          actual_max_radius: the largest distance of a vertex from the center before the vertices were scaled
+ * SIDE EFFECTS: moves the vertices so that they are centered at the origin and scales them so that
+ *               the farthest one is max_radius away from it
+ */
+extern void normalize_mesh(double max_radius, int64_t num_vertices, Vector* center, double* actual_max_radius);
+
+/*
+ * reorder_mesh
+ *
+ * INPUTS: num_triangles, num_vertices: the number of triangles and vertices in the scene
+ * SIDE EFFECTS: sorts the triangle list along a Morton curve through the centroids of the triangles, so that
+ *               consecutive triangles are close together on screen, and then moves the vertices into the order
+ *               in which the sorted triangles use them
+ *               the sort is stable, so triangles with the same Morton code keep their order
+ */
+extern void reorder_mesh(int64_t num_triangles, int64_t num_vertices);
+
+/*
+ * replace_mesh
+ *
+ * INPUTS: positions, num_vertices: the positions of the vertices of the new object
+ *         indices, num_triangles: the indices into positions of the 3 vertices of each triangle, one triangle after another
+ *         color: the color of the object
+ * SIDE EFFECTS: replaces the vertices and triangles of the scene, storing the vertices in the current vertex format
+ *               (quantized vertices are stored relative to the bounding box of the new positions)
+ */
+extern void replace_mesh(Vector* positions, int64_t num_vertices, uint32_t* indices, int64_t num_triangles, int32_t color);
+
+/*
+ * parse_and_insert_STL
+ *
+ * INPUTS: file: the STL file path
+ *         max_radius: the maximum distance from the center that each of the vertices in the object should have
+ *         num_triangles, num_vertices: pointers to these counters that will be updated as needed when the object is inserted
+ *         color: the color of the object
+ * SIDE EFFECTS: adds the triangles from the STL file into the scene, and assumes that this object is the only one in the scene
+ *               gzip (or zstd) compressed files are decompressed as they are read
+ *               may crash if the file provided is invalid
+ */
+extern void parse_and_insert_STL(char* file, double max_radius, int64_t* num_triangles, int64_t* num_vertices, int32_t color);
+
+#endif
@@ -0,0 +1,131 @@
+/*
+ *
+ * meshlet.c - splits the triangles of the current 3D scene into small clusters with
+ *             bounding spheres and normal cones, so that whole clusters can be culled
+ */
+#include "meshlet.h"
+#include "mesh.h"
+#include "stats.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
+#define MAX(X, Y) (((X) > (Y)) ? (X) : (Y))
+
+// The smallest and largest number of triangles in a meshlet
+#define MESHLET_MIN_TRIANGLES 64
+#define MESHLET_MAX_TRIANGLES 128
+// Once a meshlet has MESHLET_MIN_TRIANGLES, it is closed at the first triangle whose normal is
+// further than this (cos 45 degrees) from the average normal, which keeps the normal cones narrow
+#define MESHLET_SPLIT_COS 0.70710678
+
+int64_t num_meshlets = 0;
+Meshlet* meshlets = NULL;
+
+/*
+ * face_normal
+ *
+ * INPUTS: vertices: the positions of the vertices of a triangle
+ * RETURN VALUE: the normalized face normal, following the winding of the vertices,
+ *               or the zero vector if the triangle is degenerate
+ * SIDE EFFECTS: none
+ */
+static Vector face_normal(Vector* vertices) {
+	Vector n = cross(add_vec(vertices[1], neg_vec(vertices[0])), add_vec(vertices[2], neg_vec(vertices[0])));
+	double len = magnitude(n);
+	return (len > 0) ? mul_vec(1 / len, n) : (Vector){0, 0, 0};
+}
+
+/*
+ * finish_meshlet
+ *
+ * INPUTS: m: a meshlet whose first and count have been set
+ *         vertices: the positions of the vertices of each triangle of the meshlet
+ *         normals: the normalized face normal of each triangle of the meshlet
+ *         normal_sum: the sum of normals
+ * SIDE EFFECTS: computes the bounding sphere and normal cone of the meshlet
+ */
+static void finish_meshlet(Meshlet* m, Vector (*vertices)[3], Vector* normals, Vector normal_sum) {
+	Vector min = {INFINITY, INFINITY, INFINITY};
+	Vector max = {-INFINITY, -INFINITY, -INFINITY};
+	int32_t i, j;
+	for (i = 0; i < m->count; i++) {
+		for (j = 0; j < 3; j++) {
+			Vector v = vertices[i][j];
+			min = (Vector){MIN(min.x, v.x), MIN(min.y, v.y), MIN(min.z, v.z)};
+			max = (Vector){MAX(max.x, v.x), MAX(max.y, v.y), MAX(max.z, v.z)};
+		}
+	}
+	m->center = mul_vec(0.5, add_vec(min, max));
+
+	double axis_len = magnitude(normal_sum);
+	m->cone_axis = (axis_len > 0) ? mul_vec(1 / axis_len, normal_sum) : (Vector){0, 0, 0};
+	m->cone_cos = (axis_len > 0) ? 1 : -1;
+	double radius_sq = 0;
+	for (i = 0; i < m->count; i++) {
+		for (j = 0; j < 3; j++) {
+			double dx = vertices[i][j].x - m->center.x, dy = vertices[i][j].y - m->center.y, dz = vertices[i][j].z - m->center.z;
+			radius_sq = MAX(radius_sq, dx * dx + dy * dy + dz * dz);
+		}
+		// Degenerate triangles have no front, so they are never culled and neither is their meshlet
+		Vector n = normals[i];
+		m->cone_cos = (n.x != 0 || n.y != 0 || n.z != 0) ? MIN(m->cone_cos, dot(n, m->cone_axis)) : -1;
+	}
+	m->radius = sqrt(radius_sq);
+}
+
+/*
+ * build_meshlets
+ *
+ * INPUTS: num_triangles, num_vertices: the number of triangles and vertices in the scene
+ * RETURN VALUE: the number of meshlets built
+ * SIDE EFFECTS: reorders the triangle list along a Morton curve through the centroids of the triangles (see reorder_mesh),
+ *               splits it into meshlets of 64 to 128 triangles, and sets num_meshlets and meshlets
+ */
+int64_t build_meshlets(int64_t num_triangles, int64_t num_vertices) {
+	reorder_mesh(num_triangles, num_vertices);
+
+	STATS_BEGIN(cluster_start);
+	free(meshlets);
+	num_meshlets = 0;
+	meshlets = malloc((num_triangles / MESHLET_MIN_TRIANGLES + 1) * sizeof(Meshlet));
+	STATS_COUNT(COUNTER_BYTES_ALLOCATED, (num_triangles / MESHLET_MIN_TRIANGLES + 1) * sizeof(Meshlet));
+	if (num_triangles == 0) {
+		STATS_END(STAGE_CLUSTER, cluster_start);
+		return 0;
+	}
+
+	// Walk along the curve, closing each meshlet when it is full or when it would bend too far
+	static Vector vertices[MESHLET_MAX_TRIANGLES][3];
+	static Vector normals[MESHLET_MAX_TRIANGLES];
+	Meshlet* m = &meshlets[0];
+	m->first = 0;
+	m->count = 0;
+	Vector normal_sum = {0, 0, 0};
+	int64_t i;
+	int32_t j;
+	for (i = 0; i < num_triangles; i++) {
+		Vector v[3];
+		for (j = 0; j < 3; j++) {
+			v[j] = get_vertex(triangles[i].vertices[j]);
+		}
+		Vector n = face_normal(v);
+		if (m->count == MESHLET_MAX_TRIANGLES ||
+		    (m->count >= MESHLET_MIN_TRIANGLES && dot(n, normal_sum) < MESHLET_SPLIT_COS * magnitude(normal_sum))) {
+			finish_meshlet(m, vertices, normals, normal_sum);
+			m = &meshlets[++num_meshlets];
+			m->first = i;
+			m->count = 0;
+			normal_sum = (Vector){0, 0, 0};
+		}
+		memcpy(vertices[m->count], v, sizeof(v));
+		normals[m->count++] = n;
+		normal_sum = add_vec(normal_sum, n);
+	}
+	finish_meshlet(m, vertices, normals, normal_sum);
+	num_meshlets++;
+
+	STATS_END(STAGE_CLUSTER, cluster_start);
+	return num_meshlets;
+}
@@ -0,0 +1,42 @@
+#ifndef MESHLET_H
+#define MESHLET_H
+
+#include <stdint.h>
+#include "vector.h"
+
+/*
+ * Meshlet
+ *
+ * Struct representing a cluster of nearby triangles that can be culled with one test
+ * Members:
+ *  -first: the index of the first triangle of the meshlet, whose triangles are contiguous in the triangle list
+ *  -count: the number of triangles in the meshlet
+ *  -center, radius: a sphere containing every vertex of the meshlet
+ *  -cone_axis: the normalized average of the face normals of the triangles
+ *  -cone_cos: the cosine of the largest angle between a face normal and cone_axis,
+ *             or -1 if the normals are too spread out to bound or a triangle is degenerate
+ */
+typedef struct {
+	int64_t first;
+	int32_t count;
+	Vector center;
+	double radius;
+	Vector cone_axis;
+	double cone_cos;
+} Meshlet;
+
+// The meshlets of the current 3D scene
+extern int64_t num_meshlets;
+extern Meshlet* meshlets;
+
+/*
+ * build_meshlets
+ *
+ * INPUTS: num_triangles, num_vertices: the number of triangles and vertices in the scene
+ * RETURN VALUE: the number of meshlets built
+ * SIDE EFFECTS: reorders the triangle list along a Morton curve through the centroids of the triangles (see reorder_mesh),
+ *               splits it into meshlets of 64 to 128 triangles, and sets num_meshlets and meshlets
+ */
+extern int64_t build_meshlets(int64_t num_triangles, int64_t num_vertices);
+
+#endif
@@ -0,0 +1,470 @@
+/*
+ *
+ * pipeline.c - draws a picture with the reader, decoder, transform and raster stages running
+ *              on separate threads
+ *
+ * Each pair of neighbouring stages is connected by a link holding a fixed number of batches of
+ * triangles. Full batches are passed forward and emptied batches are passed back through
+ * single-producer single-consumer lock-free queues, so a stage that gets ahead of the next one
+ * runs out of empty batches and waits instead of buffering the whole file.
+ */
+#include "pipeline.h"
+#include "renderer.h"
+#include "mesh.h"
+#include "raster.h"
+#include "stats.h"
+#include "queue.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+// The number of triangles in each batch passed between stages
+#define BATCH_TRIANGLES 4096
+
+/*
+ * PipelineStage
+ *
+ * The stages of the pipeline, in the order that triangles pass through them
+ */
+typedef enum {
+	PIPE_READER,
+	PIPE_DECODER,
+	PIPE_TRANSFORM,
+	PIPE_RASTER,
+	NUM_PIPE_STAGES
+} PipelineStage;
+
+static const char* pipe_stage_names[NUM_PIPE_STAGES] = {
+	"reader", "decoder", "transform", "raster"
+};
+
+/*
+ * ProjectedTriangle
+ *
+ * Struct representing a shaded triangle that is ready to be rasterized
+ * Members:
+ *  -vertices: the positions of the vertices of the triangle
+ *  -projected: the vertices projected onto the camera plane
+ *  -color: the shaded color of the triangle
+ */
+typedef struct {
+	Vector vertices[3];
+	Vector projected[3];
+	int32_t color;
+} ProjectedTriangle;
+
+/*
+ * StageUsage
+ *
+ * Struct holding how one stage spent its time
+ * Members:
+ *  -start: the time at which the stage started
+ *  -first_item: the time at which the stage received its first triangle
+ *  -end: the time at which the stage finished
+ *  -wait_ns: the time spent waiting for a full batch from the stage before or an empty batch from the stage after
+ *  -items: the number of triangles that the stage passed on
+ */
+typedef struct {
+	uint64_t start;
+	uint64_t first_item;
+	uint64_t end;
+	uint64_t wait_ns;
+	uint64_t items;
+} StageUsage;
+
+/*
+ * Pipeline
+ *
+ * Struct holding the state shared by the stages
+ * Members:
+ *  -file, scale, color: the arguments of draw_pipelined
+ *  -streaming: whether triangles are normalized as they are decoded instead of being stored
+ *  -center, radius: the normalization of the object, if streaming
+ *  -camera: the camera to draw from
+ *  -light: the normalized direction of the light
+ *  -links: the links between the reader and decoder, the decoder and transform, and the transform and raster stages
+ *  -usage: how each stage spent its time
+ *  -triangles_culled: the number of triangles that the transform stage did not pass on
+ */
+typedef struct {
+	char* file;
+	double scale;
+	int32_t color;
+	int32_t streaming;
+	Vector center;
+	double radius;
+	Camera* camera;
+	Vector light;
+	Link links[NUM_PIPE_STAGES - 1];
+	StageUsage usage[NUM_PIPE_STAGES];
+	uint64_t triangles_culled;
+} Pipeline;
+
+// The normalization given with set_normalization
+static int32_t normalization_set = 0;
+static Vector normalization_center;
+static double normalization_radius;
+
+/*
+ * set_normalization
+ *
+ * INPUTS: center: the center of the vertices of the object that will be drawn
+ *         radius: the largest distance of a vertex of the object from center
+ * OUTPUTS: none
+ * RETURN VALUE: none
+ * SIDE EFFECTS: sets the normalization used by draw_pipelined instead of the one cached for the file
+ */
+void set_normalization(Vector center, double radius) {
+	normalization_set = 1;
+	normalization_center = center;
+	normalization_radius = radius;
+}
+
+/*
+ * normalization_path
+ *
+ * INPUTS: file: the STL file path
+ * RETURN VALUE: the path of the file that the normalization of the STL file is cached in, which must be freed
+ * SIDE EFFECTS: allocates the path
+ */
+static char* normalization_path(char* file) {
+	char* path = malloc(strlen(file) + sizeof(".norm"));
+	strcpy(path, file);
+	strcat(path, ".norm");
+	return path;
+}
+
+/*
+ * load_normalization
+ *
+ * INPUTS: file: the STL file path
+ * OUTPUTS: center, radius: the cached normalization of the file
+ * RETURN VALUE: 1 if the cache exists and was written for the current contents of the file, 0 otherwise
+ * SIDE EFFECTS: none
+ */
+static int32_t load_normalization(char* file, Vector* center, double* radius) {
+	struct stat st;
+	if (stat(file, &st) != 0) {
+		return 0;
+	}
+	char* path = normalization_path(file);
+	FILE* fp = fopen(path, "r");
+	free(path);
+	if (fp == NULL) {
+		return 0;
+	}
+	long long size, mtime;
+	int32_t valid = fscanf(fp, "%lld %lld %lf %lf %lf %lf", &size, &mtime, &center->x, &center->y, &center->z, radius) == 6 &&
+	                size == (long long)st.st_size && mtime == (long long)st.st_mtime;
+	fclose(fp);
+	return valid;
+}
+
+/*
+ * save_normalization
+ *
+ * INPUTS: file: the STL file path
+ *         center, radius: the normalization of the file
+ * SIDE EFFECTS: writes the normalization to the cache next to the file, if it can be written
+ */
+static void save_normalization(char* file, Vector center, double radius) {
+	struct stat st;
+	if (stat(file, &st) != 0) {
+		return;
+	}
+	char* path = normalization_path(file);
+	FILE* fp = fopen(path, "w");
+	free(path);
+	if (fp == NULL) {
+		return;
+	}
+	// Written with enough digits that the streamed vertices match the stored ones exactly
+	fprintf(fp, "%lld %lld %.17g %.17g %.17g %.17g\n", (long long)st.st_size, (long long)st.st_mtime,
+	        center.x, center.y, center.z, radius);
+	fclose(fp);
+}
+
+/*
+ * reader_stage
+ *
+ * INPUTS: arg: the pipeline
+ * RETURN VALUE: NULL
+ * SIDE EFFECTS: reads the triangle records of the file into batches and passes them to the decoder
+ *               reserves room for the object if it is going to be stored
+ */
+static void* reader_stage(void* arg) {
+	Pipeline* p = arg;
+	StageUsage* usage = &p->usage[PIPE_READER];
+	Link* out = &p->links[PIPE_READER];
+	usage->start = stats_now();
+
+	InputStream* in = open_input(p->file);
+	if (in != NULL && p->streaming) {
+		char header[STL_HEADER_SIZE];
+		read_input(in, header, STL_HEADER_SIZE);
+	} else if (in != NULL) {
+		begin_STL(in, 0, 0);
+	}
+	usage->first_item = stats_now();
+
+	while (1) {
+		Batch* b = queue_pop(&out->empty, &usage->wait_ns);
+		STATS_BEGIN(read_start);
+		b->count = (in == NULL) ? 0 : read_input(in, b->items, BATCH_TRIANGLES * STL_BLOCK_SIZE) / STL_BLOCK_SIZE;
+		STATS_END(STAGE_READ, read_start);
+		usage->items += b->count;
+		queue_push(&out->full, b, &usage->wait_ns);
+		if (b->count == 0) {
+			break;
+		}
+	}
+
+	if (in != NULL) {
+		close_input(in);
+	}
+	usage->end = stats_now();
+	return NULL;
+}
+
+/*
+ * decoder_stage
+ *
+ * INPUTS: arg: the pipeline
+ * RETURN VALUE: NULL
+ * SIDE EFFECTS: decodes the records from the reader and passes the normalized triangles to the transform stage
+ *               stores and normalizes the object first, and caches its normalization, if it is not known
+ */
+static void* decoder_stage(void* arg) {
+	Pipeline* p = arg;
+	StageUsage* usage = &p->usage[PIPE_DECODER];
+	Link* in = &p->links[PIPE_READER];
+	Link* out = &p->links[PIPE_DECODER];
+	usage->start = stats_now();
+
+	int64_t num_triangles = 0;
+	int64_t num_vertices = 0;
+	int32_t full = 0;
+	double factor = p->scale / p->radius;
+	Batch* b;
+	int32_t i, j;
+	while ((b = queue_pop(&in->full, &usage->wait_ns))->count > 0) {
+		if (usage->first_item == 0) {
+			usage->first_item = stats_now();
+		}
+		Batch* decoded = p->streaming ? queue_pop(&out->empty, &usage->wait_ns) : NULL;
+		STATS_BEGIN(parse_start);
+		if (p->streaming) {
+			RawTriangle* raw = decoded->items;
+			for (i = 0; i < b->count; i++) {
+				raw[i] = decode_STL_triangle((char*)b->items + i * STL_BLOCK_SIZE, p->color);
+				for (j = 0; j < 3; j++) {
+					raw[i].vertices[j] = mul_vec(factor, add_vec(raw[i].vertices[j], neg_vec(p->center)));
+				}
+			}
+			decoded->count = b->count;
+			usage->items += b->count;
+		} else {
+			for (i = 0; i < b->count && !full; i++) {
+				if (!add_triangle(decode_STL_triangle((char*)b->items + i * STL_BLOCK_SIZE, p->color), &num_triangles, &num_vertices)) {
+					fprintf(stderr, "%s has more than %lld triangles, which is too many vertices for 32-bit indices, so it cannot be drawn\n",
+					        p->file, (long long)num_triangles);
+					num_triangles = 0;
+					num_vertices = 0;
+					full = 1;
+				}
+			}
+		}
+		STATS_END(STAGE_PARSE, parse_start);
+		queue_push(&in->empty, b, &usage->wait_ns);
+		if (decoded != NULL) {
+			queue_push(&out->full, decoded, &usage->wait_ns);
+		}
+	}
+
+	if (!p->streaming && num_triangles > 0) {
+		STATS_COUNT(COUNTER_MESH_BYTES, num_vertices * vertex_format_size(vertex_format) + num_triangles * sizeof(Triangle));
+		normalize_mesh(p->scale, num_vertices, &p->center, &p->radius);
+		// Normalizations measured from rounded vertices would not reproduce the stored picture when streamed
+		if (!full && vertex_format == VERTEX_DOUBLE) {
+			save_normalization(p->file, p->center, p->radius);
+		}
+
+		int64_t t;
+		for (t = 0; t < num_triangles; t += BATCH_TRIANGLES) {
+			Batch* decoded = queue_pop(&out->empty, &usage->wait_ns);
+			RawTriangle* raw = decoded->items;
+			decoded->count = (int32_t)((num_triangles - t < BATCH_TRIANGLES) ? num_triangles - t : BATCH_TRIANGLES);
+			for (i = 0; i < decoded->count; i++) {
+				for (j = 0; j < 3; j++) {
+					raw[i].vertices[j] = get_vertex(triangles[t + i].vertices[j]);
+				}
+				raw[i].color = triangles[t + i].color;
+			}
+			usage->items += decoded->count;
+			queue_push(&out->full, decoded, &usage->wait_ns);
+		}
+	}
+
+	Batch* end = queue_pop(&out->empty, &usage->wait_ns);
+	end->count = 0;
+	queue_push(&out->full, end, &usage->wait_ns);
+	usage->end = stats_now();
+	return NULL;
+}
+
+/*
+ * transform_stage
+ *
+ * INPUTS: arg: the pipeline
+ * RETURN VALUE: NULL
+ * SIDE EFFECTS: shades and projects the triangles from the decoder, and passes the ones that
+ *               may be visible to the raster stage
+ */
+static void* transform_stage(void* arg) {
+	Pipeline* p = arg;
+	StageUsage* usage = &p->usage[PIPE_TRANSFORM];
+	Link* in = &p->links[PIPE_DECODER];
+	Link* out = &p->links[PIPE_TRANSFORM];
+	usage->start = stats_now();
+
+	Batch* b;
+	while ((b = queue_pop(&in->full, &usage->wait_ns))->count > 0) {
+		if (usage->first_item == 0) {
+			usage->first_item = stats_now();
+		}
+		Batch* projected = queue_pop(&out->empty, &usage->wait_ns);
+		RawTriangle* raw = b->items;
+		ProjectedTriangle* pt = projected->items;
+
+		STATS_BEGIN(project_start);
+		int32_t i;
+		int32_t count = 0;
+		for (i = 0; i < b->count; i++) {
+			if (backface_culled(raw[i].vertices, p->camera)) {
+				p->triangles_culled++;
+				continue;
+			}
+			double min_x, max_x, min_y, max_y;
+			int32_t behind_camera = project_bounds(raw[i].vertices, p->camera, pt[count].projected, &min_x, &max_x, &min_y, &max_y);
+			if (behind_camera || outside_rows(min_x, max_x, min_y, max_y, 0, image_height)) {
+				p->triangles_culled++;
+				continue;
+			}
+			memcpy(pt[count].vertices, raw[i].vertices, sizeof(pt[count].vertices));
+			pt[count].color = shade_vertices(raw[i].vertices, raw[i].color, p->light);
+			count++;
+		}
+		STATS_END(STAGE_PROJECT, project_start);
+		queue_push(&in->empty, b, &usage->wait_ns);
+
+		// An empty batch would end the stream, so batches whose triangles were all culled are kept
+		if (count > 0) {
+			projected->count = count;
+			usage->items += count;
+			queue_push(&out->full, projected, &usage->wait_ns);
+		} else {
+			queue_push(&out->empty, projected, &usage->wait_ns);
+		}
+	}
+
+	Batch* end = queue_pop(&out->empty, &usage->wait_ns);
+	end->count = 0;
+	queue_push(&out->full, end, &usage->wait_ns);
+	usage->end = stats_now();
+	return NULL;
+}
+
+/*
+ * draw_pipelined
+ *
+ * INPUTS: file: the STL file path
+ *         scale: the maximum distance of the vertices of the object from the origin
+ *         camera_location: the location where the camera should be placed
+ *         rotation: the amount that the camera should be rotated clockwise from its default orientation
+ *         color: the color of the object
+ * RETURN VALUE: 0 if any dot is drawn out of bounds, 1 otherwise
+ * SIDE EFFECTS: draws the picture with draw_dot, rasterizing on the calling thread
+ */
+int32_t draw_pipelined(char* file, double scale, Vector camera_location, double rotation, int32_t color) {
+	Pipeline* p = calloc(1, sizeof(Pipeline));
+	p->file = file;
+	p->scale = scale;
+	p->color = color;
+	if (normalization_set) {
+		p->streaming = 1;
+		p->center = normalization_center;
+		p->radius = normalization_radius;
+	} else {
+		p->streaming = load_normalization(file, &p->center, &p->radius);
+	}
+	// The pipeline never stores the object, so free anything left from an earlier picture
+	free(triangles);
+	free(vertex_list);
+	triangles = NULL;
+	triangles_size = 0;
+	vertex_list = NULL;
+	vertex_list_size = 0;
+
+	Camera camera = setup_camera(camera_location, rotation);
+	p->camera = &camera;
+	p->light = normalize(camera.direction);
+
+	init_link(&p->links[PIPE_READER], BATCH_TRIANGLES * STL_BLOCK_SIZE);
+	init_link(&p->links[PIPE_DECODER], BATCH_TRIANGLES * sizeof(RawTriangle));
+	init_link(&p->links[PIPE_TRANSFORM], BATCH_TRIANGLES * sizeof(ProjectedTriangle));
+
+	Target target;
+	init_target(&target, 0, image_height);
+	RasterCounts counts = {0, 0, 0, 0, 0};
+
+	pthread_t threads[NUM_PIPE_STAGES - 1];
+	pthread_create(&threads[PIPE_READER], NULL, reader_stage, p);
+	pthread_create(&threads[PIPE_DECODER], NULL, decoder_stage, p);
+	pthread_create(&threads[PIPE_TRANSFORM], NULL, transform_stage, p);
+
+	// Rasterize on this thread, so that the target is only ever touched here
+	StageUsage* usage = &p->usage[PIPE_RASTER];
+	Link* in = &p->links[PIPE_TRANSFORM];
+	usage->start = stats_now();
+	Batch* b;
+	while ((b = queue_pop(&in->full, &usage->wait_ns))->count > 0) {
+		if (usage->first_item == 0) {
+			usage->first_item = stats_now();
+		}
+		ProjectedTriangle* pt = b->items;
+		int32_t i;
+		for (i = 0; i < b->count; i++) {
+			raster_triangle(pt[i].vertices, pt[i].projected, pt[i].color, &camera, &target, &counts);
+		}
+		usage->items += b->count;
+		queue_push(&in->empty, b, &usage->wait_ns);
+	}
+	usage->end = stats_now();
+
+	int32_t i;
+	for (i = 0; i < NUM_PIPE_STAGES - 1; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	int32_t output = present_target(&target);
+
+	STATS_COUNT(COUNTER_TRIANGLES_IN, p->usage[PIPE_DECODER].items);
+	counts.triangles_culled += p->triangles_culled;
+	flush_counts(&counts);
+	if (stats_enabled) {
+		for (i = 0; i < NUM_PIPE_STAGES; i++) {
+			StageUsage* u = &p->usage[i];
+			stats_pipeline_stage(pipe_stage_names[i], u->start, u->first_item, u->end, u->wait_ns, u->items);
+		}
+	}
+
+	for (i = 0; i < NUM_PIPE_STAGES - 1; i++) {
+		free_link(&p->links[i]);
+	}
+	free(target.pixels);
+	free(target.z_buffer);
+	free(p);
+	return output;
+}
@@ -0,0 +1,39 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stdint.h>
+#include "vector.h"
+
+/*
+ * set_normalization
+ *
+ * INPUTS: center: the center of the vertices of the object that will be drawn
+ *         radius: the largest distance of a vertex of the object from center
+ * OUTPUTS: none
+ * RETURN VALUE: none
+ * SIDE EFFECTS: sets the normalization used by draw_pipelined instead of the one cached for the file
+ *
+ * These are the values that parse_and_insert_STL measures before it moves and scales the object,
+ * which lets the pipeline draw triangles while the rest of the file is still being read.
+ */
+extern void set_normalization(Vector center, double radius);
+
+/*
+ * draw_pipelined
+ *
+ * INPUTS: file: the STL file path
+ *         scale: the maximum distance of the vertices of the object from the origin
+ *         camera_location: the location where the camera should be placed
+ *         rotation: the amount that the camera should be rotated clockwise from its default orientation
+ *         color: the color of the object
+ * RETURN VALUE: 0 if any dot is drawn out of bounds, 1 otherwise
+ * SIDE EFFECTS: draws the picture with draw_dot
+ *
+ * Reads, decodes, transforms and rasterizes the file on separate threads that pass batches of triangles
+ * through bounded queues. If the normalization of the file is known (from set_normalization, or from the
+ * <file>.norm cache written by an earlier run), triangles are drawn as they are decoded and the object is
+ * never stored. Otherwise the object is stored and normalized first, and the normalization is cached.
+ */
+extern int32_t draw_pipelined(char* file, double scale, Vector camera_location, double rotation, int32_t color);
+
+#endif
@@ -0,0 +1,86 @@
+/*
+ *
+ * queue.c - bounded lock-free queues for passing batches between two threads
+ *
+ * Split out of pipeline.c.
+ */
+#include "queue.h"
+#include "stats.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+/*
+ * queue_push
+ *
+ * INPUTS: q: the queue to push onto, which only this thread pushes onto
+ *         b: the batch to push
+ * OUTPUTS: wait_ns: incremented with the time spent waiting for room in the queue
+ * SIDE EFFECTS: adds the batch to the end of the queue
+ */
+void queue_push(Queue* q, Batch* b, uint64_t* wait_ns) {
+	uint32_t tail = q->tail;
+	if (tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == QUEUE_DEPTH) {
+		uint64_t start = stats_now();
+		while (tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == QUEUE_DEPTH) {
+			sched_yield();
+		}
+		*wait_ns += stats_now() - start;
+	}
+	q->slots[tail % QUEUE_DEPTH] = b;
+	// Publish the batch (and everything written to it) before the consumer can see it
+	__atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * queue_pop
+ *
+ * INPUTS: q: the queue to pop from, which only this thread pops from
+ * OUTPUTS: wait_ns: incremented with the time spent waiting for the queue to be nonempty
+ * RETURN VALUE: the batch at the front of the queue
+ * SIDE EFFECTS: removes the batch from the queue
+ */
+Batch* queue_pop(Queue* q, uint64_t* wait_ns) {
+	uint32_t head = q->head;
+	if (__atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == head) {
+		uint64_t start = stats_now();
+		while (__atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == head) {
+			sched_yield();
+		}
+		*wait_ns += stats_now() - start;
+	}
+	Batch* b = q->slots[head % QUEUE_DEPTH];
+	__atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+	return b;
+}
+
+/*
+ * init_link
+ *
+ * INPUTS: link: the link to initialize
+ *         batch_size: the number of bytes of items that each batch holds
+ * SIDE EFFECTS: allocates the batches of the link and places all of them in its empty queue
+ */
+void init_link(Link* link, uint32_t batch_size) {
+	memset(link, 0, sizeof(Link));
+	int32_t i;
+	for (i = 0; i < QUEUE_DEPTH; i++) {
+		link->batches[i].items = malloc(batch_size);
+		STATS_COUNT(COUNTER_BYTES_ALLOCATED, batch_size);
+		link->empty.slots[i] = &link->batches[i];
+	}
+	link->empty.tail = QUEUE_DEPTH;
+}
+
+/*
+ * free_link
+ *
+ * INPUTS: link: a link whose stages have finished
+ * SIDE EFFECTS: frees the batches of the link
+ */
+void free_link(Link* link) {
+	int32_t i;
+	for (i = 0; i < QUEUE_DEPTH; i++) {
+		free(link->batches[i].items);
+	}
+}
@@ -0,0 +1,89 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <stdint.h>
+
+// The number of batches in each link, which must be a power of two
+#define QUEUE_DEPTH 8
+
+/*
+ * Batch
+ *
+ * Struct holding a batch of items passed from one stage to the next
+ * Members:
+ *  -count: the number of items in the batch, or 0 if the stage before has finished
+ *  -items: the items, whose type depends on the link
+ */
+typedef struct {
+	int32_t count;
+	void* items;
+} Batch;
+
+/*
+ * Queue
+ *
+ * Struct representing a bounded queue of batches with one producer and one consumer
+ * Members:
+ *  -slots: the batches in the queue
+ *  -head: the number of batches ever popped, written only by the consumer
+ *  -tail: the number of batches ever pushed, written only by the producer
+ */
+typedef struct {
+	Batch* slots[QUEUE_DEPTH];
+	uint32_t head __attribute__((aligned(64)));
+	uint32_t tail __attribute__((aligned(64)));
+} Queue;
+
+/*
+ * Link
+ *
+ * Struct connecting two neighbouring stages
+ * Members:
+ *  -full: the batches passed to the later stage
+ *  -empty: the batches passed back to the earlier stage to be refilled
+ *  -batches: the batches that circulate between the two queues
+ */
+typedef struct {
+	Queue full;
+	Queue empty;
+	Batch batches[QUEUE_DEPTH];
+} Link;
+
+/*
+ * queue_push
+ *
+ * INPUTS: q: the queue to push onto, which only this thread pushes onto
+ *         b: the batch to push
+ * OUTPUTS: wait_ns: incremented with the time spent waiting for room in the queue
+ * SIDE EFFECTS: adds the batch to the end of the queue
+ */
+extern void queue_push(Queue* q, Batch* b, uint64_t* wait_ns);
+
+/*
+ * queue_pop
+ *
+ * INPUTS: q: the queue to pop from, which only this thread pops from
+ * OUTPUTS: wait_ns: incremented with the time spent waiting for the queue to be nonempty
+ * RETURN VALUE: the batch at the front of the queue
+ * SIDE EFFECTS: removes the batch from the queue
+ */
+extern Batch* queue_pop(Queue* q, uint64_t* wait_ns);
+
+/*
+ * init_link
+ *
+ * INPUTS: link: the link to initialize
+ *         batch_size: the number of bytes of items that each batch holds
+ * SIDE EFFECTS: allocates the batches of the link and places all of them in its empty queue
+ */
+extern void init_link(Link* link, uint32_t batch_size);
+
+/*
+ * free_link
+ *
+ * INPUTS: link: a link whose stages have finished
+ * SIDE EFFECTS: frees the batches of the link
+ */
+extern void free_link(Link* link);
+
+#endif
@@ -0,0 +1,180 @@
+#ifndef RASTER_H
+#define RASTER_H
+
+#include <stdint.h>
+#include "mesh.h"
+#include "vector.h"
+
+/*
+ * Shared between the drawing paths in renderer.c and the ones split out of it.
+ */
+
+// The depth of a pixel that nothing has been drawn at
+#define Z_BUFFER_FAR 100000000.0
+
+// The color that the image is cleared to
+#define BACKGROUND_COLOR 0x00FFFFFF
+
+/*
+ * Camera
+ *
+ * Struct describing the camera that the scene is drawn from
+ * Members:
+ *  -location: the focal point of the camera
+ *  -direction: the normalized direction of the camera
+ *  -right: the normalized vector (in 3D) pointing in the (-1, 0) direction in the camera plane
+ *  -up: the normalizd vector (in 3D) pointing in the (1, 0) direction in the camera plane
+ *  -origin: the point corresponding to the origin on the camera plane
+ *  -scale: the size of a pixel on the camera plane
+ *  -width, height: the size of the image on the camera plane
+ */
+typedef struct {
+	Vector location;
+	Vector direction;
+	Vector right;
+	Vector up;
+	Vector origin;
+	double scale;
+	double width;
+	double height;
+} Camera;
+
+/*
+ * Target
+ *
+ * Struct holding the color and depth buffers for a horizontal band of the image
+ * Members:
+ *  -y0: the first image row in the band
+ *  -rows: the number of image rows in the band
+ *  -pixels: the color of each pixel in the band, row by row, in the format taken by set_color
+ *  -z_buffer: the distance from the camera of the closest sample drawn so far at each pixel, row by row
+ */
+typedef struct {
+	int32_t y0;
+	int32_t rows;
+	int32_t* pixels;
+	double* z_buffer;
+} Target;
+
+/*
+ * RasterCounts
+ *
+ * Struct holding the per-sample counters for a frame, which are kept out of the statistics
+ * module until the frame is done so that they cost nothing when statistics are disabled
+ */
+typedef struct {
+	uint64_t samples_tested;
+	uint64_t depth_passes;
+	uint64_t pixels_covered;
+	uint64_t triangles_culled;
+	uint64_t subpixel_triangles;
+} RasterCounts;
+
+/*
+ * setup_camera
+ *
+ * INPUTS: camera_location: the location where the camera should be placed
+ *         rotation: the amount that the camera should be rotated clockwise from its default orientation
+ * RETURN VALUE: a camera at camera_location pointing towards the origin
+ * SIDE EFFECTS: none
+ */
+extern Camera setup_camera(Vector camera_location, double rotation);
+
+/*
+ * init_target
+ *
+ * INPUTS: target: the target to initialize
+ *         y0, rows: the band of the image that the target covers
+ * SIDE EFFECTS: allocates the buffers of the target, clears the pixels to the background color and the depths to Z_BUFFER_FAR
+ */
+extern void init_target(Target* target, int32_t y0, int32_t rows);
+
+/*
+ * present_target
+ *
+ * INPUTS: target: a target holding a drawn band of the picture
+ * RETURN VALUE: 0 if any dot is drawn out of bounds, 1 otherwise
+ * SIDE EFFECTS: draws every pixel of the target with draw_dot
+ */
+extern int32_t present_target(Target* target);
+
+/*
+ * project_bounds
+ *
+ * INPUTS: vertices: the positions of the vertices of a triangle
+ *         camera: the camera to project the triangle with
+ * OUTPUTS: projectedVertices: the vertices projected onto the camera plane
+ *          min_x, max_x, min_y, max_y: the bounding box of the triangle in (fractional) pixels
+ * RETURN VALUE: 1 if any of the vertices is behind the camera, 0 otherwise
+ * SIDE EFFECTS: none
+ */
+extern int32_t project_bounds(Vector* vertices, Camera* camera, Vector* projectedVertices,
+                              double* min_x, double* max_x, double* min_y, double* max_y);
+
+/*
+ * outside_rows
+ *
+ * INPUTS: min_x, max_x, min_y, max_y: the bounding box of a triangle in (fractional) pixels
+ *         y0, rows: a band of image rows
+ * RETURN VALUE: 1 if no sample of the triangle can land in the band, 0 otherwise
+ * SIDE EFFECTS: none
+ */
+extern int32_t outside_rows(double min_x, double max_x, double min_y, double max_y, int32_t y0, int32_t rows);
+
+/*
+ * raster_triangle
+ *
+ * INPUTS: vertices: the positions of the vertices of the triangle
+ *         projectedVertices: the vertices projected onto the camera plane
+ *         color: the shaded color of the triangle
+ *         camera: the camera to draw the triangle from
+ *         target: the band of the image to draw into
+ * OUTPUTS: counts: incremented with the number of samples tested and drawn
+ * SIDE EFFECTS: draws the visible samples of the triangle that fall into the target and updates its z-buffer,
+ *               drawing triangles that lie within a single pixel with a single sample
+ */
+extern void raster_triangle(Vector* vertices, Vector* projectedVertices, int32_t color, Camera* camera, Target* target, RasterCounts* counts);
+
+/*
+ * backface_culled
+ *
+ * INPUTS: vertices: the positions of the vertices of a triangle
+ *         camera: the camera that the triangle is drawn from
+ * RETURN VALUE: 1 if backface culling is enabled and the front of the triangle faces away from the camera, 0 otherwise
+ * SIDE EFFECTS: none
+ */
+extern int32_t backface_culled(Vector* vertices, Camera* camera);
+
+/*
+ * draw_triangle
+ *
+ * INPUTS: t: the triangle to draw
+ *         color: the shaded color of the triangle
+ *         camera: the camera to draw the triangle from
+ *         target: the band of the image to draw into
+ * OUTPUTS: counts: incremented with the number of samples tested and drawn
+ * SIDE EFFECTS: projects the triangle, culls it if it is outside of the target or faces away from the camera
+ *               with backface culling enabled, and otherwise rasterizes it (or draws it as a point if points are enabled)
+ */
+extern void draw_triangle(Triangle t, int32_t color, Camera* camera, Target* target, RasterCounts* counts);
+
+/*
+ * shade_vertices
+ *
+ * INPUTS: vertices: the positions of the vertices of a triangle
+ *         color: the material color of the triangle
+ *         light: the normalized vector pointing in the direction of the ambient light source
+ * RETURN VALUE: the color of the triangle under the given lighting conditions
+ * SIDE EFFECTS: may rebuild the shade table, so it must only be called from one thread at a time
+ */
+extern int32_t shade_vertices(Vector* vertices, int32_t color, Vector light);
+
+/*
+ * flush_counts
+ *
+ * INPUTS: counts: the counters collected while drawing a frame
+ * SIDE EFFECTS: adds the counters to the statistics
+ */
+extern void flush_counts(RasterCounts* counts);
+
+#endif
@@ -11,90 +11,169 @@
  */
 #include "renderer.h"
 #include "vector.h"
+#include "mesh.h"
+#include "raster.h"
+#include "stats.h"
+#include "pipeline.h"
+#include "meshlet.h"
+#include "bvh.h"
+#include "lod.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
 
 #define ABS(X) (((X) > 0) ? (X) : (-(X)))
 #define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
 #define MAX(X, Y) (((X) > (Y)) ? (X) : (Y))
 
-#define BUFFER_SIZE 2500000
-#define STL_BLOCK_SIZE 50
-
 #define AMBIENT_PORTION 0
 
+// The number of pixels per unit on the camera plane at the default image width
+#define CAMERA_RESOLUTION 500.0
+
+// The number of cells along each axis of the grid used to stratify triangles for progressive rendering
+#define PROGRESSIVE_GRID 16
+// The largest block of pixels that a triangle is splatted over in the coarse progressive passes
+#define PROGRESSIVE_MAX_SPLAT 8
+// The maximum number of progressive passes (one more than the number of bits in a rank)
+#define PROGRESSIVE_MAX_PASSES 34
+// The number of triangles drawn between checks of the deadline
+#define DEADLINE_CHECK_INTERVAL 256
+
+// The default number of image rows in each band of a tiled picture
+#define DEFAULT_BAND_ROWS 256
+// The number of finished bands per worker thread that may wait to be written before workers stop to let the writer catch up
+#define BANDS_IN_FLIGHT_PER_THREAD 2
+
+// The number of intensity levels in the table that maps light intensity to a shaded color
+#define SHADE_TABLE_SIZE 1024
+
+// The number of triangles per pixel above which ENGINE_AUTO casts rays instead of rasterizing, and the number of
+// triangles below which it always rasterizes, since loading the hierarchy then costs more than drawing the picture
+#define RAY_CAST_RATIO 0.25
+#define RAY_CAST_MIN_TRIANGLES 100000
+
+// The size of the image in pixels
+int32_t image_width = WIDTH;
+int32_t image_height = HEIGHT;
+
+// The number of rows in each band of a tiled picture (0 to draw the whole picture at once) and the number of worker threads
+static int32_t tiled_band_rows = 0;
+static int32_t num_threads = 1;
+
+// Whether triangles are drawn in coarse-to-fine passes, and the time after which drawing stops (0 for no limit)
+static int32_t progressive = 0;
+static double time_budget_ms = 0;
+
+// Whether pictures are drawn by the pipelined stages in pipeline.c
+static int32_t pipelined = 0;
+
+// Whether triangles are clustered into meshlets that are culled together, and whether triangles facing away from the camera are culled
+static int32_t meshlet_culling = 0;
+static int32_t backface_culling = 0;
+
+// The size in pixels of the square drawn for each triangle in place of the triangle, or 0 to draw triangles
+static int32_t point_size = 0;
+
+// Whether the triangles and vertices of future objects are reordered along a Morton curve after they are loaded
+static int32_t reordering = 0;
+
+// Whether pictures are rasterized, ray cast, or drawn by whichever is expected to be faster
+static Engine engine = ENGINE_RASTER;
+
+// The number of triangles that objects are simplified down to (0 for no limit), the root mean square distance in
+// pixels that simplifying may move their surface on screen (0 for no limit), and whether levels of detail are cached
+static int64_t lod_max_triangles = 0;
+static double lod_rms_pixels = 0;
+static int32_t lod_cached = 0;
+
+// The table of shaded colors for the material shade_table_color, indexed by light intensity
+static int32_t shade_table[SHADE_TABLE_SIZE];
+static int32_t shade_table_color = -1;
+
 /*
- * Triangle
+ * build_shade_table
  *
- * Struct representing a triangle that will be rendered
- * Members:
- *  -vertices: the indices of the 3 vertices of the triangle in the global array vertex_list
- *  -color: the color of the triangle
+ * INPUTS: color: the material color to build the table for
+ * OUTPUTS: fills shade_table so that entry k is the shaded color at an intensity of k / (SHADE_TABLE_SIZE - 1)
+ * SIDE EFFECTS: sets shade_table_color to color
  */
-typedef struct {
-	int32_t vertices[3];
-	int32_t color;
-} Triangle;
+static void build_shade_table(int32_t color) {
+	double r = (color >> 16) & 0x000000FF;
+	double g = (color >> 8)  & 0x000000FF;
+	double b = (color >> 0)  & 0x000000FF;
+
+	int32_t k;
+	for (k = 0; k < SHADE_TABLE_SIZE; k++) {
+		double cos = (double)k / (SHADE_TABLE_SIZE - 1);
+		int32_t r_k = (int32_t)(r * AMBIENT_PORTION + ((r / 255.0) * r * cos) * (1 - AMBIENT_PORTION));
+		int32_t g_k = (int32_t)(g * AMBIENT_PORTION + ((g / 255.0) * g * cos) * (1 - AMBIENT_PORTION));
+		int32_t b_k = (int32_t)(b * AMBIENT_PORTION + ((b / 255.0) * b * cos) * (1 - AMBIENT_PORTION));
+		shade_table[k] = (r_k << 16) | (g_k << 8) | (b_k << 0);
+	}
+	shade_table_color = color;
+}
 
 /*
- * RawTriangle
+ * shade
  *
- * Struct representing a triangle that will not be rendered (must be passed through add_triangle)
- * Members:
- *  -vertices: the actual positions of the 3 vertices of the triangles as vectors
- *  -color: the color of the triangle
+ * INPUTS: color: the material color of the surface
+ *         intensity: the cosine between the surface normal and the light, from 0 to 1
+ * RETURN VALUE: the shaded color, looked up from the shade table for the material
+ * SIDE EFFECTS: rebuilds the shade table if it was built for a different material
  */
-typedef struct {
-	Vector vertices[3];
-	int32_t color;
-} RawTriangle;
-
-// A list of the vertices in the current 3D scene
-int32_t vertex_list_size = 0;
-Vector* vertex_list;
-
-// A list of the triangles in the current 3D scene
-int32_t triangles_size = 0;
-Triangle* triangles;
+static int32_t shade(int32_t color, double intensity) {
+	if (color != shade_table_color) {
+		build_shade_table(color);
+	}
+	return shade_table[(int32_t)(intensity * (SHADE_TABLE_SIZE - 1) + 0.5)];
+}
 
 /*
- * get_normal
+ * shade_vertices
  *
- * INPUTS: t: the triangle to compute the normal of
- * RETURN VALUE: a vector pointing in the direction perpendicular to the triangle face
- * SIDE EFFECTS: none
- */ 
-Vector get_normal(Triangle t) {
-	Vector u = add_vec(vertex_list[t.vertices[1]], neg_vec(vertex_list[t.vertices[0]]));
-	Vector v = add_vec(vertex_list[t.vertices[2]], neg_vec(vertex_list[t.vertices[0]]));
-	Vector normal;
-	normal.x = u.y * v.z - u.z * v.y;
-	normal.y = u.z * v.x - u.x * v.z;
-	normal.z = u.x * v.y - u.y * v.x;
-	return normalize(normal);
+ * INPUTS: vertices: the positions of the vertices of a triangle
+ *         color: the material color of the triangle
+ *         light: the normalized vector pointing in the direction of the ambient light source
+ * RETURN VALUE: the color of the triangle under the given lighting conditions, lit by the cosine between its face
+ *               normal and the light
+ * SIDE EFFECTS: may rebuild the shade table
+ *
+ * Divides the dot product by the length of the face normal instead of normalizing the normal.
+ */
+int32_t shade_vertices(Vector* vertices, int32_t color, Vector light) {
+	double ux = vertices[1].x - vertices[0].x, uy = vertices[1].y - vertices[0].y, uz = vertices[1].z - vertices[0].z;
+	double vx = vertices[2].x - vertices[0].x, vy = vertices[2].y - vertices[0].y, vz = vertices[2].z - vertices[0].z;
+	double nx = uy * vz - uz * vy;
+	double ny = uz * vx - ux * vz;
+	double nz = ux * vy - uy * vx;
+
+	double len_sq = nx * nx + ny * ny + nz * nz;
+	// Degenerate triangles have no normal, which would give a NaN intensity; draw them unlit instead
+	double intensity = (len_sq > 0) ? ABS(nx * light.x + ny * light.y + nz * light.z) / sqrt(len_sq) : 0;
+	return shade(color, MIN(intensity, 1.0));
 }
 
 /*
- * get_color
+ * shade_triangles
  *
- * INPUTS: t: the triangle to get the color of, given its orientation and the lighting conditions
- *         light_direction: the normalized vector pointing in the direction of the ambient light source
- * RETURN VALUE: the color of the triangle under the given lighting conditions
- * SIDE EFFECTS: none
- */ 
-int32_t get_color(Triangle t, Vector light_direction) {
-	double cos = ABS(dot(get_normal(t), normalize(light_direction)));
-	int32_t r = (t.color >> 16) & 0x000000FF;
-	int32_t g = (t.color >> 8)  & 0x000000FF;
-	int32_t b = (t.color >> 0)  & 0x000000FF; 
-
-	r = (int32_t)(r * AMBIENT_PORTION + ((r / 255.0) * r * cos) * (1 - AMBIENT_PORTION));
-	g = (int32_t)(g * AMBIENT_PORTION + ((g / 255.0) * g * cos) * (1 - AMBIENT_PORTION));
-	b = (int32_t)(b * AMBIENT_PORTION + ((b / 255.0) * b * cos) * (1 - AMBIENT_PORTION));
+ * INPUTS: num_triangles: the number of triangles in the scene
+ *         light_direction: the vector pointing in the direction of the ambient light source
+ * OUTPUTS: colors: filled with the shaded color of each triangle, as given by shade_vertices
+ * SIDE EFFECTS: may rebuild the shade table
+ *
+ * Normalizes the light once and computes every face normal in one pass.
+ */
+void shade_triangles(int64_t num_triangles, Vector light_direction, int32_t* colors) {
+	Vector light = normalize(light_direction);
 
-	return ((r << 16) | (g << 8) | (b << 0));
+	int64_t i;
+	for (i = 0; i < num_triangles; i++) {
+		Vector vertices[3] = {get_vertex(triangles[i].vertices[0]), get_vertex(triangles[i].vertices[1]), get_vertex(triangles[i].vertices[2])};
+		colors[i] = shade_vertices(vertices, triangles[i].color, light);
+	}
 }
 
 /*
@@ -129,150 +208,1202 @@ Vector project_point(Vector camera_location, Vector camera_direction, Vector cam
 }
 
 /*
- * dynamic_resize
+ * setup_camera
+ *
+ * INPUTS: camera_location: the location where the camera should be placed
+ *         rotation: the amount that the camera should be rotated clockwise from its default orientation
+ * RETURN VALUE: a camera at camera_location pointing towards the origin
+ * SIDE EFFECTS: none
  *
- * INPUTS: array: the array to resize
- *         array_len: a pointer to a number containing the current length of the array
- *         element_size: the size of each element in the array (returned by sizeof)
- * RETURNS: a new array with the old elements but a larger size
- * SIDE EFFECTS: alters the value pointed to by array_len with the new array length
- *               frees the array passed as a parameter
+ * The camera plane is always as wide as it is for the default image width, so larger images show the
+ * same view in more detail.
  */
-void* dynamic_resize(void* array, int32_t* array_len, uint32_t element_size) {
-	char* old_list = (char*)array;
-	int32_t old_array_len = *array_len;
-	// Double the size of the list
-	*array_len = (*array_len == 0) ? (1) : ((*array_len) * 2);
-	// Allocate new memory for the new list
-	char* new_list = malloc((*array_len) * element_size);
-	// Copy the old information from the old array into the new array
-	int32_t i;
-	for (i = 0; i < old_array_len * element_size; i++) {
-		new_list[i] = old_list[i];
+Camera setup_camera(Vector camera_location, double rotation) {
+	Camera camera;
+	camera.location = camera_location;
+
+	// Set camera direction to point towards the origin (where the object is)
+	camera.direction = normalize(neg_vec(camera_location));
+
+	// Set camera right to be the vector in the xy plane that is perpendicular to camera_direction
+	double right_angle = -atan2(camera.direction.x, camera.direction.y) - rotation;
+	camera.right = normalize((Vector){cos(right_angle), sin(right_angle), 0});
+
+	camera.up = normalize(cross(camera.right, camera.direction));
+	camera.origin = add_vec(camera.location, camera.direction);
+
+	camera.scale = 1 / (CAMERA_RESOLUTION * image_width / WIDTH);
+	camera.width = image_width * camera.scale;
+	camera.height = image_height * camera.scale;
+	return camera;
+}
+
+/*
+ * set_image_size
+ *
+ * INPUTS: width, height: the size of future pictures in pixels
+ * SIDE EFFECTS: sets image_width and image_height
+ */
+void set_image_size(int32_t width, int32_t height) {
+	image_width = width;
+	image_height = height;
+}
+
+/*
+ * set_tiled
+ *
+ * INPUTS: band_rows: the number of image rows to draw at a time, or 0 to draw whole pictures at once
+ * SIDE EFFECTS: sets the file-scope tiling options
+ */
+void set_tiled(int32_t band_rows) {
+	tiled_band_rows = band_rows;
+}
+
+/*
+ * set_threads
+ *
+ * INPUTS: threads: the number of worker threads to draw with
+ * SIDE EFFECTS: sets num_threads
+ */
+void set_threads(int32_t threads) {
+	num_threads = MAX(1, threads);
+}
+
+/*
+ * init_target
+ *
+ * INPUTS: target: the target to initialize
+ *         y0, rows: the band of the image that the target covers
+ * SIDE EFFECTS: allocates the buffers of the target, clears the pixels to the background color and the depths to Z_BUFFER_FAR
+ */
+void init_target(Target* target, int32_t y0, int32_t rows) {
+	int64_t size = (int64_t)rows * image_width;
+	target->y0 = y0;
+	target->rows = rows;
+	target->pixels = malloc(size * sizeof(int32_t));
+	target->z_buffer = malloc(size * sizeof(double));
+	STATS_COUNT(COUNTER_BYTES_ALLOCATED, size * (sizeof(int32_t) + sizeof(double)));
+
+	int64_t k;
+	for (k = 0; k < size; k++) {
+		target->pixels[k] = BACKGROUND_COLOR;
+		target->z_buffer[k] = Z_BUFFER_FAR;
 	}
-	// Free the old list
-	free(old_list);
-	// Return new list
-	return new_list;
 }
 
 /*
- * add_triangle
+ * present_target
  *
- * INPUTS: t: the triangle object containing the raw coordinates to insert into the scene
- *         num_triangles, num_vertices: pointers to these two counters that will be updated as needed
+ * INPUTS: target: a target holding a drawn band of the picture
+ * RETURN VALUE: 0 if any dot is drawn out of bounds, 1 otherwise
+ * SIDE EFFECTS: draws every pixel of the target with draw_dot
  */
-void add_triangle(RawTriangle t, int32_t* num_triangles, int32_t* num_vertices) {
-	int32_t vertexIndices[3];
+int32_t present_target(Target* target) {
+	int32_t output = 1;
+	int32_t x, y;
+	for (y = 0; y < target->rows; y++) {
+		for (x = 0; x < image_width; x++) {
+			set_color(target->pixels[(int64_t)y * image_width + x]);
+			output &= draw_dot(x, target->y0 + y);
+		}
+	}
+	return output;
+}
+
+/*
+ * project_bounds
+ *
+ * INPUTS: vertices: the positions of the vertices of a triangle
+ *         camera: the camera to project the triangle with
+ * OUTPUTS: projectedVertices: the vertices projected onto the camera plane
+ *          min_x, max_x, min_y, max_y: the bounding box of the triangle in (fractional) pixels
+ * RETURN VALUE: 1 if any of the vertices is behind the camera, 0 otherwise
+ * SIDE EFFECTS: none
+ */
+int32_t project_bounds(Vector* vertices, Camera* camera, Vector* projectedVertices,
+                       double* min_x, double* max_x, double* min_y, double* max_y) {
+	int32_t j;
+	int32_t behind_camera = 0;
+	for (j = 0; j < 3; j++) {
+		projectedVertices[j] = project_point(camera->location, camera->direction, camera->right, camera->up, 
+		                                      camera->origin, vertices[j]);
+		behind_camera |= (projectedVertices[j].z < 0);
+	}
+
+	*min_x = (MIN(projectedVertices[0].x, MIN(projectedVertices[1].x, projectedVertices[2].x)) + camera->width / 2) / camera->scale;
+	*max_x = (MAX(projectedVertices[0].x, MAX(projectedVertices[1].x, projectedVertices[2].x)) + camera->width / 2) / camera->scale;
+	*min_y = (-MAX(projectedVertices[0].y, MAX(projectedVertices[1].y, projectedVertices[2].y)) + camera->height / 2) / camera->scale;
+	*max_y = (-MIN(projectedVertices[0].y, MIN(projectedVertices[1].y, projectedVertices[2].y)) + camera->height / 2) / camera->scale;
+	return behind_camera;
+}
+
+/*
+ * outside_rows
+ *
+ * INPUTS: min_x, max_x, min_y, max_y: the bounding box of a triangle in (fractional) pixels
+ *         y0, rows: a band of image rows
+ * RETURN VALUE: 1 if no sample of the triangle can land in the band, 0 otherwise
+ * SIDE EFFECTS: none
+ *
+ * Samples are truncated towards zero, so anything above -1 still lands on the first row or column.
+ */
+int32_t outside_rows(double min_x, double max_x, double min_y, double max_y, int32_t y0, int32_t rows) {
+	return max_x <= -1 || min_x >= image_width || max_y <= ((y0 == 0) ? -1 : y0 - 1) || min_y >= y0 + rows;
+}
+
+/*
+ * draw_sample
+ *
+ * INPUTS: proj_point: a point on the camera plane
+ *         actual_point: the point in the scene that projects to proj_point
+ *         color: the color to draw the point with
+ *         camera: the camera that the point is drawn from
+ *         target: the band of the image to draw into
+ * OUTPUTS: counts: incremented with the number of samples tested and drawn
+ * SIDE EFFECTS: draws the point in the pixel containing it if that pixel is in the target and nothing closer has been drawn there
+ */
+static void draw_sample(Vector proj_point, Vector actual_point, int32_t color, Camera* camera, Target* target, RasterCounts* counts) {
+	int32_t camera_x = (proj_point.x + camera->width / 2) / camera->scale;
+	int32_t camera_y = (-proj_point.y + camera->height / 2) / camera->scale;
+
+	if (camera_x >= 0 && camera_x < image_width && camera_y >= target->y0 && camera_y < target->y0 + target->rows) {
+		// Check distance and z-buffer
+		double dist = magnitude(add_vec(actual_point, neg_vec(camera->location)));
+		int64_t index = (int64_t)(camera_y - target->y0) * image_width + camera_x;
+		counts->samples_tested++;
+		if (dist < target->z_buffer[index]) {
+			counts->pixels_covered += (target->z_buffer[index] == Z_BUFFER_FAR);
+			counts->depth_passes++;
+			target->pixels[index] = color;
+			target->z_buffer[index] = dist;
+		}
+	}
+}
+
+/*
+ * raster_triangle
+ *
+ * INPUTS: vertices: the positions of the vertices of the triangle
+ *         projectedVertices: the vertices projected onto the camera plane
+ *         color: the shaded color of the triangle
+ *         camera: the camera to draw the triangle from
+ *         target: the band of the image to draw into
+ * OUTPUTS: counts: incremented with the number of samples tested and drawn
+ * SIDE EFFECTS: draws the visible samples of the triangle that fall into the target and updates its z-buffer
+ */
+void raster_triangle(Vector* vertices, Vector* projectedVertices, int32_t color, Camera* camera, Target* target, RasterCounts* counts) {
+	STATS_BEGIN(raster_start);
+
+	// A triangle whose bounding box on screen is under a pixel wide and high covers at most a few pixels
+	// partly, so it is drawn as the single pixel under its vertex nearest to the camera instead of the sweep.
+	// This can leave out pixels that the sweep would have touched, and the sweep keeps the nearest of the points
+	// it samples, which may lie between the vertices, so a later triangle at almost the same depth may win or
+	// lose against it differently
+	double pixel_x[3], pixel_y[3];
 	int32_t i;
 	for (i = 0; i < 3; i++) {
-		if (*num_vertices == vertex_list_size) {
-			vertex_list = dynamic_resize(vertex_list, &vertex_list_size, (uint32_t)sizeof(Vector));
+		pixel_x[i] = (projectedVertices[i].x + camera->width / 2) / camera->scale;
+		pixel_y[i] = (-projectedVertices[i].y + camera->height / 2) / camera->scale;
+	}
+	if (MAX(pixel_x[0], MAX(pixel_x[1], pixel_x[2])) - MIN(pixel_x[0], MIN(pixel_x[1], pixel_x[2])) < 1 &&
+	    MAX(pixel_y[0], MAX(pixel_y[1], pixel_y[2])) - MIN(pixel_y[0], MIN(pixel_y[1], pixel_y[2])) < 1) {
+		int32_t nearest = 0;
+		double nearest_dist = magnitude(add_vec(vertices[0], neg_vec(camera->location)));
+		for (i = 1; i < 3; i++) {
+			double dist = magnitude(add_vec(vertices[i], neg_vec(camera->location)));
+			if (dist < nearest_dist) {
+				nearest = i;
+				nearest_dist = dist;
+			}
+		}
+		int32_t x = (int32_t)floor(pixel_x[nearest]);
+		int32_t y = (int32_t)floor(pixel_y[nearest]);
+		if (x >= 0 && x < image_width && y >= target->y0 && y < target->y0 + target->rows) {
+			int64_t index = (int64_t)(y - target->y0) * image_width + x;
+			counts->samples_tested++;
+			if (nearest_dist < target->z_buffer[index]) {
+				counts->pixels_covered += (target->z_buffer[index] == Z_BUFFER_FAR);
+				counts->depth_passes++;
+				target->pixels[index] = color;
+				target->z_buffer[index] = nearest_dist;
+			}
 		}
+		counts->subpixel_triangles++;
+		STATS_END(STAGE_RASTER, raster_start);
+		return;
+	}
+
+	Vector proj_start = projectedVertices[0];
+	Vector proj_trace = add_vec(projectedVertices[2], neg_vec(projectedVertices[1]));
+	Vector actual_start = vertices[0];
+	Vector actual_trace = add_vec(vertices[2], neg_vec(vertices[1]));
+
+	// Draw a triangle by going across one edge and drawing lines to the remaining point
+	double progress;
+	double increment1 = camera->scale / magnitude(proj_trace) / 2;
+	for (progress = 0; progress <= 1; progress += increment1) {
+		Vector proj_end = add_vec(projectedVertices[1], mul_vec(progress, proj_trace));
+		Vector actual_end = add_vec(vertices[1], mul_vec(progress, actual_trace));
+
+		Vector proj_delta = add_vec(proj_end, neg_vec(proj_start));
+		Vector actual_delta = add_vec(actual_end, neg_vec(actual_start));
 
-		// Insert new vertex into vertex list
-		vertex_list[*num_vertices] = t.vertices[i];
-		vertexIndices[i] = *num_vertices;
-		(*num_vertices)++;
+		// Draw a line from start to end
+		double t;
+		double increment2 = camera->scale / magnitude(proj_delta) / 2;
+		for (t = 0; t <= 1; t += increment2) {
+			draw_sample(add_vec(proj_start, mul_vec(t, proj_delta)), add_vec(actual_start, mul_vec(t, actual_delta)),
+			            color, camera, target, counts);
+		}
+	}
+	STATS_END(STAGE_RASTER, raster_start);
+}
+
+/*
+ * draw_point
+ *
+ * INPUTS: vertices: the positions of the vertices of a triangle
+ *         color: the shaded color of the triangle
+ *         camera: the camera to draw the triangle from
+ *         target: the band of the image to draw into
+ * OUTPUTS: counts: incremented with the number of samples tested and drawn
+ * SIDE EFFECTS: draws a square of point_size by point_size pixels around the centroid of the triangle,
+ *               at the depth of the centroid, in place of the triangle
+ */
+static void draw_point(Vector* vertices, int32_t color, Camera* camera, Target* target, RasterCounts* counts) {
+	STATS_BEGIN(raster_start);
+	Vector centroid = mul_vec(1 / 3.0, add_vec(vertices[0], add_vec(vertices[1], vertices[2])));
+	Vector proj = project_point(camera->location, camera->direction, camera->right, camera->up, camera->origin, centroid);
+	if (proj.z < 0) {
+		counts->triangles_culled++;
+		STATS_END(STAGE_RASTER, raster_start);
+		return;
 	}
 
-	// Create new triangle object
-	Triangle new_t;
-	new_t.color = t.color;
-	for (i = 0; i < 3; i++)
-		new_t.vertices[i] = vertexIndices[i];
+	int32_t center_x = (proj.x + camera->width / 2) / camera->scale;
+	int32_t center_y = (-proj.y + camera->height / 2) / camera->scale;
+	double dist = magnitude(add_vec(centroid, neg_vec(camera->location)));
 
-	if (*num_triangles == triangles_size) {
-		triangles = dynamic_resize(triangles, &triangles_size, (uint32_t)sizeof(Triangle));
+	int32_t x, y;
+	for (y = MAX(target->y0, center_y - point_size / 2); y < MIN(target->y0 + target->rows, center_y - point_size / 2 + point_size); y++) {
+		for (x = MAX(0, center_x - point_size / 2); x < MIN(image_width, center_x - point_size / 2 + point_size); x++) {
+			int64_t index = (int64_t)(y - target->y0) * image_width + x;
+			counts->samples_tested++;
+			if (dist < target->z_buffer[index]) {
+				counts->pixels_covered += (target->z_buffer[index] == Z_BUFFER_FAR);
+				counts->depth_passes++;
+				target->pixels[index] = color;
+				target->z_buffer[index] = dist;
+			}
+		}
 	}
+	STATS_END(STAGE_RASTER, raster_start);
+}
 
-	// Insert new triangle into triangle array
-	triangles[*num_triangles] = new_t;
-	(*num_triangles)++;
+/*
+ * backface_culled
+ *
+ * INPUTS: vertices: the positions of the vertices of a triangle
+ *         camera: the camera that the triangle is drawn from
+ * RETURN VALUE: 1 if backface culling is enabled and the front of the triangle faces away from the camera, 0 otherwise
+ * SIDE EFFECTS: none
+ */
+int32_t backface_culled(Vector* vertices, Camera* camera) {
+	if (!backface_culling) {
+		return 0;
+	}
+	Vector normal = cross(add_vec(vertices[1], neg_vec(vertices[0])), add_vec(vertices[2], neg_vec(vertices[0])));
+	return dot(normal, add_vec(vertices[0], neg_vec(camera->location))) > 0;
 }
 
 /*
- * parse_and_insert_STL
+ * draw_triangle
  *
- * INPUTS: file: the STL file path
- *         max_radius: the maximum distance from the center that each of the vertices in the object should have
- *         num_triangles, num_vertices: pointers to these counters that will be updated as needed when the object is inserted
- *         color: the color of the object
- * SIDE EFFECTS: adds the triangles from the STL file into the scene, and assumes that this object is the only one in the scene
- *               may crash if the file provided is invalid
+ * INPUTS: t: the triangle to draw
+ *         color: the shaded color of the triangle
+ *         camera: the camera to draw the triangle from
+ *         target: the band of the image to draw into
+ * OUTPUTS: counts: incremented with the number of samples tested and drawn
+ * SIDE EFFECTS: draws the visible samples of the triangle that fall into the target and updates its z-buffer
+ */
+void draw_triangle(Triangle t, int32_t color, Camera* camera, Target* target, RasterCounts* counts) {
+	STATS_BEGIN(project_start);
+	// Dequantize the vertices once as they are transformed
+	Vector vertices[3];
+	Vector projectedVertices[3];
+	int32_t j;
+	for (j = 0; j < 3; j++) {
+		vertices[j] = get_vertex(t.vertices[j]);
+	}
+
+	if (backface_culled(vertices, camera)) {
+		STATS_END(STAGE_PROJECT, project_start);
+		counts->triangles_culled++;
+		return;
+	}
+
+	// Points only need the centroid to be projected
+	if (point_size > 0) {
+		STATS_END(STAGE_PROJECT, project_start);
+		draw_point(vertices, color, camera, target, counts);
+		return;
+	}
+
+	// Skip triangles that are behind the camera or whose bounding box lies entirely outside of the target
+	double min_x, max_x, min_y, max_y;
+	int32_t behind_camera = project_bounds(vertices, camera, projectedVertices, &min_x, &max_x, &min_y, &max_y);
+	STATS_END(STAGE_PROJECT, project_start);
+	if (behind_camera || outside_rows(min_x, max_x, min_y, max_y, target->y0, target->rows)) {
+		counts->triangles_culled++;
+		return;
+	}
+
+	raster_triangle(vertices, projectedVertices, color, camera, target, counts);
+}
+
+/*
+ * flush_counts
+ *
+ * INPUTS: counts: the counters collected while drawing a frame
+ * SIDE EFFECTS: adds the counters to the statistics
+ */
+void flush_counts(RasterCounts* counts) {
+	STATS_COUNT(COUNTER_TRIANGLES_CULLED, counts->triangles_culled);
+	STATS_COUNT(COUNTER_SAMPLES_TESTED, counts->samples_tested);
+	STATS_COUNT(COUNTER_DEPTH_PASSES, counts->depth_passes);
+	STATS_COUNT(COUNTER_DEPTH_FAILS, counts->samples_tested - counts->depth_passes);
+	STATS_COUNT(COUNTER_PIXELS_COVERED, counts->pixels_covered);
+	STATS_COUNT(COUNTER_SUBPIXEL_TRIANGLES, counts->subpixel_triangles);
+}
+
+/*
+ * set_pipelined
+ *
+ * INPUTS: enabled: nonzero if future pictures should be drawn by concurrent reader, decoder, transform and raster stages
+ * OUTPUTS: none
+ * RETURN VALUE: none
+ * SIDE EFFECTS: sets the pipelining option
+ */
+void set_pipelined(int32_t enabled) {
+	pipelined = enabled;
+}
+
+/*
+ * set_engine
+ *
+ * INPUTS: new_engine: the way future pictures should be drawn
+ * OUTPUTS: none
+ * RETURN VALUE: none
+ * SIDE EFFECTS: sets the engine option
+ */
+void set_engine(Engine new_engine) {
+	engine = new_engine;
+}
+
+/*
+ * set_lod
+ *
+ * INPUTS: max_triangles: the number of triangles to simplify future objects down to, or 0 for no limit
+ *         rms_pixels: the root mean square distance in pixels that simplifying may move the surface of an object on
+ *                     screen, or 0 for no limit
+ *         cached: nonzero if levels of detail should be cached in <STL file>.lod
+ * OUTPUTS: none
+ * RETURN VALUE: none
+ * SIDE EFFECTS: sets the level of detail options
  */
-void parse_and_insert_STL(char* file, double max_radius, int32_t* num_triangles, int32_t* num_vertices, int32_t color) {
-	FILE* fp;
+void set_lod(int64_t max_triangles, double rms_pixels, int32_t cached) {
+	lod_max_triangles = max_triangles;
+	lod_rms_pixels = rms_pixels;
+	lod_cached = cached;
+}
+
+/*
+ * set_reorder
+ *
+ * INPUTS: enabled: nonzero if the triangles and vertices of future objects should be reordered for locality
+ * OUTPUTS: none
+ * RETURN VALUE: none
+ * SIDE EFFECTS: sets the reordering option
+ */
+void set_reorder(int32_t enabled) {
+	reordering = enabled;
+}
 
-	fp = fopen(file, "r");
-	
-	// Skip STL header
-	fseek(fp, 80, SEEK_SET);
+/*
+ * set_meshlets
+ *
+ * INPUTS: enabled: nonzero if future objects should be split into meshlets that are culled as a whole
+ * OUTPUTS: none
+ * RETURN VALUE: none
+ * SIDE EFFECTS: sets the meshlet option
+ */
+void set_meshlets(int32_t enabled) {
+	meshlet_culling = enabled;
+}
+
+/*
+ * set_backface_culling
+ *
+ * INPUTS: enabled: nonzero if triangles whose front (counterclockwise) side faces away from the camera should not be drawn
+ * OUTPUTS: none
+ * RETURN VALUE: none
+ * SIDE EFFECTS: sets the backface culling option
+ */
+void set_backface_culling(int32_t enabled) {
+	backface_culling = enabled;
+}
 
-	// Get number of triangles
-	uint32_t actual_num_triangles;
-	fread(&actual_num_triangles, 4, 1, fp);
+/*
+ * outside_view
+ *
+ * INPUTS: center, radius: a sphere
+ *         camera: the camera that the picture is drawn from
+ * RETURN VALUE: 1 if no point in the sphere can be drawn as a sample of the picture, 0 otherwise
+ * SIDE EFFECTS: none
+ *
+ * A point d in front of the camera (relative to its location) projects to x = dot(right', d) / dot(direction, d),
+ * where right' is the part of camera->right perpendicular to the direction, so each edge of the picture is a
+ * plane through the camera location and the sphere is tested against the four of them and the camera plane.
+ */
+static int32_t outside_view(Vector center, double radius, Camera* camera) {
+	Vector d = add_vec(center, neg_vec(camera->location));
+	if (dot(camera->direction, d) < -radius) {
+		return 1;
+	}
 
+	// Allow a pixel of slack, since samples are truncated to pixels
+	double half_width = camera->width / 2 + camera->scale;
+	double half_height = camera->height / 2 + camera->scale;
+	Vector right = add_vec(camera->right, mul_vec(-dot(camera->right, camera->direction), camera->direction));
+	Vector up = add_vec(camera->up, mul_vec(-dot(camera->up, camera->direction), camera->direction));
+	Vector planes[4] = {
+		add_vec(right, mul_vec(-half_width, camera->direction)),
+		add_vec(neg_vec(right), mul_vec(-half_width, camera->direction)),
+		add_vec(up, mul_vec(-half_height, camera->direction)),
+		add_vec(neg_vec(up), mul_vec(-half_height, camera->direction))
+	};
 	int32_t i;
-	char buffer[BUFFER_SIZE];
+	for (i = 0; i < 4; i++) {
+		if (dot(planes[i], d) > radius * magnitude(planes[i])) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * facing_away
+ *
+ * INPUTS: m: a meshlet
+ *         camera: the camera that the picture is drawn from
+ * RETURN VALUE: 1 if the front of every triangle of the meshlet faces away from the camera, 0 otherwise
+ * SIDE EFFECTS: none
+ *
+ * Every normal is within acos(cone_cos) of the cone axis, and every direction from the camera to the
+ * meshlet is within asin(radius / distance) of the direction to its center, so all of the triangles
+ * face away if those angles and the angle between the axis and the center add up to less than 90 degrees.
+ */
+static int32_t facing_away(Meshlet* m, Camera* camera) {
+	if (m->cone_cos <= 0) {
+		return 0;
+	}
+	Vector d = add_vec(m->center, neg_vec(camera->location));
+	double distance = magnitude(d);
+	if (distance <= m->radius) {
+		return 0;
+	}
+	double center_angle = acos(MAX(-1.0, MIN(1.0, dot(d, m->cone_axis) / distance)));
+	return center_angle + asin(m->radius / distance) + acos(m->cone_cos) < M_PI / 2;
+}
+
+/*
+ * draw_meshlets
+ *
+ * INPUTS: light: the normalized direction of the light
+ *         camera: the camera to draw the triangles from
+ *         target: the target to draw into
+ * OUTPUTS: counts: incremented with the number of samples tested and drawn
+ * SIDE EFFECTS: draws the triangles of every meshlet that may be visible, shading them as they are drawn
+ */
+static void draw_meshlets(Vector light, Camera* camera, Target* target, RasterCounts* counts) {
+	uint64_t meshlets_culled = 0;
+	uint64_t triangles_culled = 0;
+	int64_t i, j;
+	for (i = 0; i < num_meshlets; i++) {
+		Meshlet* m = &meshlets[i];
+		if (outside_view(m->center, m->radius, camera) || (backface_culling && facing_away(m, camera))) {
+			meshlets_culled++;
+			triangles_culled += m->count;
+			continue;
+		}
+
+		for (j = m->first; j < m->first + m->count; j++) {
+			STATS_BEGIN(shade_start);
+			Vector vertices[3] = {get_vertex(triangles[j].vertices[0]), get_vertex(triangles[j].vertices[1]), get_vertex(triangles[j].vertices[2])};
+			int32_t color = shade_vertices(vertices, triangles[j].color, light);
+			STATS_END(STAGE_SHADE, shade_start);
+			draw_triangle(triangles[j], color, camera, target, counts);
+		}
+	}
+
+	counts->triangles_culled += triangles_culled;
+	STATS_COUNT(COUNTER_MESHLETS, num_meshlets);
+	STATS_COUNT(COUNTER_MESHLETS_CULLED, meshlets_culled);
+	STATS_COUNT(COUNTER_MESHLET_TRIANGLES_CULLED, triangles_culled);
+}
+
+/*
+ * set_point_size
+ *
+ * INPUTS: size: the size in pixels of the square to draw for each triangle instead of the triangle, or 0 to draw triangles
+ * OUTPUTS: none
+ * RETURN VALUE: none
+ * SIDE EFFECTS: sets the point splat option
+ */
+void set_point_size(int32_t size) {
+	point_size = size;
+}
+
+/*
+ * set_progressive
+ *
+ * INPUTS: enabled: nonzero if future pictures should be drawn in coarse-to-fine passes
+ *         budget_ms: the number of milliseconds after the start of draw_picture at which drawing stops,
+ *                    or 0 to always finish the picture
+ * SIDE EFFECTS: sets the file-scope progressive rendering options
+ */
+void set_progressive(int32_t enabled, double budget_ms) {
+	progressive = enabled;
+	time_budget_ms = budget_ms;
+}
+
+/*
+ * stratified_order
+ *
+ * INPUTS: num_triangles: the number of triangles in the scene
+ *         scale: the maximum radius of any of the object's vertices
+ * OUTPUTS: pass_ends: the index in the returned order at which each pass ends
+ *          num_passes: the number of passes
+ * RETURN VALUE: the indices of all triangles, ordered so that every prefix ending at a pass end is spread evenly over the object
+ * SIDE EFFECTS: allocates the returned array, which must be freed by the caller
+ *
+ * Triangles are bucketed into a grid by their centroids and ranked by their order within their cell. The first
+ * pass holds the first triangle of every cell, and pass p holds the triangles ranked from 2^(p-1) to 2^p - 1,
+ * so every pass doubles the density of the picture.
+ */
+static int64_t* stratified_order(int64_t num_triangles, double scale, int64_t* pass_ends, int32_t* num_passes) {
+	int64_t cell_counts[PROGRESSIVE_GRID * PROGRESSIVE_GRID * PROGRESSIVE_GRID];
+	memset(cell_counts, 0, sizeof(cell_counts));
+
+	uint32_t* ranks = malloc(num_triangles * sizeof(uint32_t));
+	int64_t* order = malloc(num_triangles * sizeof(int64_t));
+	STATS_COUNT(COUNTER_BYTES_ALLOCATED, num_triangles * (sizeof(uint32_t) + sizeof(int64_t)));
+
+	int64_t i;
+	uint32_t max_rank = 0;
+	for (i = 0; i < num_triangles; i++) {
+		Vector centroid = mul_vec(1 / 3.0, add_vec(get_vertex(triangles[i].vertices[0]),
+		                                   add_vec(get_vertex(triangles[i].vertices[1]), get_vertex(triangles[i].vertices[2]))));
+		// The object is centered at the origin with a radius of scale
+		int32_t cx = (int32_t)((centroid.x + scale) / (2 * scale) * PROGRESSIVE_GRID);
+		int32_t cy = (int32_t)((centroid.y + scale) / (2 * scale) * PROGRESSIVE_GRID);
+		int32_t cz = (int32_t)((centroid.z + scale) / (2 * scale) * PROGRESSIVE_GRID);
+		cx = MAX(0, MIN(PROGRESSIVE_GRID - 1, cx));
+		cy = MAX(0, MIN(PROGRESSIVE_GRID - 1, cy));
+		cz = MAX(0, MIN(PROGRESSIVE_GRID - 1, cz));
+		ranks[i] = (uint32_t)cell_counts[(cx * PROGRESSIVE_GRID + cy) * PROGRESSIVE_GRID + cz]++;
+		max_rank = MAX(max_rank, ranks[i]);
+	}
+
+	// Counting sort by rank, keeping the file order among triangles of equal rank
+	int64_t* rank_starts = calloc((int64_t)max_rank + 2, sizeof(int64_t));
+	for (i = 0; i < num_triangles; i++) {
+		rank_starts[ranks[i] + 1]++;
+	}
+	for (i = 1; i <= (int64_t)max_rank + 1; i++) {
+		rank_starts[i] += rank_starts[i - 1];
+	}
+
+	*num_passes = 0;
+	int64_t rank_end = 1;
 	while (1) {
-		int32_t num_elements_read = fread(&buffer, 1, BUFFER_SIZE, fp);
-		for (i = 0; i < num_elements_read / STL_BLOCK_SIZE; i++) {
-			char* cur_buffer = buffer + i * STL_BLOCK_SIZE;
-			RawTriangle t;
-			t.color = color;	
-
-			// Skip normal
-			cur_buffer += 12;
-
-			// Read in triangles
-			int32_t j;
-			for (j = 0; j < 3; j++) {
-				float x, y, z;
-				memcpy(&x, cur_buffer + 0, 4);
-				memcpy(&y, cur_buffer + 4, 4);
-				memcpy(&z, cur_buffer + 8, 4);
-				t.vertices[j].x = (double)x;
-				t.vertices[j].y = (double)y;
-				t.vertices[j].z = (double)z;
-				cur_buffer += 12;
+		pass_ends[(*num_passes)++] = rank_starts[MIN(rank_end, (int64_t)max_rank + 1)];
+		if (rank_end > max_rank) {
+			break;
+		}
+		rank_end *= 2;
+	}
+
+	for (i = 0; i < num_triangles; i++) {
+		order[rank_starts[ranks[i]]++] = i;
+	}
+
+	free(rank_starts);
+	free(ranks);
+	return order;
+}
+
+/*
+ * splat_triangle
+ *
+ * INPUTS: t: the triangle to splat
+ *         color: the shaded color of the triangle
+ *         camera: the camera to draw the triangle from
+ *         size: the width and height of the block of pixels to cover
+ *         target: the target to draw into
+ *         splat_buffer: the distance from the camera of the closest splat drawn at each pixel of the target
+ * SIDE EFFECTS: draws a block of pixels around the centroid of the triangle wherever no sample has been
+ *               drawn and no closer splat has been drawn, and updates splat_buffer
+ *
+ * Splats stand in for the triangles that have not been drawn yet during the coarse progressive passes.
+ */
+static void splat_triangle(Triangle t, int32_t color, Camera* camera, int32_t size, Target* target, float* splat_buffer) {
+	Vector centroid = mul_vec(1 / 3.0, add_vec(get_vertex(t.vertices[0]), add_vec(get_vertex(t.vertices[1]), get_vertex(t.vertices[2]))));
+	Vector proj = project_point(camera->location, camera->direction, camera->right, camera->up, camera->origin, centroid);
+	if (proj.z < 0) {
+		return;
+	}
+
+	int32_t center_x = (proj.x + camera->width / 2) / camera->scale;
+	int32_t center_y = (-proj.y + camera->height / 2) / camera->scale;
+	float dist = magnitude(add_vec(centroid, neg_vec(camera->location)));
+
+	int32_t x, y;
+	for (y = MAX(target->y0, center_y - size / 2); y < MIN(target->y0 + target->rows, center_y - size / 2 + size); y++) {
+		for (x = MAX(0, center_x - size / 2); x < MIN(image_width, center_x - size / 2 + size); x++) {
+			int64_t index = (int64_t)(y - target->y0) * image_width + x;
+			if (target->z_buffer[index] == Z_BUFFER_FAR && dist < splat_buffer[index]) {
+				splat_buffer[index] = dist;
+				target->pixels[index] = color;
 			}
+		}
+	}
+}
+
+/*
+ * draw_progressive
+ *
+ * INPUTS: num_triangles: the number of triangles in the scene
+ *         scale: the maximum radius of any of the object's vertices
+ *         colors: the shaded color of each triangle
+ *         camera: the camera to draw the triangles from
+ *         target: the target covering the whole image to draw into
+ *         start: the value of stats_now() when draw_picture started
+ * OUTPUTS: counts: incremented with the number of samples tested and drawn
+ * RETURN VALUE: 0 if any dot is drawn out of bounds, 1 otherwise
+ * SIDE EFFECTS: draws the triangles in coarse-to-fine passes until they have all been drawn or the time budget
+ *               runs out, presenting the target and calling progressive_pass_done after every pass
+ *
+ * Every triangle is drawn exactly as it would be otherwise, so a finished progressive picture is the same as a
+ * normal one except where triangles tie in depth, since they are drawn in a different order. The coarse passes also splat each triangle over a block of pixels to cover the gaps left by the
+ * triangles that have not been drawn yet; splats never override samples and are erased if the picture finishes.
+ */
+static int32_t draw_progressive(int64_t num_triangles, double scale, int32_t* colors, Camera* camera,
+                                Target* target, uint64_t start, RasterCounts* counts) {
+	int32_t output = 1;
+	uint64_t deadline = (time_budget_ms > 0) ? start + (uint64_t)(time_budget_ms * 1e6) : 0;
+
+	int64_t pass_ends[PROGRESSIVE_MAX_PASSES];
+	int32_t num_passes;
+	int64_t* order = stratified_order(num_triangles, scale, pass_ends, &num_passes);
 
-			// Skip attributes
-			cur_buffer += 2;
+	int64_t size = (int64_t)image_width * image_height;
+	float* splat_buffer = malloc(size * sizeof(float));
+	STATS_COUNT(COUNTER_BYTES_ALLOCATED, size * sizeof(float));
+	int64_t k;
+	for (k = 0; k < size; k++) {
+		splat_buffer[k] = Z_BUFFER_FAR;
+	}
 
-			// Add triangle
-			add_triangle(t, num_triangles, num_vertices);
+	int32_t pass;
+	int32_t expired = 0;
+	for (pass = 0, k = 0; pass < num_passes && !expired; pass++) {
+		// Splat over the average spacing between the triangles drawn so far
+		int32_t splat_size = 1;
+		if (pass_ends[pass] < num_triangles) {
+			splat_size = (int32_t)ceil(sqrt((double)num_triangles / pass_ends[pass]));
+			splat_size = MIN(splat_size, PROGRESSIVE_MAX_SPLAT);
 		}
 
-		if (num_elements_read != BUFFER_SIZE)
+		for (; k < pass_ends[pass]; k++) {
+			int64_t i = order[k];
+			draw_triangle(triangles[i], colors[i], camera, target, counts);
+			if (splat_size > 1) {
+				splat_triangle(triangles[i], colors[i], camera, splat_size, target, splat_buffer);
+			}
+
+			// The first pass is always finished so that there is something to show
+			if (pass > 0 && deadline != 0 && (k % DEADLINE_CHECK_INTERVAL) == 0 && stats_now() > deadline) {
+				expired = 1;
+				break;
+			}
+		}
+
+		if (k == num_triangles) {
+			// Erase the splats that were never covered by a sample
+			int64_t index;
+			for (index = 0; index < size; index++) {
+				if (target->z_buffer[index] == Z_BUFFER_FAR && splat_buffer[index] != Z_BUFFER_FAR) {
+					target->pixels[index] = BACKGROUND_COLOR;
+				}
+			}
+		}
+
+		output &= present_target(target);
+		if (!expired) {
+			progressive_pass_done(pass, k, stats_now() - start);
+		}
+	}
+
+	if (k != num_triangles) {
+		printf("Time budget ran out after drawing %lld of %lld triangles (%d of %d passes)\n",
+		       (long long)k, (long long)num_triangles, pass - 1, num_passes);
+	}
+
+	free(splat_buffer);
+	free(order);
+	return output;
+}
+
+/*
+ * TiledJob
+ *
+ * Struct shared between the worker threads and the writer of a tiled picture
+ * Members:
+ *  -camera: the camera to draw the triangles from
+ *  -colors: the shaded color of each triangle
+ *  -num_bands: the number of bands in the picture
+ *  -band_starts, band_triangles: the triangles that overlap band b are band_triangles[band_starts[b]] to
+ *                                band_triangles[band_starts[b + 1] - 1]
+ *  -lock, changed: protect and signal changes to the members below
+ *  -next_band: the next band that a worker should draw
+ *  -bands_written: the number of bands that have been written out
+ *  -finished: the drawn pixels of each band, or NULL if it has not been drawn yet
+ *  -counts: the counters collected by all workers
+ */
+typedef struct {
+	Camera* camera;
+	int32_t* colors;
+	int32_t num_bands;
+	int64_t* band_starts;
+	uint32_t* band_triangles;
+
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	int32_t next_band;
+	int32_t bands_written;
+	int32_t** finished;
+	RasterCounts counts;
+} TiledJob;
+
+/*
+ * bin_triangles
+ *
+ * INPUTS: num_triangles: the number of triangles in the scene
+ *         camera: the camera to draw the triangles from
+ *         num_bands: the number of bands in the picture
+ * OUTPUTS: band_starts, band_triangles: the triangles overlapping each band, as described in TiledJob
+ * SIDE EFFECTS: allocates *band_starts and *band_triangles, which must be freed by the caller
+ *
+ * Triangles are projected once and added to every band that their bounding box overlaps, so each band
+ * only has to look at its own triangles.
+ */
+static void bin_triangles(int64_t num_triangles, Camera* camera, int32_t num_bands, int64_t** band_starts, uint32_t** band_triangles) {
+	int32_t* first_bands = malloc(num_triangles * sizeof(int32_t));
+	int32_t* last_bands = malloc(num_triangles * sizeof(int32_t));
+	*band_starts = calloc(num_bands + 1, sizeof(int64_t));
+
+	int64_t i;
+	for (i = 0; i < num_triangles; i++) {
+		Vector vertices[3];
+		Vector projectedVertices[3];
+		int32_t j;
+		for (j = 0; j < 3; j++) {
+			vertices[j] = get_vertex(triangles[i].vertices[j]);
+		}
+
+		double min_x, max_x, min_y, max_y;
+		int32_t behind_camera = project_bounds(vertices, camera, projectedVertices, &min_x, &max_x, &min_y, &max_y);
+		if (behind_camera || outside_rows(min_x, max_x, min_y, max_y, 0, image_height)) {
+			// Not in any band
+			first_bands[i] = 1;
+			last_bands[i] = 0;
+			continue;
+		}
+		first_bands[i] = (min_y < 0) ? 0 : (int32_t)min_y / tiled_band_rows;
+		last_bands[i] = (max_y >= image_height) ? num_bands - 1 : (int32_t)MAX(0, max_y) / tiled_band_rows;
+		for (j = first_bands[i]; j <= last_bands[i]; j++) {
+			(*band_starts)[j + 1]++;
+		}
+	}
+
+	int32_t b;
+	for (b = 0; b < num_bands; b++) {
+		(*band_starts)[b + 1] += (*band_starts)[b];
+	}
+	*band_triangles = malloc((*band_starts)[num_bands] * sizeof(uint32_t));
+	STATS_COUNT(COUNTER_BYTES_ALLOCATED, (*band_starts)[num_bands] * sizeof(uint32_t));
+
+	int64_t* band_ends = malloc(num_bands * sizeof(int64_t));
+	memcpy(band_ends, *band_starts, num_bands * sizeof(int64_t));
+	for (i = 0; i < num_triangles; i++) {
+		for (b = first_bands[i]; b <= last_bands[i]; b++) {
+			(*band_triangles)[band_ends[b]++] = (uint32_t)i;
+		}
+	}
+
+	free(band_ends);
+	free(last_bands);
+	free(first_bands);
+}
+
+/*
+ * tiled_worker
+ *
+ * INPUTS: arg: the TiledJob to work on
+ * RETURN VALUE: NULL
+ * SIDE EFFECTS: draws bands of the picture until there are none left, waiting whenever too many finished
+ *               bands have not been written yet
+ */
+static void* tiled_worker(void* arg) {
+	TiledJob* job = arg;
+	RasterCounts counts = {0, 0, 0, 0, 0};
+	int32_t max_in_flight = BANDS_IN_FLIGHT_PER_THREAD * num_threads;
+
+	while (1) {
+		pthread_mutex_lock(&job->lock);
+		while (job->next_band < job->num_bands && job->next_band >= job->bands_written + max_in_flight) {
+			pthread_cond_wait(&job->changed, &job->lock);
+		}
+		int32_t band = job->next_band++;
+		pthread_mutex_unlock(&job->lock);
+		if (band >= job->num_bands) {
 			break;
+		}
+
+		Target target;
+		int32_t y0 = band * tiled_band_rows;
+		init_target(&target, y0, MIN(tiled_band_rows, image_height - y0));
+		int64_t k;
+		for (k = job->band_starts[band]; k < job->band_starts[band + 1]; k++) {
+			uint32_t i = job->band_triangles[k];
+			draw_triangle(triangles[i], job->colors[i], job->camera, &target, &counts);
+		}
+		free(target.z_buffer);
+
+		pthread_mutex_lock(&job->lock);
+		job->finished[band] = target.pixels;
+		pthread_cond_broadcast(&job->changed);
+		pthread_mutex_unlock(&job->lock);
 	}
 
-	fclose(fp);
+	pthread_mutex_lock(&job->lock);
+	job->counts.samples_tested += counts.samples_tested;
+	job->counts.depth_passes += counts.depth_passes;
+	job->counts.pixels_covered += counts.pixels_covered;
+	job->counts.triangles_culled += counts.triangles_culled;
+	job->counts.subpixel_triangles += counts.subpixel_triangles;
+	pthread_mutex_unlock(&job->lock);
+	return NULL;
+}
+
+/*
+ * draw_tiled
+ *
+ * INPUTS: num_triangles: the number of triangles in the scene
+ *         colors: the shaded color of each triangle
+ *         camera: the camera to draw the triangles from
+ * OUTPUTS: counts: incremented with the number of samples tested and drawn
+ * SIDE EFFECTS: draws the picture one band at a time on num_threads worker threads, passing every row to
+ *               write_row in order as soon as its band is finished
+ *
+ * Only a bounded number of bands are held in memory at once, so the memory used depends on the width of
+ * the picture and the number of rows in a band, not on the height of the picture.
+ */
+static void draw_tiled(int64_t num_triangles, int32_t* colors, Camera* camera, RasterCounts* counts) {
+	TiledJob job;
+	job.camera = camera;
+	job.colors = colors;
+	job.num_bands = (image_height + tiled_band_rows - 1) / tiled_band_rows;
+	job.next_band = 0;
+	job.bands_written = 0;
+	job.finished = calloc(job.num_bands, sizeof(int32_t*));
+	job.counts = (RasterCounts){0, 0, 0, 0, 0};
+	pthread_mutex_init(&job.lock, NULL);
+	pthread_cond_init(&job.changed, NULL);
+
+	STATS_BEGIN(bin_start);
+	bin_triangles(num_triangles, camera, job.num_bands, &job.band_starts, &job.band_triangles);
+	STATS_END(STAGE_PROJECT, bin_start);
+
+	pthread_t* workers = malloc(num_threads * sizeof(pthread_t));
+	int32_t i;
+	for (i = 0; i < num_threads; i++) {
+		pthread_create(&workers[i], NULL, tiled_worker, &job);
+	}
+
+	// Write out the bands in order as they are finished
+	int32_t band;
+	for (band = 0; band < job.num_bands; band++) {
+		pthread_mutex_lock(&job.lock);
+		while (job.finished[band] == NULL) {
+			pthread_cond_wait(&job.changed, &job.lock);
+		}
+		pthread_mutex_unlock(&job.lock);
+
+		int32_t y0 = band * tiled_band_rows;
+		int32_t y;
+		for (y = y0; y < MIN(y0 + tiled_band_rows, image_height); y++) {
+			write_row(y, job.finished[band] + (int64_t)(y - y0) * image_width);
+		}
+		free(job.finished[band]);
+
+		pthread_mutex_lock(&job.lock);
+		job.bands_written++;
+		pthread_cond_broadcast(&job.changed);
+		pthread_mutex_unlock(&job.lock);
+	}
+
+	for (i = 0; i < num_threads; i++) {
+		pthread_join(workers[i], NULL);
+	}
+
+	counts->samples_tested += job.counts.samples_tested;
+	counts->depth_passes += job.counts.depth_passes;
+	counts->pixels_covered += job.counts.pixels_covered;
+	counts->triangles_culled += job.counts.triangles_culled;
+	counts->subpixel_triangles += job.counts.subpixel_triangles;
+
+	pthread_cond_destroy(&job.changed);
+	pthread_mutex_destroy(&job.lock);
+	free(workers);
+	free(job.band_triangles);
+	free(job.band_starts);
+	free(job.finished);
+}
+
+/*
+ * RayJob
+ *
+ * Struct shared between the threads casting the rays of a picture
+ * Members:
+ *  -camera: the camera to cast rays from
+ *  -target: the picture to draw into
+ *  -bvh: the hierarchy over the triangles of the scene
+ *  -light: the normalized direction of the light
+ *  -to_direction: the columns of the matrix that turns (1, right offset, up offset) on the camera plane
+ *                 into the direction of the ray through that point
+ *  -next_row: the next row of packets that a worker should cast
+ *  -lock: protects the members below
+ *  -counts: the counters collected by all workers
+ *  -nodes_visited: the number of nodes of the hierarchy visited by all workers
+ */
+typedef struct {
+	Camera* camera;
+	Target* target;
+	Bvh* bvh;
+	Vector light;
+	Vector to_direction[3];
+	int32_t next_row;
+
+	pthread_mutex_t lock;
+	RasterCounts counts;
+	uint64_t nodes_visited;
+} RayJob;
+
+/*
+ * raycast_worker
+ *
+ * INPUTS: arg: the RayJob to work on
+ * RETURN VALUE: NULL
+ * SIDE EFFECTS: casts one ray through the center of each pixel of rows of packets until there are none left,
+ *               and draws the nearest triangle hit by each ray
+ */
+static void* raycast_worker(void* arg) {
+	RayJob* job = arg;
+	Camera* camera = job->camera;
+	RasterCounts counts = {0, 0, 0, 0, 0};
+	uint64_t nodes_visited = 0;
+	int32_t num_rows = (image_height + RAY_PACKET_SIDE - 1) / RAY_PACKET_SIDE;
+	// The camera plane is offset along right when the camera is rotated, which the ray directions undo
+	double right_offset = dot(camera->right, camera->direction);
+	double up_offset = dot(camera->up, camera->direction);
+
+	int32_t row;
+	while ((row = __atomic_fetch_add(&job->next_row, 1, __ATOMIC_RELAXED)) < num_rows) {
+		int32_t x0;
+		for (x0 = 0; x0 < image_width; x0 += RAY_PACKET_SIDE) {
+			RayPacket packet;
+			int64_t pixels[RAY_PACKET_SIZE];
+			packet.origin = camera->location;
+			packet.count = 0;
+			int32_t x, y;
+			for (y = row * RAY_PACKET_SIDE; y < MIN((row + 1) * RAY_PACKET_SIDE, image_height); y++) {
+				for (x = x0; x < MIN(x0 + RAY_PACKET_SIDE, image_width); x++) {
+					double proj_x = (x + 0.5) * camera->scale - camera->width / 2;
+					double proj_y = camera->height / 2 - (y + 0.5) * camera->scale;
+					packet.directions[packet.count] = add_vec(job->to_direction[0],
+					                                          add_vec(mul_vec(proj_x + right_offset, job->to_direction[1]),
+					                                                  mul_vec(proj_y + up_offset, job->to_direction[2])));
+					packet.t[packet.count] = INFINITY;
+					packet.triangle[packet.count] = -1;
+					pixels[packet.count++] = (int64_t)y * image_width + x;
+				}
+			}
+			nodes_visited += trace_packet(job->bvh, &packet, backface_culling);
+
+			int32_t r;
+			for (r = 0; r < packet.count; r++) {
+				counts.samples_tested++;
+				if (packet.triangle[r] < 0) {
+					continue;
+				}
+				Triangle t = triangles[packet.triangle[r]];
+				Vector vertices[3] = {get_vertex(t.vertices[0]), get_vertex(t.vertices[1]), get_vertex(t.vertices[2])};
+				job->target->pixels[pixels[r]] = shade_vertices(vertices, t.color, job->light);
+				job->target->z_buffer[pixels[r]] = packet.t[r] * magnitude(packet.directions[r]);
+				counts.pixels_covered++;
+				counts.depth_passes++;
+			}
+		}
+	}
+
+	pthread_mutex_lock(&job->lock);
+	job->counts.samples_tested += counts.samples_tested;
+	job->counts.depth_passes += counts.depth_passes;
+	job->counts.pixels_covered += counts.pixels_covered;
+	job->nodes_visited += nodes_visited;
+	pthread_mutex_unlock(&job->lock);
+	return NULL;
+}
+
+/*
+ * lod_enabled
+ *
+ * RETURN VALUE: 1 if objects are simplified before they are drawn, 0 otherwise
+ * SIDE EFFECTS: none
+ */
+static int32_t lod_enabled() {
+	return lod_max_triangles > 0 || lod_rms_pixels > 0;
+}
+
+/*
+ * draw_raycast
+ *
+ * INPUTS: file: the STL file that the scene was loaded from
+ *         scale: the maximum radius that the object was normalized to
+ *         num_triangles: the number of triangles in the scene
+ *         light: the normalized direction of the light
+ *         color: the color of the object
+ *         camera: the camera to cast rays from
+ *         target: the whole picture, cleared
+ * OUTPUTS: counts: incremented with the number of rays cast and pixels drawn
+ * SIDE EFFECTS: loads the hierarchy over the triangles cached for the file, or builds it and caches it,
+ *               unless the object was simplified, and casts one ray per pixel on num_threads threads, drawing the triangle each ray hits first
+ *               with the same color that rasterizing would give it
+ */
+static void draw_raycast(char* file, double scale, int64_t num_triangles, Vector light, int32_t color, Camera* camera,
+                         Target* target, RasterCounts* counts) {
+	STATS_BEGIN(bvh_start);
+	// The cache only matches the triangles of the full object, and a simplified object depends on the camera
+	Bvh bvh;
+	if (lod_enabled()) {
+		build_bvh(num_triangles, num_threads, &bvh);
+	} else if (!load_bvh(file, scale, num_triangles, &bvh)) {
+		build_bvh(num_triangles, num_threads, &bvh);
+		save_bvh(file, scale, &bvh);
+	}
+	STATS_END(STAGE_BVH, bvh_start);
 
-	// Normalize triangles to be centered at the origin
-	Vector center = (Vector){0, 0, 0};
-	for (i = 0; i < *num_vertices; i++) {
-		center = add_vec(center, vertex_list[i]);
+	STATS_BEGIN(ray_start);
+	RayJob job;
+	job.camera = camera;
+	job.target = target;
+	job.bvh = &bvh;
+	job.light = light;
+	job.next_row = 0;
+	job.counts = (RasterCounts){0, 0, 0, 0, 0};
+	job.nodes_visited = 0;
+	pthread_mutex_init(&job.lock, NULL);
+
+	// A point p on the camera plane is reached by the direction d with dot(direction, d) = 1, dot(right, d) = p.x
+	// plus the offset of the plane and dot(up, d) = p.y, so d is found by inverting the matrix with those rows
+	Vector rows[3] = {camera->direction, camera->right, camera->up};
+	double det = dot(rows[0], cross(rows[1], rows[2]));
+	job.to_direction[0] = mul_vec(1 / det, cross(rows[1], rows[2]));
+	job.to_direction[1] = mul_vec(1 / det, cross(rows[2], rows[0]));
+	job.to_direction[2] = mul_vec(1 / det, cross(rows[0], rows[1]));
+
+	// The workers shade the triangles they hit at the same time, so they must only ever read the shade table
+	if (color != shade_table_color) {
+		build_shade_table(color);
 	}
-	center = mul_vec(1.0 / (*num_vertices), center);
 
-	for (i = 0; i < *num_vertices; i++) {
-		vertex_list[i] = add_vec(vertex_list[i], neg_vec(center));
+	pthread_t* workers = malloc(num_threads * sizeof(pthread_t));
+	int32_t i;
+	for (i = 0; i < num_threads; i++) {
+		pthread_create(&workers[i], NULL, raycast_worker, &job);
 	}
+	for (i = 0; i < num_threads; i++) {
+		pthread_join(workers[i], NULL);
+	}
+	free(workers);
+	pthread_mutex_destroy(&job.lock);
+	STATS_END(STAGE_RAY_CAST, ray_start);
+
+	counts->samples_tested += job.counts.samples_tested;
+	counts->depth_passes += job.counts.depth_passes;
+	counts->pixels_covered += job.counts.pixels_covered;
+	STATS_COUNT(COUNTER_BVH_NODES_VISITED, job.nodes_visited);
+	free_bvh(&bvh);
+}
 
-	// Limit the maximum spread
-	double actual_max_radius = 0;
-	for (i = 0; i < *num_vertices; i++) {
-		double dist = magnitude(vertex_list[i]);
-		actual_max_radius = MAX(actual_max_radius, dist);
+/*
+ * use_raycast
+ *
+ * INPUTS: file: the STL file that the scene was loaded from
+ *         scale: the maximum radius that the object was normalized to
+ *         num_triangles: the number of triangles in the scene
+ * RETURN VALUE: 1 if the picture should be ray cast, 0 if it should be rasterized
+ * SIDE EFFECTS: none
+ *
+ * Rasterizing costs about the same for every triangle, while casting rays costs about the same for every
+ * pixel once the hierarchy exists, so ENGINE_AUTO casts rays when there are many triangles per pixel.
+ * Building the hierarchy costs a few times more per triangle than rasterizing it, so ENGINE_AUTO only casts
+ * rays when the hierarchy is already cached for the file; ENGINE_RAY builds and caches it. Simplified objects
+ * are never cached, since they depend on the camera, so ENGINE_AUTO always rasterizes them.
+ */
+static int32_t use_raycast(char* file, double scale, int64_t num_triangles) {
+	if (engine != ENGINE_AUTO) {
+		return engine == ENGINE_RAY;
 	}
+	if (tiled_band_rows > 0 || progressive || meshlet_culling || point_size > 0) {
+		return 0;
+	}
+	double ratio = (double)num_triangles / ((double)image_width * image_height);
+	return num_triangles >= RAY_CAST_MIN_TRIANGLES && ratio >= RAY_CAST_RATIO && !lod_enabled() &&
+	       bvh_cached(file, scale, num_triangles);
+}
 
-	for (i = 0; i < *num_vertices; i++) {
-		vertex_list[i] = mul_vec(max_radius / actual_max_radius, vertex_list[i]);
+/*
+ * lod_max_rms_error
+ *
+ * INPUTS: camera: the camera the picture is drawn with
+ *         scale: the maximum radius of any of the object's vertices
+ * RETURN VALUE: the root mean square distance that the surface of the object can move without moving by more
+ *               than lod_rms_pixels on screen, or INFINITY if there is no limit
+ * SIDE EFFECTS: none
+ *
+ * The object lies within scale of the origin, so no part of it is closer to the camera than that, and a
+ * pixel at a depth z covers z * camera->scale.
+ */
+static double lod_max_rms_error(Camera* camera, double scale) {
+	if (lod_rms_pixels <= 0) {
+		return INFINITY;
 	}
-}	
+	double nearest = magnitude(camera->location) - scale;
+	return (nearest > 0) ? lod_rms_pixels * camera->scale * nearest : 0;
+}
 
 /*
  * draw_picture
@@ -284,50 +1415,39 @@ void parse_and_insert_STL(char* file, double max_radius, int32_t* num_triangles,
  *         rotation: the amount that the camera should be rotated clockwise from its default orientation
  *         color: the color of the object to draw
  * RETURNS: 1 if any dot is drawn out of bounds
+ * SIDE EFFECTS: draws the picture with draw_dot, or passes it to write_row one row at a time if it is tiled
  */
 int32_t draw_picture(char* file, double scale, Vector camera_location, double rotation, int32_t color) {
+	if (pipelined) {
+		return draw_pipelined(file, scale, camera_location, rotation, color);
+	}
+
+	uint64_t start = stats_now();
+
 	// Initialize variables
 	int32_t output = 1;
-	int32_t num_triangles = 0;
-	int32_t num_vertices = 0;
+	int64_t num_triangles = 0;
+	int64_t num_vertices = 0;
+	free(triangles);
+	free(vertex_list);
 	triangles = NULL;
+	triangles_size = 0;
 	vertex_list = NULL;
+	vertex_list_size = 0;
 
-	// Clear image
-	int32_t x;
-	for (x = 0; x < WIDTH; x++) {
-		int32_t y;
-		for (y = 0; y < HEIGHT; y++) {
-			draw_dot(x, y);
-		}
-	}
+	Camera camera = setup_camera(camera_location, rotation);
 
 	// Insert object into scene
-	int delta_vertices = num_vertices;
-	parse_and_insert_STL(file, scale, &num_triangles, &num_vertices, color);
-	delta_vertices = num_vertices - delta_vertices;
-
-	// Set camera direction to point towards the origin (where the object is)
-	Vector camera_direction = normalize(neg_vec(camera_location));
-
-	// Set camera right to be the vector in the xy plane that is perpendicular to camera_direction
-	double right_angle = -atan2(camera_direction.x, camera_direction.y) - rotation;
-	Vector camera_right = normalize((Vector){cos(right_angle), sin(right_angle), 0});
-
-	Vector camera_up = normalize(cross(camera_right, camera_direction));
-
-	const double CAMERA_SCALE = 1 / 500.0;
-	const double CAMERA_WIDTH = WIDTH * CAMERA_SCALE;
-	const double CAMERA_HEIGHT = HEIGHT * CAMERA_SCALE;
-	const Vector LIGHT_DIRECTION = camera_direction;
-
-	double z_buffer[WIDTH][HEIGHT];
-	for (x = 0; x < WIDTH; x++) {
-		int32_t y;
-		for (y = 0; y < HEIGHT; y++) {
-			z_buffer[x][y] = 100000000.0;
-		}
+	int64_t delta_vertices = num_vertices;
+	if (lod_enabled()) {
+		load_lod(file, scale, lod_max_triangles, lod_max_rms_error(&camera, scale), lod_cached, num_threads, color,
+		         &num_triangles, &num_vertices);
+	} else {
+		parse_and_insert_STL(file, scale, &num_triangles, &num_vertices, color);
 	}
+	delta_vertices = num_vertices - delta_vertices;
+	STATS_COUNT(COUNTER_MESH_BYTES, num_vertices * vertex_format_size(vertex_format) + num_triangles * sizeof(Triangle));
+	const Vector LIGHT_DIRECTION = camera.direction;
 
 	// Create z buffer
 	// Loop through all objects
@@ -335,54 +1455,55 @@ int32_t draw_picture(char* file, double scale, Vector camera_location, double ro
 	//		Calculate the positions of the vertices in the picture
 	//		Loop through the pixels in the triangle and check each one with the z buffer
 	// 		If the z buffer is good, put the pixel into the image
-	int32_t i;
-	for (i = 0; i < num_triangles; i++) {
-		int32_t color = get_color(triangles[i], LIGHT_DIRECTION);
+	RasterCounts counts = {0, 0, 0, 0, 0};
 
-		Vector projectedVertices[3];
-		int32_t j;
-		for (j = 0; j < 3; j++) {
-			projectedVertices[j] = project_point(camera_location, camera_direction, camera_right, camera_up, 
-			                                      add_vec(camera_location, camera_direction), vertex_list[triangles[i].vertices[j]]);
+	// Shade every triangle up front, since the light is fixed for the whole frame, unless only the
+	// triangles of visible meshlets will be shaded
+	int32_t* colors = NULL;
+	int32_t raycast = use_raycast(file, scale, num_triangles);
+	if (raycast) {
+		// Only the triangles that rays hit are shaded
+	} else if (meshlet_culling) {
+		build_meshlets(num_triangles, num_vertices);
+	} else {
+		if (reordering) {
+			reorder_mesh(num_triangles, num_vertices);
 		}
+		STATS_BEGIN(shade_start);
+		colors = malloc(num_triangles * sizeof(int32_t));
+		STATS_COUNT(COUNTER_BYTES_ALLOCATED, num_triangles * sizeof(int32_t));
+		shade_triangles(num_triangles, LIGHT_DIRECTION, colors);
+		STATS_END(STAGE_SHADE, shade_start);
+	}
 
-		Vector proj_start = projectedVertices[0];
-		Vector proj_trace = add_vec(projectedVertices[2], neg_vec(projectedVertices[1]));
-		Vector actual_start = vertex_list[triangles[i].vertices[0]];
-		Vector actual_trace = add_vec(vertex_list[triangles[i].vertices[2]], neg_vec(vertex_list[triangles[i].vertices[1]]));
-
-		// Draw a triangle by going across one edge and drawing lines to the remaining point
-		double progress;
-		double increment1 = CAMERA_SCALE / magnitude(proj_trace) / 2;
-		for (progress = 0; progress <= 1; progress += increment1) {
-			Vector proj_end = add_vec(projectedVertices[1], mul_vec(progress, proj_trace));
-			Vector actual_end = add_vec(vertex_list[triangles[i].vertices[1]], mul_vec(progress, actual_trace));
-
-			Vector proj_delta = add_vec(proj_end, neg_vec(proj_start));
-			Vector actual_delta = add_vec(actual_end, neg_vec(actual_start));
-
-			// Draw a line from start to end
-			double t;
-			double increment2 = CAMERA_SCALE / magnitude(proj_delta) / 2;
-			for (t = 0; t <= 1; t += increment2) {
-				Vector proj_point = add_vec(proj_start, mul_vec(t, proj_delta));
-				Vector actual_point = add_vec(actual_start, mul_vec(t, actual_delta));
-
-				int32_t camera_x = (proj_point.x + CAMERA_WIDTH / 2) / CAMERA_SCALE;
-				int32_t camera_y = (-proj_point.y + CAMERA_HEIGHT / 2) / CAMERA_SCALE;
-
-				if (camera_x >= 0 && camera_x < WIDTH && camera_y >= 0 && camera_y < HEIGHT) {
-					// Check distance and z-buffer
-					double dist = magnitude(add_vec(actual_point, neg_vec(camera_location)));
-					if (dist < z_buffer[camera_x][camera_y]) {
-						set_color(color);
-						output &= draw_dot(camera_x, camera_y);
-						z_buffer[camera_x][camera_y] = dist;
-					}
-				}
+	if (tiled_band_rows > 0) {
+		draw_tiled(num_triangles, colors, &camera, &counts);
+	} else {
+		Target target;
+		init_target(&target, 0, image_height);
+		if (raycast) {
+			draw_raycast(file, scale, num_triangles, normalize(LIGHT_DIRECTION), color, &camera, &target, &counts);
+			output &= present_target(&target);
+		} else if (progressive) {
+			output &= draw_progressive(num_triangles, scale, colors, &camera, &target, start, &counts);
+		} else if (meshlet_culling) {
+			draw_meshlets(normalize(LIGHT_DIRECTION), &camera, &target, &counts);
+			output &= present_target(&target);
+		} else {
+			int64_t i;
+			for (i = 0; i < num_triangles; i++) {
+				draw_triangle(triangles[i], colors[i], &camera, &target, &counts);
 			}
+			output &= present_target(&target);
 		}
+		free(target.pixels);
+		free(target.z_buffer);
 	}
 
+	STATS_COUNT(COUNTER_TRIANGLES_IN, num_triangles);
+	flush_counts(&counts);
+
+	free(colors);
+
 	return output;
-}
\ No newline at end of file
+}
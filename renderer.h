@@ -38,14 +38,197 @@
 
 #include <stdint.h>
 
+// The default size of the image
 #define WIDTH 624
 #define HEIGHT 320
 
+// The size of the image, set with set_image_size
+extern int32_t image_width;
+extern int32_t image_height;
+
 /*
  * Draws the 3D rendered STL file
  */
 extern int32_t draw_picture();
 
+/*
+ * set_image_size
+ *
+ * INPUTS: width, height: the size of future pictures in pixels
+ * OUTPUTS: none
+ * RETURN VALUE: none
+ * SIDE EFFECTS: sets image_width and image_height
+ *
+ * The view is framed as it is at the default size, so larger images show the same view in more detail.
+ */
+extern void set_image_size(int32_t width, int32_t height);
+
+/*
+ * set_tiled
+ *
+ * INPUTS: band_rows: the number of image rows to draw at a time, or 0 to draw whole pictures at once
+ * OUTPUTS: none
+ * RETURN VALUE: none
+ * SIDE EFFECTS: sets the tiling options
+ *
+ * Tiled pictures are drawn in horizontal bands and passed to write_row one row at a time
+ * instead of being drawn with draw_dot, so the whole picture never has to be in memory.
+ */
+extern void set_tiled(int32_t band_rows);
+
+/*
+ * set_threads
+ *
+ * INPUTS: threads: the number of worker threads to draw with
+ * OUTPUTS: none
+ * RETURN VALUE: none
+ * SIDE EFFECTS: sets the number of worker threads
+ */
+extern void set_threads(int32_t threads);
+
+/*
+ * write_row
+ *
+ * INPUTS: y: the index of the row of the picture, which are passed in order from top to bottom
+ *         row: the colors of the image_width pixels in the row, in the format taken by set_color
+ * OUTPUTS: none
+ * RETURN VALUE: none
+ * SIDE EFFECTS: none
+ *
+ * Called by draw_picture for every row of a tiled picture.
+ */
+extern void write_row(int32_t y, const int32_t* row);
+
+/*
+ * set_pipelined
+ *
+ * INPUTS: enabled: nonzero if future pictures should be drawn by concurrent reader, decoder, transform and raster stages
+ * OUTPUTS: none
+ * RETURN VALUE: none
+ * SIDE EFFECTS: sets the pipelining option
+ *
+ * Pipelined pictures can start drawing before the file has been read if the normalization of the object is known.
+ */
+extern void set_pipelined(int32_t enabled);
+
+/*
+ * Engine
+ *
+ * The ways in which pictures can be drawn
+ *  -ENGINE_RASTER: project and rasterize every triangle
+ *  -ENGINE_RAY: cast a ray through every pixel, using a bounding volume hierarchy over the triangles
+ *  -ENGINE_AUTO: cast rays when there are many triangles per pixel and the hierarchy is cached, and rasterize otherwise
+ */
+typedef enum {
+	ENGINE_RASTER,
+	ENGINE_RAY,
+	ENGINE_AUTO
+} Engine;
+
+/*
+ * set_engine
+ *
+ * INPUTS: new_engine: the way future pictures should be drawn
+ * OUTPUTS: none
+ * RETURN VALUE: none
+ * SIDE EFFECTS: sets the engine option
+ *
+ * The hierarchy that rays are cast through is cached in <STL file>.bvh, so only the first picture of a file pays to build it.
+ */
+extern void set_engine(Engine new_engine);
+
+/*
+ * set_lod
+ *
+ * INPUTS: max_triangles: the number of triangles to simplify future objects down to, or 0 for no limit
+ *         rms_pixels: the root mean square distance in pixels that simplifying may move the surface of an object on
+ *                     screen, or 0 for no limit
+ *         cached: nonzero if levels of detail should be cached in <STL file>.lod
+ * OUTPUTS: none
+ * RETURN VALUE: none
+ * SIDE EFFECTS: sets the level of detail options
+ *
+ * Objects are only simplified if one of the limits is set. The screen-space limit is measured at the point of the
+ * object's bounding sphere that is closest to the camera, so it picks coarser levels for objects that are farther away.
+ */
+extern void set_lod(int64_t max_triangles, double rms_pixels, int32_t cached);
+
+/*
+ * set_reorder
+ *
+ * INPUTS: enabled: nonzero if the triangles and vertices of future objects should be reordered for locality
+ * OUTPUTS: none
+ * RETURN VALUE: none
+ * SIDE EFFECTS: sets the reordering option
+ *
+ * Objects split into meshlets are always reordered.
+ */
+extern void set_reorder(int32_t enabled);
+
+/*
+ * set_meshlets
+ *
+ * INPUTS: enabled: nonzero if future objects should be split into meshlets that are culled as a whole
+ * OUTPUTS: none
+ * RETURN VALUE: none
+ * SIDE EFFECTS: sets the meshlet option
+ *
+ * Meshlets that lie outside of the view are skipped with one test, as are meshlets whose triangles all
+ * face away from the camera if backface culling is enabled. Building them reorders the triangles.
+ */
+extern void set_meshlets(int32_t enabled);
+
+/*
+ * set_backface_culling
+ *
+ * INPUTS: enabled: nonzero if triangles whose front (counterclockwise) side faces away from the camera should not be drawn
+ * OUTPUTS: none
+ * RETURN VALUE: none
+ * SIDE EFFECTS: sets the backface culling option
+ *
+ * Objects are drawn from both sides by default, so this only leaves the picture unchanged for closed objects.
+ */
+extern void set_backface_culling(int32_t enabled);
+
+/*
+ * set_point_size
+ *
+ * INPUTS: size: the size in pixels of the square to draw for each triangle instead of the triangle, or 0 to draw triangles
+ * OUTPUTS: none
+ * RETURN VALUE: none
+ * SIDE EFFECTS: sets the point splat option
+ *
+ * Points are only worth drawing for meshes that are so dense that most triangles are smaller than a pixel.
+ */
+extern void set_point_size(int32_t size);
+
+/*
+ * set_progressive
+ *
+ * INPUTS: enabled: nonzero if future pictures should be drawn in coarse-to-fine passes
+ *         budget_ms: the number of milliseconds after the start of draw_picture at which drawing stops,
+ *                    or 0 to always finish the picture
+ * OUTPUTS: none
+ * RETURN VALUE: none
+ * SIDE EFFECTS: sets the progressive rendering options
+ */
+extern void set_progressive(int32_t enabled, double budget_ms);
+
+/*
+ * progressive_pass_done
+ *
+ * INPUTS: pass: the index of the progressive pass that was just finished
+ *         triangles_drawn: the total number of triangles drawn so far
+ *         elapsed_ns: the time since draw_picture started
+ * OUTPUTS: none
+ * RETURN VALUE: none
+ * SIDE EFFECTS: none
+ *
+ * Called by draw_picture after every progressive pass, at which point picture_data holds
+ * the picture that would be returned if the time budget ran out.
+ */
+extern void progressive_pass_done(int32_t pass, int64_t triangles_drawn, uint64_t elapsed_ns);
+
 /* 
  *  set_color
  *	 
@@ -0,0 +1,322 @@
+#include "stats.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * StageTime
+ *
+ * Struct holding the accumulated timing information for one stage
+ * Members:
+ *  -total_ns: the total time spent in the stage
+ *  -calls: the number of times the stage was entered
+ *  -first_start: the time at which the stage was first entered
+ *  -last_end: the time at which the stage was last exited
+ */
+typedef struct {
+	uint64_t total_ns;
+	uint64_t calls;
+	uint64_t first_start;
+	uint64_t last_end;
+} StageTime;
+
+/*
+ * PipelineTime
+ *
+ * Struct holding the utilization of one stage of the pipeline
+ * Members:
+ *  -name: the name of the stage
+ *  -start, first_item, end: the times at which the stage started, received its first triangle and finished
+ *  -wait_ns: the time that the stage spent waiting on its neighbours
+ *  -items: the number of triangles that the stage passed on
+ */
+typedef struct {
+	const char* name;
+	uint64_t start;
+	uint64_t first_item;
+	uint64_t end;
+	uint64_t wait_ns;
+	uint64_t items;
+} PipelineTime;
+
+#define MAX_PIPELINE_STAGES 8
+
+static const char* stage_names[NUM_STAGES] = {
+	"cache_lookup", "read", "decompress", "parse", "normalize", "simplify", "lod_cache", "reorder", "cluster", "project", "shade", "raster", "bvh", "ray_cast", "png_encode", "cache_store"
+};
+
+static const char* counter_names[NUM_COUNTERS] = {
+	"triangles_in", "triangles_culled", "samples_tested", "depth_passes",
+	"depth_fails", "pixels_covered", "bytes_allocated", "mesh_bytes",
+	"compressed_bytes", "decompressed_bytes", "meshlets", "meshlets_culled", "meshlet_triangles_culled",
+	"subpixel_triangles",
+	"cache_hits",
+	"cache_misses",
+	"bvh_nodes_visited",
+	"triangles_simplified"
+};
+
+int32_t stats_enabled = 0;
+
+static StageTime stage_times[NUM_STAGES];
+static uint64_t counters[NUM_COUNTERS];
+static uint64_t epoch = 0;
+static PipelineTime pipeline_times[MAX_PIPELINE_STAGES];
+static int32_t num_pipeline_stages = 0;
+
+/*
+ * stats_now
+ *
+ * RETURN VALUE: the current value of the monotonic clock in nanoseconds
+ * SIDE EFFECTS: none
+ */
+uint64_t stats_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * store_earliest
+ *
+ * INPUTS: value: a time that may be updated from several threads at once, or 0 if no time has been stored yet
+ *         time: the time to store if it is earlier
+ * SIDE EFFECTS: atomically sets value to time if it is 0 or later than time
+ */
+static void store_earliest(uint64_t* value, uint64_t time) {
+	uint64_t seen = __atomic_load_n(value, __ATOMIC_RELAXED);
+	while ((seen == 0 || time < seen) &&
+	       !__atomic_compare_exchange_n(value, &seen, time, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	}
+}
+
+/*
+ * store_latest
+ *
+ * INPUTS: value: a time that may be updated from several threads at once
+ *         time: the time to store if it is later
+ * SIDE EFFECTS: atomically sets value to time if it is earlier than time
+ */
+static void store_latest(uint64_t* value, uint64_t time) {
+	uint64_t seen = __atomic_load_n(value, __ATOMIC_RELAXED);
+	while (time > seen && !__atomic_compare_exchange_n(value, &seen, time, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	}
+}
+
+/*
+ * stats_stage_add
+ *
+ * INPUTS: stage: the stage that was executing
+ *         start, end: the values of stats_now() when the stage started and finished
+ * SIDE EFFECTS: adds the elapsed time to the total for the stage
+ */
+void stats_stage_add(Stage stage, uint64_t start, uint64_t end) {
+	StageTime* st = &stage_times[stage];
+	// Stages may be timed from several threads at once
+	__atomic_fetch_add(&st->total_ns, end - start, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&st->calls, 1, __ATOMIC_RELAXED);
+	store_earliest(&st->first_start, start);
+	store_latest(&st->last_end, end);
+	store_earliest(&epoch, start);
+}
+
+/*
+ * stats_count
+ *
+ * INPUTS: counter: the counter to increment
+ *         n: the amount to increment it by
+ * SIDE EFFECTS: increments the counter
+ */
+void stats_count(Counter counter, uint64_t n) {
+	__atomic_fetch_add(&counters[counter], n, __ATOMIC_RELAXED);
+}
+
+/*
+ * stats_pipeline_stage
+ *
+ * INPUTS: name: the name of a stage of the pipeline
+ *         start: the time at which the stage started
+ *         first_item: the time at which the stage received its first triangle
+ *         end: the time at which the stage finished
+ *         wait_ns: the time that the stage spent waiting on its neighbours
+ *         items: the number of triangles that the stage passed on
+ * SIDE EFFECTS: records the utilization of the stage
+ */
+void stats_pipeline_stage(const char* name, uint64_t start, uint64_t first_item, uint64_t end, uint64_t wait_ns, uint64_t items) {
+	if (num_pipeline_stages == MAX_PIPELINE_STAGES) {
+		return;
+	}
+	pipeline_times[num_pipeline_stages++] = (PipelineTime){name, start, first_item, end, wait_ns, items};
+	store_earliest(&epoch, start);
+}
+
+/*
+ * open_output
+ *
+ * INPUTS: file: the path of the file to open, or "-" for stdout
+ * RETURN VALUE: the opened file, or NULL if it could not be opened
+ * SIDE EFFECTS: none
+ */
+static FILE* open_output(char* file) {
+	if (strcmp(file, "-") == 0) {
+		return stdout;
+	}
+	return fopen(file, "w");
+}
+
+/*
+ * close_output
+ *
+ * INPUTS: fp: a file returned by open_output
+ * SIDE EFFECTS: closes the file unless it is stdout
+ */
+static void close_output(FILE* fp) {
+	if (fp != stdout) {
+		fclose(fp);
+	} else {
+		fflush(fp);
+	}
+}
+
+/*
+ * overdraw_ratio
+ *
+ * RETURN VALUE: the number of pixel writes per covered pixel
+ * SIDE EFFECTS: none
+ */
+static double overdraw_ratio() {
+	if (counters[COUNTER_PIXELS_COVERED] == 0) {
+		return 0;
+	}
+	return (double)counters[COUNTER_DEPTH_PASSES] / counters[COUNTER_PIXELS_COVERED];
+}
+
+/*
+ * bytes_per_triangle
+ *
+ * RETURN VALUE: the number of bytes of vertex and triangle storage per triangle in the scene
+ * SIDE EFFECTS: none
+ */
+static double bytes_per_triangle() {
+	if (counters[COUNTER_TRIANGLES_IN] == 0) {
+		return 0;
+	}
+	return (double)counters[COUNTER_MESH_BYTES] / counters[COUNTER_TRIANGLES_IN];
+}
+
+/*
+ * decompress_throughput
+ *
+ * RETURN VALUE: the number of megabytes decompressed per second of decompression
+ * SIDE EFFECTS: none
+ */
+static double decompress_throughput() {
+	if (stage_times[STAGE_DECOMPRESS].total_ns == 0) {
+		return 0;
+	}
+	return counters[COUNTER_DECOMPRESSED_BYTES] / 1e6 / (stage_times[STAGE_DECOMPRESS].total_ns / 1e9);
+}
+
+/*
+ * stats_write_json
+ *
+ * INPUTS: file: the path of the file to write the statistics to, or "-" for stdout
+ * RETURN VALUE: 1 if the file was written, 0 otherwise
+ * SIDE EFFECTS: writes the stage timings and counters as a JSON object
+ */
+int32_t stats_write_json(char* file) {
+	FILE* fp = open_output(file);
+	if (fp == NULL) {
+		fprintf(stderr, "Failed to open statistics file %s\n", file);
+		return 0;
+	}
+
+	int32_t i;
+	fprintf(fp, "{\n  \"stages\": {\n");
+	for (i = 0; i < NUM_STAGES; i++) {
+		fprintf(fp, "    \"%s\": {\"ms\": %.6f, \"calls\": %llu}%s\n", stage_names[i],
+		        stage_times[i].total_ns / 1e6, (unsigned long long)stage_times[i].calls,
+		        (i == NUM_STAGES - 1) ? "" : ",");
+	}
+	fprintf(fp, "  },\n  \"counters\": {\n");
+	for (i = 0; i < NUM_COUNTERS; i++) {
+		fprintf(fp, "    \"%s\": %llu,\n", counter_names[i], (unsigned long long)counters[i]);
+	}
+	fprintf(fp, "    \"overdraw_ratio\": %.6f,\n", overdraw_ratio());
+	fprintf(fp, "    \"bytes_per_triangle\": %.6f,\n", bytes_per_triangle());
+	fprintf(fp, "    \"decompress_mb_per_s\": %.6f\n  }", decompress_throughput());
+
+	// The utilization of a stage is the fraction of the time it was running that it was not waiting on its neighbours
+	if (num_pipeline_stages > 0) {
+		fprintf(fp, ",\n  \"pipeline\": {\n");
+		for (i = 0; i < num_pipeline_stages; i++) {
+			PipelineTime* pt = &pipeline_times[i];
+			uint64_t wall_ns = pt->end - pt->start;
+			fprintf(fp, "    \"%s\": {\"first_item_ms\": %.6f, \"end_ms\": %.6f, \"busy_ms\": %.6f, \"wait_ms\": %.6f, "
+			            "\"utilization\": %.4f, \"items\": %llu}%s\n",
+			        pt->name, (pt->first_item - epoch) / 1e6, (pt->end - epoch) / 1e6, (wall_ns - pt->wait_ns) / 1e6,
+			        pt->wait_ns / 1e6, wall_ns ? (double)(wall_ns - pt->wait_ns) / wall_ns : 0,
+			        (unsigned long long)pt->items, (i == num_pipeline_stages - 1) ? "" : ",");
+		}
+		fprintf(fp, "  }");
+	}
+	fprintf(fp, "\n}\n");
+
+	close_output(fp);
+	return 1;
+}
+
+/*
+ * stats_write_trace
+ *
+ * INPUTS: file: the path of the file to write the trace to
+ * RETURN VALUE: 1 if the file was written, 0 otherwise
+ * SIDE EFFECTS: writes the stage timings and counters in the Chrome trace event format,
+ *               which can be loaded in chrome://tracing or Perfetto
+ *
+ * Stages that run once per triangle are interleaved with each other, so each stage is
+ * drawn as a single span on its own row, starting when the stage was first entered and
+ * lasting for the total time spent in it.
+ */
+int32_t stats_write_trace(char* file) {
+	FILE* fp = open_output(file);
+	if (fp == NULL) {
+		fprintf(stderr, "Failed to open trace file %s\n", file);
+		return 0;
+	}
+
+	int32_t i;
+	uint64_t last_end = epoch;
+	fprintf(fp, "{\"traceEvents\": [\n");
+	for (i = 0; i < NUM_STAGES; i++) {
+		StageTime* st = &stage_times[i];
+		if (st->calls == 0) {
+			continue;
+		}
+		fprintf(fp, "  {\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, "
+		            "\"args\": {\"calls\": %llu, \"wall_ms\": %.6f}},\n",
+		        stage_names[i], i + 1, (st->first_start - epoch) / 1e3, st->total_ns / 1e3,
+		        (unsigned long long)st->calls, (st->last_end - st->first_start) / 1e6);
+		fprintf(fp, "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s\"}},\n",
+		        i + 1, stage_names[i]);
+		last_end = (st->last_end > last_end) ? st->last_end : last_end;
+	}
+	for (i = 0; i < num_pipeline_stages; i++) {
+		PipelineTime* pt = &pipeline_times[i];
+		fprintf(fp, "  {\"name\": \"%s\", \"ph\": \"X\", \"pid\": 2, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, "
+		            "\"args\": {\"wait_ms\": %.6f, \"items\": %llu}},\n",
+		        pt->name, i + 1, (pt->start - epoch) / 1e3, (pt->end - pt->start) / 1e3,
+		        pt->wait_ns / 1e6, (unsigned long long)pt->items);
+		fprintf(fp, "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 2, \"tid\": %d, \"args\": {\"name\": \"%s\"}},\n",
+		        i + 1, pt->name);
+		last_end = (pt->end > last_end) ? pt->end : last_end;
+	}
+	fprintf(fp, "  {\"name\": \"counters\", \"ph\": \"C\", \"pid\": 1, \"ts\": %.3f, \"args\": {", (last_end - epoch) / 1e3);
+	for (i = 0; i < NUM_COUNTERS; i++) {
+		fprintf(fp, "\"%s\": %llu, ", counter_names[i], (unsigned long long)counters[i]);
+	}
+	fprintf(fp, "\"overdraw_ratio\": %.6f}}\n]}\n", overdraw_ratio());
+
+	close_output(fp);
+	return 1;
+}
@@ -0,0 +1,127 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+/*
+ * Stage
+ *
+ * The stages of the rendering pipeline that are timed when statistics are enabled
+ */
+typedef enum {
+	STAGE_CACHE_LOOKUP,
+	STAGE_READ,
+	STAGE_DECOMPRESS,
+	STAGE_PARSE,
+	STAGE_NORMALIZE,
+	STAGE_SIMPLIFY,
+	STAGE_LOD_CACHE,
+	STAGE_REORDER,
+	STAGE_CLUSTER,
+	STAGE_PROJECT,
+	STAGE_SHADE,
+	STAGE_RASTER,
+	STAGE_BVH,
+	STAGE_RAY_CAST,
+	STAGE_PNG_ENCODE,
+	STAGE_CACHE_STORE,
+	NUM_STAGES
+} Stage;
+
+/*
+ * Counter
+ *
+ * The event counters that are collected when statistics are enabled
+ */
+typedef enum {
+	COUNTER_TRIANGLES_IN,
+	COUNTER_TRIANGLES_CULLED,
+	COUNTER_SAMPLES_TESTED,
+	COUNTER_DEPTH_PASSES,
+	COUNTER_DEPTH_FAILS,
+	COUNTER_PIXELS_COVERED,
+	COUNTER_BYTES_ALLOCATED,
+	COUNTER_MESH_BYTES,
+	COUNTER_COMPRESSED_BYTES,
+	COUNTER_DECOMPRESSED_BYTES,
+	COUNTER_MESHLETS,
+	COUNTER_MESHLETS_CULLED,
+	COUNTER_MESHLET_TRIANGLES_CULLED,
+	COUNTER_SUBPIXEL_TRIANGLES,
+	COUNTER_CACHE_HITS,
+	COUNTER_CACHE_MISSES,
+	COUNTER_BVH_NODES_VISITED,
+	COUNTER_TRIANGLES_SIMPLIFIED,
+	NUM_COUNTERS
+} Counter;
+
+// Nonzero if statistics should be collected, set once before rendering starts
+extern int32_t stats_enabled;
+
+/*
+ * Brackets a region of code that should be timed as the given stage. Both macros
+ * reduce to a single well-predicted branch when statistics are disabled.
+ */
+#define STATS_BEGIN(var) uint64_t var = stats_enabled ? stats_now() : 0
+#define STATS_END(stage, var) do { if (stats_enabled) stats_stage_add((stage), (var), stats_now()); } while (0)
+#define STATS_COUNT(counter, n) do { if (stats_enabled) stats_count((counter), (n)); } while (0)
+
+/*
+ * stats_now
+ *
+ * RETURN VALUE: the current value of the monotonic clock in nanoseconds
+ * SIDE EFFECTS: none
+ */
+extern uint64_t stats_now();
+
+/*
+ * stats_stage_add
+ *
+ * INPUTS: stage: the stage that was executing
+ *         start, end: the values of stats_now() when the stage started and finished
+ * SIDE EFFECTS: adds the elapsed time to the total for the stage
+ */
+extern void stats_stage_add(Stage stage, uint64_t start, uint64_t end);
+
+/*
+ * stats_count
+ *
+ * INPUTS: counter: the counter to increment
+ *         n: the amount to increment it by
+ * SIDE EFFECTS: increments the counter
+ */
+extern void stats_count(Counter counter, uint64_t n);
+
+/*
+ * stats_pipeline_stage
+ *
+ * INPUTS: name: the name of a stage of the pipeline
+ *         start: the time at which the stage started
+ *         first_item: the time at which the stage received its first triangle
+ *         end: the time at which the stage finished
+ *         wait_ns: the time that the stage spent waiting on its neighbours
+ *         items: the number of triangles that the stage passed on
+ * SIDE EFFECTS: records the utilization of the stage
+ */
+extern void stats_pipeline_stage(const char* name, uint64_t start, uint64_t first_item, uint64_t end, uint64_t wait_ns, uint64_t items);
+
+/*
+ * stats_write_json
+ *
+ * INPUTS: file: the path of the file to write the statistics to, or "-" for stdout
+ * RETURN VALUE: 1 if the file was written, 0 otherwise
+ * SIDE EFFECTS: writes the stage timings and counters as a JSON object
+ */
+extern int32_t stats_write_json(char* file);
+
+/*
+ * stats_write_trace
+ *
+ * INPUTS: file: the path of the file to write the trace to
+ * RETURN VALUE: 1 if the file was written, 0 otherwise
+ * SIDE EFFECTS: writes the stage timings and counters in the Chrome trace event format,
+ *               which can be loaded in chrome://tracing or Perfetto
+ */
+extern int32_t stats_write_trace(char* file);
+
+#endif